@@ -0,0 +1,96 @@
+// Throughput of async_file_backing_store against I/O depth.
+//
+// Writes a batch of objects and reads them back through the backing
+// store's asynchronous interface, keeping up to depth operations in
+// flight, for growing depths and with each I/O engine: io_uring (if
+// the kernel has it) and the thread pool.  Writes are fsynced one by
+// one unless write-behind mode is asked for, which is where depth
+// should help most; reads mostly come from the page cache.  The
+// first line is a one_file_per_object_backing_store, whose
+// asynchronous interface just does each operation synchronously.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/async_io_bench.cpp local/*.cpp
+//
+// Usage: async_io_bench [directory] [objects] [object-size] [max-depth]
+//                       [write-behind]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "include/backing_store.hpp"
+
+// Run nops operations through store with up to depth in flight, and
+// return how many finished per second.
+template<class Submit>
+static double pump(backing_store &store, uint64_t nops, uint64_t depth,
+		   Submit submit)
+{
+  std::vector<backing_store::io_completion> done;
+  uint64_t submitted = 0;
+  uint64_t finished = 0;
+  auto begin = std::chrono::steady_clock::now();
+  while (finished < nops) {
+    while (submitted < nops && submitted - finished < depth)
+      submit(submitted++);
+    done.clear();
+    store.poll(done, 1);
+    for (size_t i = 0; i < done.size(); i++)
+      if (done[i].block && done[i].block->size() == 0)
+	abort();
+    finished += done.size();
+  }
+  double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  return nops / t;
+}
+
+static void run(backing_store &store, const char *name, uint64_t depth,
+		uint64_t nobjects, const std::string &contents)
+{
+  for (uint64_t i = 0; i < nobjects; i++)
+    store.allocate(i, 1);
+  double writes = pump(store, nobjects, depth, [&](uint64_t i) {
+      store.submit_write(i, i, 1, contents);
+    });
+  store.sync();
+  double reads = pump(store, nobjects, depth, [&](uint64_t i) {
+      store.submit_read(i, i, 1);
+    });
+  for (uint64_t i = 0; i < nobjects; i++)
+    store.deallocate(i, 1);
+
+  std::cout << name << ", depth " << depth << ": " << writes << " writes/s, "
+	    << reads << " reads/s" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_async_io_bench";
+  uint64_t nobjects = argc > 2 ? strtoull(argv[2], NULL, 0) : 2048;
+  uint64_t size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1ULL << 16;
+  uint64_t max_depth = argc > 4 ? strtoull(argv[4], NULL, 0) : 64;
+  bool write_behind = argc > 5 && strtoull(argv[5], NULL, 0);
+
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+  std::string contents(size, 'x');
+
+  {
+    one_file_per_object_backing_store store(dir, write_behind);
+    run(store, "blocking", 1, nobjects, contents);
+  }
+  for (int uring = 1; uring >= 0; uring--) {
+    for (uint64_t depth = 1; depth <= max_depth; depth *= 2) {
+      async_file_backing_store store(dir, write_behind, depth, uring);
+      if (uring && store.get_io_engine() != async_file_backing_store::IO_URING) {
+	std::cout << "io_uring isn't available" << std::endl;
+	break;
+      }
+      run(store, uring ? "io_uring" : "thread pool", depth, nobjects, contents);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+// Backing store comparison.
+//
+// Runs the same insert workload against a one_file_per_object
+// backing store and a log_structured backing store, both in
+// write-behind mode with group-committed write-backs, and reports the
+// run time and how many files each one left in its directory.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/backing_store_bench.cpp local/*.cpp
+//
+// Usage: backing_store_bench [directory] [inserts] [cache-size]
+
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include "include/db-tree.hpp"
+
+static uint64_t count_files(const std::string &dir)
+{
+  uint64_t n = 0;
+  DIR *d = opendir(dir.c_str());
+  while (struct dirent *de = readdir(d))
+    if (de->d_name[0] != '.')
+      n++;
+  closedir(d);
+  return n;
+}
+
+static void run(const char *name, backing_store &store, const std::string &dir,
+		uint64_t ninserts, uint64_t cache_size)
+{
+  swap_space ss(&store, cache_size);
+  ss.set_write_group_size(64);
+  betree<uint64_t, std::string> b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  std::mt19937_64 rng(1);
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < ninserts; i++)
+    b.insert(rng(), "value-" + std::to_string(i));
+  ss.checkpoint();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << name << ": " << secs << " s, "
+	    << ninserts / secs << " inserts/s, "
+	    << count_files(dir) << " files" << std::endl;
+}
+
+static std::string fresh_directory(const std::string &dir)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+  return dir;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_backing_store_bench";
+  uint64_t ninserts = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 18;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 64;
+
+  {
+    one_file_per_object_backing_store store(fresh_directory(dir), true);
+    run("one file per object", store, dir, ninserts, cache_size);
+  }
+  {
+    log_structured_backing_store store(fresh_directory(dir), true, 1ULL << 24);
+    run("log structured", store, dir, ninserts, cache_size);
+  }
+  return 0;
+}
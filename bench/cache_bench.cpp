@@ -0,0 +1,59 @@
+// Node-access throughput against cache size.
+//
+// Builds a tree of small nodes on an in-memory backing store and then
+// runs random lookups and inserts with the swap_space cache set to a
+// range of sizes, from much smaller than the tree to larger than it.
+// Small caches stress victim selection and write-back; large ones
+// measure the per-access bookkeeping alone.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/cache_bench.cpp local/*.cpp
+//
+// Usage: cache_bench [keys] [max-node-size] [operations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include "include/db-tree.hpp"
+#include "bench/memory_backing_store.hpp"
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t nkeys = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 18;
+  uint64_t node_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 64;
+  uint64_t nops = argc > 3 ? strtoull(argv[3], NULL, 0) : 1ULL << 17;
+
+  for (uint64_t cache_size = 16; cache_size <= (1ULL << 16); cache_size *= 4) {
+    memory_backing_store store;
+    swap_space ss(&store, 1ULL << 20);
+    betree<uint64_t, std::string> b(&ss, node_size, node_size / 4, node_size / 16);
+    std::mt19937_64 rng(1);
+    for (uint64_t i = 0; i < nkeys; i++)
+      b.insert(rng() % (4 * nkeys), "value-" + std::to_string(i));
+    ss.set_cache_size(cache_size);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t found = 0;
+    for (uint64_t i = 0; i < nops; i++)
+      found += b.find(rng() % (4 * nkeys)) ? 1 : 0;
+    double lookups = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nops; i++)
+      b.insert(rng() % (4 * nkeys), "new-value");
+    double inserts = seconds_since(start);
+
+    std::cout << "cache " << cache_size << " nodes: "
+	      << nops / lookups << " lookups/s, "
+	      << nops / inserts << " inserts/s"
+	      << " (" << found << " found)" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Bytes written and CPU time per insert with each compression codec.
+//
+// Loads a tree of string keys with long shared prefixes (the way
+// hierarchical keys usually look) through a cache much smaller than
+// the tree, so that nodes are written back over and over, and then
+// looks up every key with the cache mostly cold.  For each codec it
+// reports the compression ratio of what was written back, the bytes
+// that reached the backing store per insert, and the CPU time of the
+// inserts and lookups, which includes compressing on write-back and
+// decompressing on misses.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/compression_bench.cpp local/*.cpp
+//
+// Usage: compression_bench [directory] [keys] [cache-size] [text]
+
+#include <ctime>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include "include/db-tree.hpp"
+
+typedef betree<std::string, std::string> tree;
+
+static std::string make_key(uint64_t i)
+{
+  return "tenant-" + std::to_string(i % 16) + "/region-us-east/users/" +
+    std::to_string(1000000 + i) + "/profile";
+}
+
+static void run(const std::string &dir, uint64_t nkeys, uint64_t cache_size,
+		serialization_format format, compression_codec codec,
+		const char *name, double &baseline)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store store(dir, true);
+  swap_space ss(&store, cache_size, format);
+  ss.set_write_group_size(64);
+  ss.set_compression(codec);
+  tree b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  std::mt19937_64 rng(1);
+
+  std::clock_t begin = std::clock();
+  for (uint64_t i = 0; i < nkeys; i++)
+    b.insert(make_key(rng() % nkeys), "value-" + std::to_string(i));
+  ss.checkpoint();
+  double insert_cpu = double(std::clock() - begin) / CLOCKS_PER_SEC;
+  swap_space::cache_stats stats = ss.get_cache_stats();
+
+  rng.seed(1);
+  begin = std::clock();
+  for (uint64_t i = 0; i < nkeys; i++)
+    b.find(make_key(rng() % nkeys));
+  double query_cpu = double(std::clock() - begin) / CLOCKS_PER_SEC;
+
+  double per_insert = double(stats.bytes_stored) / nkeys;
+  if (codec == NO_COMPRESSION)
+    baseline = per_insert;
+  std::cout << name << ": ratio "
+	    << double(stats.bytes_serialized) / stats.bytes_stored
+	    << ", " << per_insert << " bytes written per insert ("
+	    << 100 * (per_insert - baseline) / baseline << "%)"
+	    << ", inserts " << insert_cpu << " s CPU"
+	    << ", lookups " << query_cpu << " s CPU" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_compression_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 17;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 64;
+  serialization_format format = argc > 4 && strtoull(argv[4], NULL, 0) ?
+    TEXT_SERIALIZATION : BINARY_SERIALIZATION;
+
+  double baseline = 0;
+  run(dir, nkeys, cache_size, format, NO_COMPRESSION, "none", baseline);
+  run(dir, nkeys, cache_size, format, FAST_COMPRESSION, "fast", baseline);
+  run(dir, nkeys, cache_size, format, HIGH_COMPRESSION, "high", baseline);
+  return 0;
+}
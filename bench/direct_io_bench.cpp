@@ -0,0 +1,155 @@
+// Memory use and throughput of a tree on direct_file_backing_store
+// against one_file_per_object_backing_store's buffered I/O.
+//
+// Each run loads a tree bigger than memory in a child process, with
+// the swap_space limited to a byte budget, and then times a mix of
+// random lookups and updates.  It reports the process's resident set
+// and how much of the tree's files the kernel is caching, measured
+// with mincore(); with buffered I/O the latter is memory the
+// swap_space's budget doesn't account for.  The runs are buffered
+// I/O and direct I/O with the same budget, and then direct I/O with
+// the budget raised to the total memory, RSS plus page cache, that
+// the buffered run ended up using.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/direct_io_bench.cpp local/*.cpp
+//
+// Usage: direct_io_bench [directory] [keys] [value-size] [cache-MB]
+//                        [operations]
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "include/db-tree.hpp"
+
+typedef betree<uint64_t, std::string> tree;
+
+static uint64_t resident_bytes(void)
+{
+  uint64_t size = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL || fscanf(f, "%lu %lu", &size, &resident) != 2)
+    abort();
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Bytes of the files in dir that are in the page cache.
+static uint64_t page_cache_bytes(const std::string &dir)
+{
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t cached = 0;
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL)
+    abort();
+  std::vector<unsigned char> vec;
+  while (struct dirent *e = readdir(d)) {
+    std::string filename = dir + "/" + e->d_name;
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      if (fd >= 0)
+	close(fd);
+      continue;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      continue;
+    vec.resize((st.st_size + page - 1) / page);
+    if (mincore(addr, st.st_size, &vec[0]) == 0)
+      for (size_t i = 0; i < vec.size(); i++)
+	cached += (vec[i] & 1) * page;
+    munmap(addr, st.st_size);
+  }
+  closedir(d);
+  return cached;
+}
+
+// Run one configuration in a child process and return the total
+// memory it used.
+static uint64_t run(const std::string &dir, bool direct, uint64_t nkeys,
+		    uint64_t value_size, uint64_t budget, uint64_t nops)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    abort();
+  pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (pid == 0) {
+    close(fds[0]);
+    std::unique_ptr<backing_store> store;
+    if (direct)
+      store.reset(new direct_file_backing_store(dir, true));
+    else
+      store.reset(new one_file_per_object_backing_store(dir, true));
+    swap_space ss(store.get(), UINT64_MAX);
+    ss.set_cache_size_in_bytes(budget);
+    ss.set_write_group_size(64);
+    tree b(&ss, 1 << 8, 1 << 6, 1 << 4);
+    std::mt19937_64 rng(1);
+    for (uint64_t i = 0; i < nkeys; i++)
+      b.insert(rng() % nkeys, std::string(value_size, 'a' + i % 26));
+    ss.checkpoint();
+
+    auto begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nops; i++) {
+      if (i % 4 == 0)
+	b.insert(rng() % nkeys, std::string(value_size, 'A' + i % 26));
+      else
+	b.find(rng() % nkeys);
+    }
+    ss.checkpoint();
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    uint64_t rss = resident_bytes();
+    uint64_t cached = page_cache_bytes(dir);
+    std::cout << (direct ? "direct" : "buffered") << ", " << (budget >> 20)
+	      << "MB cache: " << nops / t << " ops/s, RSS " << (rss >> 20)
+	      << "MB, page cache " << (cached >> 20) << "MB, total "
+	      << ((rss + cached) >> 20) << "MB" << std::endl;
+    std::string total = std::to_string(rss + cached);
+    if (write(fds[1], total.data(), total.size()) != (ssize_t)total.size())
+      abort();
+    _exit(0);
+  }
+  close(fds[1]);
+  char buf[32] = {0};
+  if (::read(fds[0], buf, sizeof(buf) - 1) <= 0)
+    abort();
+  close(fds[0]);
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    abort();
+  return strtoull(buf, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_direct_io_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 18;
+  uint64_t value_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 256;
+  uint64_t budget = (argc > 4 ? strtoull(argv[4], NULL, 0) : 32) << 20;
+  uint64_t nops = argc > 5 ? strtoull(argv[5], NULL, 0) : 1ULL << 16;
+
+  uint64_t total = run(dir, false, nkeys, value_size, budget, nops);
+  run(dir, true, nkeys, value_size, budget, nops);
+  run(dir, true, nkeys, value_size, total, nops);
+  return 0;
+}
@@ -0,0 +1,48 @@
+// Flush cost as a function of node fanout.
+//
+// Inserts the same stream of random keys into trees with increasing
+// maximum node sizes (and hence increasing fanout and buffer sizes)
+// and reports the average cost per insert.  Keys are inserted in
+// small unsorted batches, which span several children and so are
+// buffered in internal nodes and later flushed, rather than going
+// straight down to a dirty child.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/flush_bench.cpp local/*.cpp
+//
+// Usage: flush_bench [messages] [batch-size]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "include/db-tree.hpp"
+#include "bench/memory_backing_store.hpp"
+
+int main(int argc, char **argv)
+{
+  uint64_t nmessages = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 20;
+  uint64_t batch_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 16;
+
+  for (uint64_t node_size = 1ULL << 8; node_size <= 1ULL << 16; node_size <<= 2) {
+    memory_backing_store store;
+    swap_space ss(&store, 1ULL << 40);
+    betree<uint64_t, uint64_t> b(&ss, node_size, node_size / 4, node_size / 16);
+    std::mt19937_64 rng(1);
+
+    std::vector<std::pair<uint64_t, uint64_t> > batch;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nmessages; i += batch_size) {
+      batch.clear();
+      for (uint64_t j = 0; j < batch_size; j++)
+	batch.push_back(std::make_pair(rng(), i + j));
+      b.insert_batch(batch.begin(), batch.end());
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "max node size " << node_size
+	      << ": " << 1e6 * secs / nmessages << " us/insert" << std::endl;
+  }
+  return 0;
+}
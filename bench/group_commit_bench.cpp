@@ -0,0 +1,64 @@
+// Eviction cost with and without group commit.
+//
+// Runs the same insert workload against a one_file_per_object
+// backing store twice: once fsyncing every write-back, and once in
+// write-behind mode with the swap_space syncing in groups.  The cache
+// is kept small so that most inserts trigger evictions, and the
+// per-insert latency distribution shows what the eviction costs the
+// foreground thread.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/group_commit_bench.cpp local/*.cpp
+//
+// Usage: group_commit_bench [directory] [inserts] [group-size]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "include/db-tree.hpp"
+
+static void run(const std::string &dir, uint64_t ninserts, uint64_t group_size)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store store(dir, group_size > 1);
+  swap_space ss(&store, 8);
+  ss.set_write_group_size(group_size);
+  betree<uint64_t, std::string> b(&ss, 1 << 10, 1 << 8, 1 << 6);
+  std::mt19937_64 rng(1);
+
+  std::vector<double> latencies;
+  latencies.reserve(ninserts);
+  auto begin = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < ninserts; i++) {
+    auto start = std::chrono::steady_clock::now();
+    b.insert(rng(), "value-" + std::to_string(i));
+    latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  ss.checkpoint();
+  double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << "group size " << group_size
+	    << ": total " << total << " s"
+	    << " p50 " << 1e6 * latencies[latencies.size() / 2] << " us"
+	    << " p99 " << 1e6 * latencies[latencies.size() * 99 / 100] << " us"
+	    << " max " << 1e6 * latencies.back() << " us" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_group_commit_bench";
+  uint64_t ninserts = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 16;
+  uint64_t group_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 64;
+
+  run(dir, ninserts, 1);
+  run(dir, ninserts, group_size);
+  return 0;
+}
@@ -0,0 +1,51 @@
+// A backing_store that keeps every object version in a std::string,
+// so that benchmarks can measure CPU costs without disk I/O getting in
+// the way.
+
+#ifndef MEMORY_BACKING_STORE_HPP
+#define MEMORY_BACKING_STORE_HPP
+
+#include <map>
+#include <sstream>
+#include <string>
+#include "include/backing_store.hpp"
+
+class memory_backing_store : public backing_store {
+public:
+  class object_stream : public std::stringstream {
+  public:
+    object_stream(uint64_t id, uint64_t v, const std::string &contents)
+      : std::stringstream(contents),
+	obj_id(id),
+	version(v)
+    {}
+    uint64_t obj_id;
+    uint64_t version;
+  };
+
+  void allocate(uint64_t obj_id, uint64_t version) {
+    objects[std::make_pair(obj_id, version)] = std::string();
+  }
+
+  void deallocate(uint64_t obj_id, uint64_t version) {
+    objects.erase(std::make_pair(obj_id, version));
+  }
+
+  std::iostream * get(uint64_t obj_id, uint64_t version) {
+    return new object_stream(obj_id, version,
+			     objects[std::make_pair(obj_id, version)]);
+  }
+
+  void put(std::iostream *ios) {
+    object_stream *os = (object_stream *)ios;
+    std::string &contents = objects[std::make_pair(os->obj_id, os->version)];
+    contents = os->str();
+    last_put_size = contents.size();
+    delete os;
+  }
+
+  std::map<std::pair<uint64_t, uint64_t>, std::string> objects;
+  uint64_t last_put_size = 0;
+};
+
+#endif // MEMORY_BACKING_STORE_HPP
@@ -0,0 +1,84 @@
+// Compares the std::map and flat sorted-array node layouts.
+//
+// For each layout, loads a fully cached tree with random keys using
+// batched inserts, then reports heap bytes per message (via glibc's
+// mallinfo2), batched and single-message insert throughput, and
+// point-lookup throughput.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/node_layout_bench.cpp local/*.cpp
+//
+// Usage: node_layout_bench [messages] [max-node-size] [batch-size]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+#include <random>
+#include <vector>
+#include "include/db-tree.hpp"
+#include "bench/memory_backing_store.hpp"
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<class Layout>
+static void run(const char *name, uint64_t nmessages, uint64_t node_size,
+		uint64_t batch_size)
+{
+  memory_backing_store store;
+  // Big enough that nothing is ever evicted.
+  swap_space ss(&store, 1ULL << 40);
+  std::mt19937_64 rng(1);
+
+  size_t heap_before = mallinfo2().uordblks;
+  betree<uint64_t, uint64_t, Layout> b(&ss, node_size, node_size / 4,
+				       node_size / 16);
+
+  std::vector<std::pair<uint64_t, uint64_t> > batch;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < nmessages; i += batch_size) {
+    batch.clear();
+    for (uint64_t j = i; j < std::min(nmessages, i + batch_size); j++)
+      batch.push_back(std::make_pair(rng(), j));
+    std::sort(batch.begin(), batch.end());
+    b.insert_batch(batch.begin(), batch.end());
+  }
+  double batch_secs = seconds_since(start);
+  size_t heap_after = mallinfo2().uordblks;
+
+  uint64_t nsingle = nmessages / 16;
+  start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < nsingle; i++)
+    b.insert(rng(), i);
+  double single_secs = seconds_since(start);
+
+  uint64_t nlookups = nmessages;
+  uint64_t found = 0;
+  std::mt19937_64 replay(1);
+  start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < nlookups; i++)
+    found += b.find(i % 2 ? replay() : rng()).has_value();
+  double lookup_secs = seconds_since(start);
+
+  std::cout << name
+	    << ": bytes/message " << (double)(heap_after - heap_before) / nmessages
+	    << " batched inserts " << nmessages / batch_secs / 1e6 << " M/s"
+	    << " single inserts " << nsingle / single_secs / 1e6 << " M/s"
+	    << " lookups " << nlookups / lookup_secs / 1e6 << " M/s"
+	    << " (" << found << " hits)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t nmessages = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 21;
+  uint64_t node_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 14;
+  uint64_t batch_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1ULL << 12;
+
+  run<map_node_layout>("std::map", nmessages, node_size, batch_size);
+  run<flat_node_layout>("flat", nmessages, node_size, batch_size);
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Cold-read latency of the stream and block read paths.
+//
+// Loads a tree into a one_file_per_object_backing_store, shrinks the
+// cache so that almost every lookup misses on its leaf, and times
+// random lookups three ways:
+//
+//   stream    every miss reads the node out of the fstream the
+//             store's get() returns, as all reads used to, and then
+//             deserializes the copy
+//   mapped    misses map the node's file with the store's read() and
+//             deserialize from the mapping in place
+//   retained  as mapped, with every leaf's image retained, so that
+//             reloading an evicted leaf doesn't touch the store
+//
+// The files stay in the page cache throughout, so this measures the
+// software cost of a miss rather than the disk.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/read_path_bench.cpp local/*.cpp
+//
+// Usage: read_path_bench [directory] [keys] [value-size] [lookups]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include "include/db-tree.hpp"
+
+typedef betree<uint64_t, std::string> tree;
+
+// Forwards everything but read(), so that the default read() copies
+// every version out of get()'s stream.
+class stream_backing_store : public backing_store {
+public:
+  stream_backing_store(backing_store *bs) : store(bs) {}
+  void allocate(uint64_t obj_id, uint64_t version) { store->allocate(obj_id, version); }
+  void deallocate(uint64_t obj_id, uint64_t version) { store->deallocate(obj_id, version); }
+  std::iostream * get(uint64_t obj_id, uint64_t version) { return store->get(obj_id, version); }
+  void put(std::iostream *ios) { store->put(ios); }
+  void sync(void) { store->sync(); }
+
+private:
+  backing_store *store;
+};
+
+static void run(const std::string &dir, uint64_t nkeys, uint64_t value_size,
+		uint64_t nlookups, const char *mode)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store files(dir, true);
+  stream_backing_store streams(&files);
+  bool stream = std::string(mode) == "stream";
+  swap_space ss(stream ? (backing_store *)&streams : &files, 1024);
+  ss.set_write_group_size(64);
+  tree b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  for (uint64_t i = 0; i < nkeys; i++)
+    b.insert(i, std::string(value_size, 'a' + i % 26));
+  ss.set_cache_size(8);
+  ss.checkpoint();
+  if (std::string(mode) == "retained")
+    ss.set_retained_leaf_images(nkeys);
+  ss.reset_cache_stats();
+
+  std::mt19937_64 rng(1);
+  auto begin = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < nlookups; i++)
+    b.find(rng() % nkeys);
+  double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  swap_space::cache_stats stats = ss.get_cache_stats();
+
+  std::cout << mode << ": " << 1e6 * t / nlookups << " us per lookup, "
+	    << double(stats.misses) / nlookups << " misses per lookup, "
+	    << 1e6 * t / stats.misses << " us per miss";
+  if (stats.image_loads)
+    std::cout << " (" << stats.image_loads << " from retained images)";
+  std::cout << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_read_path_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 16;
+  uint64_t value_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 100;
+  uint64_t nlookups = argc > 4 ? strtoull(argv[4], NULL, 0) : 1ULL << 14;
+
+  run(dir, nkeys, value_size, nlookups, "stream");
+  run(dir, nkeys, value_size, nlookups, "mapped");
+  run(dir, nkeys, value_size, nlookups, "retained");
+  return 0;
+}
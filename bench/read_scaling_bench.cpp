@@ -0,0 +1,92 @@
+// Lookup throughput of a concurrent tree as reader threads are added.
+//
+// Loads a tree, switches it to concurrent mode, and then runs 1, 2,
+// 4, ... reader threads doing random find()s for a fixed time each,
+// optionally alongside one writer thread doing upserts.  Readers
+// share latches on their root-to-leaf paths and mostly re-pin nodes
+// without taking the cache lock, so throughput should grow with the
+// number of cores until the writer, or misses in a small cache,
+// start to serialize them.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/read_scaling_bench.cpp local/*.cpp
+//
+// Usage: read_scaling_bench [directory] [keys] [cache-size]
+//                           [max-threads] [seconds] [writer]
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "include/db-tree.hpp"
+
+typedef betree<uint64_t, std::string> tree;
+
+static void run(tree &b, uint64_t nkeys, uint64_t nthreads, double seconds,
+		bool writer)
+{
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> lookups(0);
+  std::atomic<uint64_t> upserts(0);
+  std::vector<std::thread> threads;
+
+  for (uint64_t t = 0; t < nthreads; t++)
+    threads.emplace_back([&, t]() {
+	std::mt19937_64 rng(t + 1);
+	uint64_t n = 0;
+	while (!stop) {
+	  b.find(rng() % nkeys);
+	  n++;
+	}
+	lookups += n;
+      });
+  if (writer)
+    threads.emplace_back([&]() {
+	std::mt19937_64 rng(0);
+	uint64_t n = 0;
+	while (!stop) {
+	  b.insert(rng() % nkeys, "update-" + std::to_string(n));
+	  n++;
+	}
+	upserts += n;
+      });
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (auto &t : threads)
+    t.join();
+
+  std::cout << nthreads << " readers: " << lookups / seconds << " lookups/s";
+  if (writer)
+    std::cout << ", " << upserts / seconds << " upserts/s";
+  std::cout << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_read_scaling_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 17;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1024;
+  uint64_t max_threads = argc > 4 ? strtoull(argv[4], NULL, 0) : 8;
+  double seconds = argc > 5 ? strtod(argv[5], NULL) : 2;
+  bool writer = argc > 6 ? strtoull(argv[6], NULL, 0) != 0 : false;
+
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store store(dir, true);
+  swap_space ss(&store, cache_size);
+  tree b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  for (uint64_t i = 0; i < nkeys; i++)
+    b.insert(i, "value-" + std::to_string(i));
+  b.set_concurrent(true);
+
+  for (uint64_t t = 1; t <= max_threads; t *= 2)
+    run(b, nkeys, t, seconds, writer);
+  return 0;
+}
@@ -0,0 +1,81 @@
+// Recovery time of a persistent tree against the length of its log.
+//
+// For each count, a child process opens a fresh tree with
+// betree::open(), upserts that many random keys with checkpointing
+// effectively disabled, and exits without closing the tree, as if it
+// had crashed.  The parent then times reopening it, which loads the
+// last checkpoint, replays the whole log and checkpoints again.
+// Recovery time should grow about linearly with the log, and the
+// upsert rate shows what logging each upsert durably costs with the
+// given log group size.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/recovery_bench.cpp local/*.cpp
+//
+// Usage: recovery_bench [directory] [max-upserts] [cache-size]
+//                       [log-group-size]
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include "include/db-tree.hpp"
+
+typedef betree<uint64_t, std::string> tree;
+
+static void run(const std::string &dir, uint64_t nupserts, uint64_t cache_size,
+		uint64_t group_size)
+{
+  std::string cmd = "rm -rf " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (pid == 0) {
+    std::unique_ptr<tree> b = tree::open(dir, cache_size, 1 << 8, 1 << 6, 1 << 4);
+    b->set_checkpoint_interval(~0ULL);
+    b->set_log_group_size(group_size);
+    std::mt19937_64 rng(1);
+    auto begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nupserts; i++)
+      b->insert(rng() % (4 * nupserts), "value-" + std::to_string(i));
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << nupserts << " upserts: " << nupserts / t << " upserts/s";
+    std::cout.flush();
+    // Crash.
+    _exit(0);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    abort();
+
+  struct stat st;
+  uint64_t log_bytes = 0;
+  for (uint64_t n = 0; n < 4; n++)
+    if (stat((dir + "/log." + std::to_string(n)).c_str(), &st) == 0)
+      log_bytes += st.st_size;
+
+  auto begin = std::chrono::steady_clock::now();
+  std::unique_ptr<tree> b = tree::open(dir, cache_size);
+  double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  std::cout << ", " << log_bytes << " bytes of log recovered in " << t << " s"
+	    << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_recovery_bench";
+  uint64_t max_upserts = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 16;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1024;
+  uint64_t group_size = argc > 4 ? strtoull(argv[4], NULL, 0) : 64;
+
+  for (uint64_t n = 1ULL << 12; n <= max_upserts; n *= 2)
+    run(dir, n, cache_size, group_size);
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Cache hit rates of the replacement policies under scans.
+//
+// Loads a tree of small nodes on an in-memory backing store, then
+// alternates batches of point queries, most of which go to a hot key
+// range, with full scans of the tree.  Under LRU every scan flushes
+// the hot nodes from the cache; scan-resistant policies should keep
+// them.  Reports the hit rate of the point queries alone and of
+// everything, for each policy with and without internal nodes being
+// favored.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/replacement_bench.cpp local/*.cpp
+//
+// Usage: replacement_bench [keys] [max-node-size] [cache-size] [rounds]
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include "include/db-tree.hpp"
+#include "bench/memory_backing_store.hpp"
+
+static double hit_rate(const swap_space::cache_stats &stats)
+{
+  return 100.0 * stats.hits / (stats.hits + stats.misses);
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t nkeys = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 17;
+  uint64_t node_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 64;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 512;
+  uint64_t rounds = argc > 4 ? strtoull(argv[4], NULL, 0) : 20;
+  uint64_t queries_per_round = 500;
+
+  const char *names[] = { "LRU", "2Q", "ARC" };
+  replacement_policy_kind kinds[] = { LRU_REPLACEMENT, TWO_Q_REPLACEMENT, ARC_REPLACEMENT };
+
+  for (int k = 0; k < 3; k++) {
+    for (int favor = 0; favor < 2; favor++) {
+      memory_backing_store store;
+      swap_space ss(&store, cache_size);
+      ss.set_replacement_policy(kinds[k], favor);
+      betree<uint64_t, std::string> b(&ss, node_size, node_size / 4, node_size / 16);
+      std::mt19937_64 rng(1);
+      for (uint64_t i = 0; i < nkeys; i++)
+	b.insert(rng() % (4 * nkeys), "value-" + std::to_string(i));
+
+      // The hot range is 1/32 of the key space.
+      uint64_t hot_keys = 4 * nkeys / 32;
+      swap_space::cache_stats query_stats;
+      ss.reset_cache_stats();
+      for (uint64_t r = 0; r < rounds; r++) {
+	swap_space::cache_stats before = ss.get_cache_stats();
+	for (uint64_t i = 0; i < queries_per_round; i++) {
+	  uint64_t key = rng() % 10 ? rng() % hot_keys : rng() % (4 * nkeys);
+	  b.find(key);
+	}
+	query_stats.hits += ss.get_cache_stats().hits - before.hits;
+	query_stats.misses += ss.get_cache_stats().misses - before.misses;
+
+	for (auto it = b.begin(); it != b.end(); ++it)
+	  ;
+      }
+
+      std::cout << names[k] << (favor ? " favoring internal nodes" : "")
+		<< ": point queries " << hit_rate(query_stats) << "% hits, "
+		<< "overall " << hit_rate(ss.get_cache_stats()) << "% hits"
+		<< std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Range-scan throughput benchmark.
+//
+// Loads a tree with random keys (a mix of inserts and updates, so that
+// messages for the same key are spread over several levels) and then
+// measures full scans and short range scans starting at random keys.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/scan_bench.cpp local/*.cpp
+//
+// Usage: scan_bench [keys] [max-node-size] [cache-size] [range-length]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "include/db-tree.hpp"
+#include "bench/memory_backing_store.hpp"
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t nkeys = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 18;
+  uint64_t node_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 12;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1ULL << 10;
+  uint64_t range_len = argc > 4 ? strtoull(argv[4], NULL, 0) : 100;
+
+  memory_backing_store store;
+  swap_space ss(&store, cache_size);
+  betree<uint64_t, std::string> b(&ss, node_size, node_size / 4, node_size / 16);
+
+  srand(1);
+  for (uint64_t i = 0; i < nkeys; i++) {
+    uint64_t k = rand() % (4 * nkeys);
+    if (i % 4 == 3)
+      b.update(k, "u");
+    else
+      b.insert(k, "value-" + std::to_string(i));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t nscanned = 0;
+  for (auto it = b.begin(); it != b.end(); ++it)
+    nscanned++;
+  double full = seconds_since(start);
+  std::cout << "full scan: " << nscanned << " keys in " << full << " s, "
+	    << nscanned / full / 1e6 << " Mkeys/s" << std::endl;
+
+  int nranges = 1000;
+  nscanned = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < nranges; i++) {
+    auto it = b.lower_bound(rand() % (4 * nkeys));
+    for (uint64_t j = 0; j < range_len && it != b.end(); j++, ++it)
+      nscanned++;
+  }
+  double ranges = seconds_since(start);
+  std::cout << "range scans: " << nranges << " x " << range_len << " keys in "
+	    << ranges << " s, " << nscanned / ranges / 1e6 << " Mkeys/s"
+	    << std::endl;
+  return 0;
+}
@@ -0,0 +1,63 @@
+// Round-trip benchmark for the node serialization formats.
+//
+// Builds a single-leaf betree holding a large message buffer and then
+// forces the leaf to be evicted and reloaded over and over again, so
+// that every iteration pays one serialize and one deserialize of the
+// node.  Objects are kept in an in-memory backing store so that the
+// numbers reflect CPU cost rather than disk I/O.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/serialization_bench.cpp local/*.cpp
+//
+// Usage: serialization_bench [messages-per-node] [rounds]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "include/db-tree.hpp"
+#include "bench/memory_backing_store.hpp"
+
+static double run(serialization_format fmt, uint64_t nmessages, int rounds,
+		  uint64_t &node_bytes)
+{
+  memory_backing_store store;
+  swap_space ss(&store, 1, fmt);
+  betree<uint64_t, std::string> big(&ss, 4 * nmessages, nmessages, nmessages);
+  for (uint64_t i = 0; i < nmessages; i++)
+    big.insert(i * 7919 % nmessages, "value-" + std::to_string(i));
+
+  // Allocating the second tree evicts the root of the first one.
+  betree<uint64_t, std::string> small(&ss);
+  small.insert(0, "x");
+  node_bytes = store.last_put_size;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    big.query(i % nmessages);   // deserialize big, evict small
+    small.query(0);             // deserialize small, evict big
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t nmessages = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 16;
+  int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+  const char *names[] = { "text", "binary" };
+  serialization_format fmts[] = { TEXT_SERIALIZATION, BINARY_SERIALIZATION };
+  for (int f = 0; f < 2; f++) {
+    uint64_t node_bytes = 0;
+    double secs = run(fmts[f], nmessages, rounds, node_bytes);
+    std::cout << names[f]
+	      << ": messages/node " << nmessages
+	      << " node bytes " << node_bytes
+	      << " round trips " << rounds
+	      << " ms/round trip " << 1000.0 * secs / rounds
+	      << " Mmsg/s " << nmessages * rounds / secs / 1e6
+	      << std::endl;
+  }
+  return 0;
+}
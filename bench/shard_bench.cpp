@@ -0,0 +1,129 @@
+// Throughput of a sharded_betree as its shards are split, in process
+// and over the Unix-socket transport.
+//
+// Loads keys into a router with a single shard, then runs a mix of
+// random upserts and lookups from several threads, splitting the
+// hottest shard between rounds (the new shards going to the nodes in
+// turn) until there are max-shards of them, and timing each round.
+// Every round ends with a full scan, merged from all the shards.  It
+// does this once with both nodes in this process and once with the
+// second node a shard_server in a child process, so that half of the
+// shards are reached through socket_transport.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/shard_bench.cpp local/*.cpp
+//
+// Usage: shard_bench [directory] [keys] [operations] [threads]
+//                    [max-shards]
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "include/sharded_betree.hpp"
+
+typedef sharded_betree<uint64_t, std::string> router;
+typedef shard_host<uint64_t, std::string> host;
+
+static double seconds_since(std::chrono::steady_clock::time_point begin)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static void run(const char *name, shard_transport<uint64_t, std::string> *nodes[2],
+		uint64_t nkeys, uint64_t nops, uint64_t nthreads, uint64_t max_shards)
+{
+  router t(nodes[0]);
+  std::mt19937_64 rng(1);
+  for (uint64_t i = 0; i < nkeys; i++)
+    t.insert(rng() % nkeys, std::string(64, 'a' + i % 26));
+
+  for (uint64_t round = 0; ; round++) {
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < nthreads; i++)
+      threads.emplace_back([&, i]() {
+	  std::mt19937_64 r(round * nthreads + i);
+	  for (uint64_t j = 0; j < nops / nthreads; j++) {
+	    if (j % 2)
+	      t.update(r() % nkeys, "x");
+	    else
+	      t.find(r() % nkeys);
+	  }
+	});
+    for (auto &th : threads)
+      th.join();
+    double ops = nops / seconds_since(begin);
+
+    begin = std::chrono::steady_clock::now();
+    uint64_t scanned = 0;
+    for (auto it = t.begin(); it != t.end(); ++it)
+      scanned++;
+    double scan = scanned / seconds_since(begin);
+
+    std::cout << name << ", " << t.shard_count() << " shards: " << ops
+	      << " ops/s, scan " << scan << " pairs/s" << std::endl;
+    if (t.shard_count() >= max_shards ||
+	!t.split(t.hottest_shard(), nodes[(round + 1) % 2]))
+      break;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_shard_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 17;
+  uint64_t nops = argc > 3 ? strtoull(argv[3], NULL, 0) : 1ULL << 17;
+  uint64_t nthreads = argc > 4 ? strtoull(argv[4], NULL, 0) : 4;
+  uint64_t max_shards = argc > 5 ? strtoull(argv[5], NULL, 0) : 8;
+
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  {
+    host a(dir + "/local-a", 256, 1 << 8, 1 << 6, 1 << 4);
+    host b(dir + "/local-b", 256, 1 << 8, 1 << 6, 1 << 4);
+    shard_transport<uint64_t, std::string> *nodes[2] = { &a, &b };
+    run("in process", nodes, nkeys, nops, nthreads, max_shards);
+  }
+
+  std::string path = dir + "/socket";
+  int fds[2];
+  if (pipe(fds) != 0)
+    abort();
+  pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (pid == 0) {
+    close(fds[0]);
+    host remote(dir + "/remote", 256, 1 << 8, 1 << 6, 1 << 4);
+    shard_server<uint64_t, std::string> server(&remote, path);
+    if (write(fds[1], "", 1) != 1)
+      abort();
+    // Until the parent kills us.
+    pause();
+    _exit(0);
+  }
+  close(fds[1]);
+  char ready;
+  if (::read(fds[0], &ready, 1) != 1)
+    abort();
+  close(fds[0]);
+  {
+    host a(dir + "/local-a2", 256, 1 << 8, 1 << 6, 1 << 4);
+    socket_transport<uint64_t, std::string> b(path);
+    shard_transport<uint64_t, std::string> *nodes[2] = { &a, &b };
+    run("one node over a socket", nodes, nkeys, nops, nthreads, max_shards);
+  }
+  kill(pid, SIGTERM);
+  int status;
+  waitpid(pid, &status, 0);
+  return 0;
+}
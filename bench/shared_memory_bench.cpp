@@ -0,0 +1,123 @@
+// Node store and load rates of shared_memory_backing_store against
+// one_file_per_object_backing_store.
+//
+// Stores a batch of node-sized objects the way the swap_space writes
+// them back (allocate(), then get(), write and put()), twice, timing
+// the second time.  Then it loads each of them with read() and sums
+// its bytes, and loads them all again from a child process that
+// attaches to the store on its own, the way a query worker would
+// pick up what an ingest worker wrote.  The file store runs in
+// write-behind mode and is synced only outside the timed parts, so
+// neither store pays for durability.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/shared_memory_bench.cpp local/*.cpp
+//
+// Usage: shared_memory_bench [directory] [objects] [object-size]
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "include/backing_store.hpp"
+
+static double seconds_since(std::chrono::steady_clock::time_point begin)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// Returns loads per second.
+static double load_all(backing_store &store, uint64_t nobjects)
+{
+  uint64_t sum = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < nobjects; i++) {
+    std::shared_ptr<stored_block> block = store.read(i, 1);
+    for (size_t j = 0; j < block->size(); j += 64)
+      sum += (unsigned char)block->data()[j];
+  }
+  double t = seconds_since(begin);
+  if (sum == 0)
+    abort();
+  return nobjects / t;
+}
+
+static void run(const char *name, std::function<backing_store *(bool)> open,
+		uint64_t nobjects, uint64_t size)
+{
+  std::unique_ptr<backing_store> store(open(true));
+  std::string contents(size, 'x');
+
+  // The first pass is a warm-up, so that the shared-memory segment's
+  // pages have been touched, as they would be in a running system.
+  double stores = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass > 0)
+      for (uint64_t i = 0; i < nobjects; i++)
+	store->deallocate(i, 1);
+    auto begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nobjects; i++) {
+      store->allocate(i, 1);
+      std::iostream *out = store->get(i, 1);
+      out->write(contents.data(), contents.size());
+      store->put(out);
+    }
+    stores = nobjects / seconds_since(begin);
+    store->sync();
+  }
+  double loads = load_all(*store, nobjects);
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    abort();
+  pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (pid == 0) {
+    std::unique_ptr<backing_store> attached(open(false));
+    double rate = load_all(*attached, nobjects);
+    if (write(fds[1], &rate, sizeof(rate)) != sizeof(rate))
+      abort();
+    _exit(0);
+  }
+  double other = 0;
+  int status;
+  if (::read(fds[0], &other, sizeof(other)) != sizeof(other) ||
+      waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    abort();
+  close(fds[0]);
+  close(fds[1]);
+
+  for (uint64_t i = 0; i < nobjects; i++)
+    store->deallocate(i, 1);
+  std::cout << name << ": " << stores << " stores/s, " << loads << " loads/s, "
+	    << other << " loads/s from another process" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_shared_memory_bench";
+  uint64_t nobjects = argc > 2 ? strtoull(argv[2], NULL, 0) : 4096;
+  uint64_t size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1ULL << 16;
+
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+  run("one file per object", [&](bool) {
+      return new one_file_per_object_backing_store(dir, true);
+    }, nobjects, size);
+
+  std::string name = "betree_shared_memory_bench";
+  shared_memory_backing_store::remove(name);
+  uint64_t segment_size = 2 * nobjects * (size + 1024) + (1ULL << 20);
+  run("shared memory", [&](bool create) {
+      return new shared_memory_backing_store(name, create ? segment_size : 0);
+    }, nobjects, size);
+  shared_memory_backing_store::remove(name);
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Upsert throughput of a concurrent tree while snapshots of it are
+// scanned.
+//
+// Loads a tree, then runs writer threads upserting random keys for a
+// fixed time, first alone and then alongside a thread that keeps
+// taking a snapshot, scanning all of it and releasing it.  Scans of
+// a snapshot take no latches, so writers never wait for them; the
+// cost to writers is copying each node the first time they write to
+// it after a snapshot, and the extra cache pressure of the old
+// versions the scan is still using.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/snapshot_bench.cpp local/*.cpp
+//
+// Usage: snapshot_bench [directory] [keys] [cache-size] [writers]
+//                       [seconds]
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "include/db-tree.hpp"
+
+typedef betree<uint64_t, std::string> tree;
+
+static void run(tree &b, uint64_t nkeys, uint64_t nwriters, double seconds,
+		bool scan)
+{
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> upserts(0);
+  uint64_t scans = 0;
+  uint64_t scanned = 0;
+  std::vector<std::thread> threads;
+
+  for (uint64_t t = 0; t < nwriters; t++)
+    threads.emplace_back([&, t]() {
+	std::mt19937_64 rng(t + 1);
+	uint64_t n = 0;
+	while (!stop) {
+	  b.insert(rng() % nkeys, "update-" + std::to_string(n));
+	  n++;
+	}
+	upserts += n;
+      });
+  if (scan)
+    threads.emplace_back([&]() {
+	while (!stop) {
+	  tree::snapshot_handle s = b.snapshot();
+	  for (auto it = s.begin(); it != s.end(); ++it)
+	    scanned++;
+	  scans++;
+	}
+      });
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (auto &t : threads)
+    t.join();
+
+  std::cout << nwriters << " writers" << (scan ? ", scanning snapshots" : "")
+	    << ": " << upserts / seconds << " upserts/s";
+  if (scan)
+    std::cout << ", " << scans << " scans, " << scanned / seconds << " keys/s";
+  std::cout << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_snapshot_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 17;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1024;
+  uint64_t nwriters = argc > 4 ? strtoull(argv[4], NULL, 0) : 2;
+  double seconds = argc > 5 ? strtod(argv[5], NULL) : 2;
+
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store store(dir, true);
+  swap_space ss(&store, cache_size);
+  tree b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  for (uint64_t i = 0; i < nkeys; i++)
+    b.insert(i, "value-" + std::to_string(i));
+  b.set_concurrent(true);
+
+  run(b, nkeys, nwriters, seconds, false);
+  run(b, nkeys, nwriters, seconds, true);
+  return 0;
+}
@@ -0,0 +1,87 @@
+// Upsert throughput of a concurrent tree as writer threads are added.
+//
+// Runs 1, 2, 4, ... writer threads upserting random keys into a fresh
+// concurrent tree for a fixed time each.  Every upsert goes through
+// the root, but a writer only holds the root's latch while its
+// messages go into the root's buffer and the children that might
+// split are flushed; flushes into the rest of the tree run after it
+// lets go, so writers headed into different subtrees overlap.  How
+// far that scales depends on how often the root fills up and on the
+// number of cores.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/write_scaling_bench.cpp local/*.cpp
+//
+// Usage: write_scaling_bench [directory] [key-range] [cache-size]
+//                            [max-threads] [seconds] [batch-size]
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "include/db-tree.hpp"
+
+typedef betree<uint64_t, std::string> tree;
+
+static void run(const std::string &dir, uint64_t nkeys, uint64_t cache_size,
+		uint64_t nthreads, double seconds, uint64_t batch_size)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store store(dir, true);
+  swap_space ss(&store, cache_size);
+  tree b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  b.set_concurrent(true);
+
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> upserts(0);
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < nthreads; t++)
+    threads.emplace_back([&, t]() {
+	std::mt19937_64 rng(t + 1);
+	std::vector<std::pair<uint64_t, std::string> > batch;
+	uint64_t n = 0;
+	while (!stop) {
+	  if (batch_size <= 1) {
+	    b.insert(rng() % nkeys, "value-" + std::to_string(n));
+	    n++;
+	    continue;
+	  }
+	  batch.clear();
+	  for (uint64_t i = 0; i < batch_size; i++)
+	    batch.push_back(std::make_pair(rng() % nkeys, "value-" + std::to_string(n + i)));
+	  b.insert_batch(batch.begin(), batch.end());
+	  n += batch_size;
+	}
+	upserts += n;
+      });
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (auto &t : threads)
+    t.join();
+  b.set_concurrent(false);
+
+  std::cout << nthreads << " writers: " << upserts / seconds << " upserts/s"
+	    << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_write_scaling_bench";
+  uint64_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 20;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1024;
+  uint64_t max_threads = argc > 4 ? strtoull(argv[4], NULL, 0) : 8;
+  double seconds = argc > 5 ? strtod(argv[5], NULL) : 2;
+  uint64_t batch_size = argc > 6 ? strtoull(argv[6], NULL, 0) : 1;
+
+  for (uint64_t t = 1; t <= max_threads; t *= 2)
+    run(dir, nkeys, cache_size, t, seconds, batch_size);
+  return 0;
+}
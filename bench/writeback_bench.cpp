@@ -0,0 +1,74 @@
+// Insert latency with and without background write-back.
+//
+// Runs the same mix of inserts and lookups against a
+// one_file_per_object backing store, which fsyncs every write, with a
+// cache small enough that operations keep evicting nodes, and reports
+// the latency of the inserts.  Without background write-back,
+// evicting a dirty node costs the inserting thread a serialize, a
+// write and an fsync.  With it, the flusher threads have usually
+// written the victim already and eviction just drops it.
+//
+// Build with something like
+//   g++ -O2 -std=c++17 -pthread -I. -Iinclude bench/writeback_bench.cpp local/*.cpp
+//
+// Usage: writeback_bench [directory] [inserts] [cache-size] [threads]
+//                        [lookups-per-insert]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "include/db-tree.hpp"
+
+static void run(const std::string &dir, uint64_t ninserts, uint64_t cache_size,
+		uint64_t nthreads, uint64_t lookups_per_insert)
+{
+  std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+  if (system(cmd.c_str()) != 0)
+    abort();
+
+  one_file_per_object_backing_store store(dir);
+  swap_space ss(&store, cache_size);
+  if (nthreads)
+    ss.start_background_writeback(nthreads, cache_size / 4);
+  betree<uint64_t, std::string> b(&ss, 1 << 8, 1 << 6, 1 << 4);
+  std::mt19937_64 rng(1);
+
+  std::vector<double> latencies;
+  latencies.reserve(ninserts);
+  auto begin = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < ninserts; i++) {
+    auto start = std::chrono::steady_clock::now();
+    b.insert(rng() % (4 * ninserts), "value-" + std::to_string(i));
+    latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    for (uint64_t j = 0; j < lookups_per_insert; j++)
+      b.find(rng() % (4 * ninserts));
+  }
+  ss.checkpoint();
+  double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  const swap_space::cache_stats &stats = ss.get_cache_stats();
+  std::cout << nthreads << " writer threads: total " << total << " s"
+	    << " p50 " << 1e6 * latencies[latencies.size() / 2] << " us"
+	    << " p99 " << 1e6 * latencies[latencies.size() * 99 / 100] << " us"
+	    << " p99.9 " << 1e6 * latencies[latencies.size() * 999 / 1000] << " us"
+	    << ", " << stats.dirty_evictions << " of " << stats.evictions
+	    << " evictions dirty" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp/betree_writeback_bench";
+  uint64_t ninserts = argc > 2 ? strtoull(argv[2], NULL, 0) : 1ULL << 17;
+  uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 64;
+  uint64_t nthreads = argc > 4 ? strtoull(argv[4], NULL, 0) : 2;
+  uint64_t lookups_per_insert = argc > 5 ? strtoull(argv[5], NULL, 0) : 0;
+
+  run(dir, ninserts, cache_size, 0, lookups_per_insert);
+  run(dir, ninserts, cache_size, nthreads, lookups_per_insert);
+  return 0;
+}
@@ -7,27 +7,423 @@
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/managed_shared_memory.hpp>
+
+// The contents of a stored object version, as returned by
+// backing_store::read().  The bytes stay valid, and unchanged, for
+// as long as the block exists, even if the version is deallocated.
+class stored_block {
+public:
+  virtual ~stored_block(void) {}
+  const char * data(void) const { return bytes; }
+  size_t size(void) const { return length; }
+
+protected:
+  const char *bytes = NULL;
+  size_t length = 0;
+};
+
+// A stored_block read into memory.
+class buffered_block : public stored_block {
+public:
+  buffered_block(std::string contents) : buffer(std::move(contents)) {
+    bytes = buffer.data();
+    length = buffer.size();
+  }
+
+private:
+  std::string buffer;
+};
 
 class backing_store {
 public:
+  virtual ~backing_store(void) {}
   virtual void   allocate(uint64_t obj_id, uint64_t version) = 0;
   virtual void deallocate(uint64_t obj_id, uint64_t version) = 0;
   virtual std::iostream * get(uint64_t obj_id, uint64_t version) = 0;
   virtual void            put(std::iostream *ios) = 0;
+  // Read a version that has been put(), without going through a
+  // stream.  By default this copies it out of get()'s stream; stores
+  // that can hand out their bytes more directly should override it.
+  // Safe to call from several threads at once, like get().
+  virtual std::shared_ptr<stored_block> read(uint64_t obj_id, uint64_t version);
+  // Make every put() so far durable.  Stores whose put()s are
+  // durable on their own needn't override this.
+  virtual void            sync(void) {}
+
+  // The first object id a new swap_space on this store may use.
+  // Stores that several swap_spaces share hand each of them a range
+  // of ids of its own; by default a store has one user, which starts
+  // at 1.
+  virtual uint64_t reserve_object_ids(void) { return 1; }
+
+  // Asynchronous I/O.  submit_write() stores contents as a version
+  // that has been allocate()d, as get(), writing and put() would,
+  // and submit_read() reads a version the way read() does.  Both may
+  // return before the I/O is done, or even started.  poll() starts
+  // whatever has been submitted and appends the operations that have
+  // finished since it last returned them to done, first waiting
+  // until at least min have.  Operations are identified by tags the
+  // caller chooses.  Calls to these three mustn't overlap each other,
+  // but may overlap anything else.  By default the I/O is done
+  // synchronously by submit_read() and submit_write().
+  class io_completion {
+  public:
+    uint64_t tag;
+    // The version's contents, for reads.
+    std::shared_ptr<stored_block> block;
+  };
+  virtual void submit_read(uint64_t tag, uint64_t obj_id, uint64_t version);
+  virtual void submit_write(uint64_t tag, uint64_t obj_id, uint64_t version,
+			    std::string contents);
+  virtual void poll(std::vector<io_completion> &done, size_t min);
+
+private:
+  std::vector<io_completion> completed;
 };
 
+// Each object version lives in its own file.  By default put()
+// fsyncs the file it wrote.  In write-behind mode put() just writes,
+// and the next sync() fsyncs every file written since the previous
+// one (and the directory) in one go.  read() maps the file read-only
+// rather than copying it, unless it is smaller than a page.
 class one_file_per_object_backing_store: public backing_store {
 public:
-  one_file_per_object_backing_store(std::string rt);
+  one_file_per_object_backing_store(std::string rt, bool writebehind = false);
+  ~one_file_per_object_backing_store(void);
   void	  allocate(uint64_t obj_id, uint64_t version);
   void		  deallocate(uint64_t obj_id, uint64_t version);
   std::iostream * get(uint64_t obj_id, uint64_t version);
   void            put(std::iostream *ios);
+  std::shared_ptr<stored_block> read(uint64_t obj_id, uint64_t version);
+  void            sync(void);
   std::string get_filename(uint64_t obj_id, uint64_t version);
-  
+
+protected:
+  bool is_write_behind(void) const { return write_behind; }
+  // Account for a version written through fd rather than by get()
+  // and put(), and take fd over.  Unless the store is in write-behind
+  // mode, the write must already be durable.
+  void written(uint64_t obj_id, uint64_t version, int fd);
+
+private:
+  std::string	root;
+  bool		write_behind;
+  // Descriptors of the files written since the last sync(), which
+  // can be called from any thread.
+  std::mutex	unsynced_mutex;
+  std::vector<int> unsynced;
+  // Versions allocated but not yet written, and the streams get()
+  // returned for writing them, so that put()s of streams that were
+  // only read don't leave descriptors for sync().
+  std::set<std::pair<uint64_t, uint64_t> > allocated;
+  std::set<std::iostream *> writing;
+};
+
+// A one_file_per_object_backing_store whose asynchronous interface
+// keeps up to depth reads and writes in flight at once.  It uses
+// io_uring, driven through the raw system calls, when the kernel
+// supports it, and otherwise (or if use_io_uring is false) a pool of
+// depth threads doing blocking I/O.  Files are still opened and
+// closed synchronously, by submit_*() and poll(); the reads, writes
+// and, unless in write-behind mode, fsyncs are what go in flight.
+// Reads return buffered blocks.  Everything submitted has to be
+// poll()ed before the store is destroyed.
+class async_file_backing_store: public one_file_per_object_backing_store {
+public:
+  enum io_engine_kind { IO_URING, THREAD_POOL };
+
+  async_file_backing_store(std::string rt, bool writebehind = false,
+			   uint64_t depth = 64, bool use_io_uring = true);
+  ~async_file_backing_store(void);
+  void submit_read(uint64_t tag, uint64_t obj_id, uint64_t version);
+  void submit_write(uint64_t tag, uint64_t obj_id, uint64_t version,
+		    std::string contents);
+  void poll(std::vector<io_completion> &done, size_t min);
+
+  io_engine_kind get_io_engine(void) const { return engine_kind; }
+
+  // Defined in backing_store.cpp.
+  class operation;
+  class io_engine;
+
+private:
+  io_engine_kind engine_kind;
+  std::unique_ptr<io_engine> io;
+};
+
+// A one_file_per_object_backing_store that bypasses the kernel's
+// page cache, so that the swap_space is the only cache of stored
+// objects and its budget is what they cost.  Files are written and
+// read whole with O_DIRECT, through buffers aligned to block_size
+// that are reused from a pool holding up to pool_bytes.  Each file
+// is a 16-byte header giving the length of the contents, then the
+// contents, padded with zeros to a multiple of block_size.  On file
+// systems without O_DIRECT (tmpfs, for one) it falls back to
+// buffered I/O and asks the kernel to drop each file's pages once
+// it's done with them.
+class direct_file_backing_store: public one_file_per_object_backing_store {
+public:
+  direct_file_backing_store(std::string rt, bool writebehind = false,
+			    size_t blocksize = 4096,
+			    uint64_t pool_bytes = 1ULL << 24);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  std::shared_ptr<stored_block> read(uint64_t obj_id, uint64_t version);
+
+  // Whether O_DIRECT is in use, rather than the fallback.
+  bool is_direct(void) const { return direct; }
+
+  // Defined in backing_store.cpp.
+  class buffer_pool;
+
+private:
+  class object_stream : public std::stringstream {
+  public:
+    object_stream(uint64_t id, uint64_t v, bool w, const std::string &contents)
+      : std::stringstream(contents),
+	obj_id(id),
+	version(v),
+	writing(w)
+    {}
+    uint64_t obj_id;
+    uint64_t version;
+    // The version hasn't been written yet; put() writes it.
+    bool writing;
+  };
+
+  int open_file(uint64_t obj_id, uint64_t version, int flags);
+
+  bool		direct;
+  size_t	block_size;
+  std::shared_ptr<buffer_pool> pool;
+};
+
+// All object versions are appended to a few large segment files
+// (<root>/segment_<n>) instead of one file each.  An in-memory index
+// maps each (obj_id, version) to the extent holding it.  Changes to
+// the index are journaled to <root>/index, which is made durable
+// together with the segments and rewritten when it gets long, so the
+// store can be reopened.  deallocate() only drops the index entry; a background
+// cleaner thread copies the live extents out of mostly-dead sealed
+// segments into the active one and then deletes them.  put() fsyncs
+// unless the store is in write-behind mode, as with
+// one_file_per_object_backing_store.
+class log_structured_backing_store: public backing_store {
+public:
+  log_structured_backing_store(std::string rt,
+			       bool writebehind = false,
+			       uint64_t segmentsize = 1ULL << 26,
+			       double cleanthreshold = 0.5);
+  ~log_structured_backing_store(void);
+  void	  allocate(uint64_t obj_id, uint64_t version);
+  void		  deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  std::shared_ptr<stored_block> read(uint64_t obj_id, uint64_t version);
+  void            sync(void);
+
+  // Clean every segment that qualifies right now, without waiting
+  // for the background thread.
+  void clean(void);
+
+  uint64_t live_bytes(void);
+  uint64_t total_bytes(void);
+  uint64_t segment_count(void);
+
 private:
+  class object_stream : public std::stringstream {
+  public:
+    object_stream(uint64_t id, uint64_t v, const std::string &contents)
+      : std::stringstream(contents),
+	obj_id(id),
+	version(v)
+    {}
+    uint64_t obj_id;
+    uint64_t version;
+  };
+
+  struct extent {
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  struct segment {
+    int fd;
+    uint64_t size;
+    uint64_t live;
+  };
+
+  typedef std::pair<uint64_t, uint64_t> object_version;
+
+  std::string segment_filename(uint64_t seg);
+  std::string index_filename(void);
+  std::string read_extent(const extent &e);
+  void open_segment(uint64_t seg, bool truncate);
+  extent append(const std::string &contents);
+  void kill(const extent &e);
+  bool needs_cleaning(uint64_t seg);
+  void clean_segment(uint64_t seg);
+  void sync_locked(void);
+  void load_index(void);
+  void rewrite_index(void);
+  void cleaner_main(void);
+
   std::string	root;
+  bool		write_behind;
+  uint64_t	segment_size;
+  double	clean_threshold;
+
+  std::mutex	mutex;
+  std::map<object_version, extent> index;
+  // Allocated but not yet put().
+  std::set<object_version> pending;
+  std::map<uint64_t, segment> segments;
+  uint64_t	active_segment;
+  std::set<uint64_t> dirty_segments;
+  // Segments have been created since the last sync.
+  bool		directory_dirty;
+  // Index journal and the records not yet written to it.
+  int		index_fd;
+  uint64_t	index_records;
+  std::string	unwritten_records;
+
+  std::condition_variable cleaner_wakeup;
+  bool		stop_cleaner;
+  std::thread	cleaner;
 };
 
+// Object versions live in a boost::interprocess managed shared-memory
+// segment, so that several processes on a machine can share them
+// without going through the file system.  The segment holds the
+// versions' contents, allocated from it as blobs, and an index from
+// (obj_id, version) to blob, guarded by a mutex in the segment.  The
+// first store to name a segment creates it with the given size, and
+// the others attach to it (a size of 0 only attaches, and throws
+// boost::interprocess::interprocess_exception if there's no segment
+// to attach to).  The segment lasts until remove() is called, but
+// not across reboots, so sync() has nothing to do.  read() returns
+// the blob itself rather than a copy, and a blob deallocated while
+// some process is reading it is freed once the last reader is done.
+// Any process may read any version, but each swap_space on the
+// segment gets a range of object ids of its own from
+// reserve_object_ids(), so their writes never collide.  put() throws
+// std::bad_alloc when the segment is full.
+class shared_memory_backing_store: public backing_store {
+public:
+  shared_memory_backing_store(std::string name, uint64_t size = 1ULL << 28);
+  ~shared_memory_backing_store(void);
+  void	  allocate(uint64_t obj_id, uint64_t version);
+  void		  deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  std::shared_ptr<stored_block> read(uint64_t obj_id, uint64_t version);
+  uint64_t	  reserve_object_ids(void);
+
+  // Ids per reserve_object_ids() range.
+  static const uint64_t OBJECT_ID_RANGE = 1ULL << 40;
+
+  // Bytes free in the segment.
+  uint64_t free_bytes(void);
+
+  // Delete the segment named name.  Stores already attached to it
+  // keep working until they're destroyed.
+  static void remove(std::string name);
+
+  // Defined in backing_store.cpp.
+  class shared_state;
+  class shared_block;
+
+private:
+  class object_stream : public std::stringstream {
+  public:
+    object_stream(uint64_t id, uint64_t v, bool w, const std::string &contents)
+      : std::stringstream(contents),
+	obj_id(id),
+	version(v),
+	writing(w)
+    {}
+    uint64_t obj_id;
+    uint64_t version;
+    // The version hasn't been written yet; put() writes it.
+    bool writing;
+  };
+
+  std::shared_ptr<boost::interprocess::managed_shared_memory> segment;
+  shared_state *state;
+};
+
+// An append-only log of records, for redo logging.  Each record is
+// framed with its length and a CRC-32, so reading the log back stops
+// cleanly at a record that a crash left half-written.  append() only
+// buffers a record; commit() makes it durable, and a single write()
+// and fdatasync() covers every record appended by then, so threads
+// committing at the same time share syncs.
+class write_ahead_log {
+public:
+  // Opens (creating if necessary) the log in filename.  Call replay()
+  // before appending to a log that has records in it.
+  write_ahead_log(std::string filename);
+  ~write_ahead_log(void);
+
+  // Hand each intact record to f, in order, and cut off whatever
+  // follows the last one.  Returns the number of records.
+  uint64_t replay(std::function<void(const std::string &)> f);
+
+  // Returns the record's log sequence number, for commit().
+  uint64_t append(const std::string &record);
+
+  // Records become durable in groups of n: commit() syncs the log
+  // once n records have been appended since the last sync, and
+  // otherwise returns right away.  With the default of 1, a
+  // committed record is durable.  If another thread is syncing,
+  // commit() waits for it and then checks again.  Both throw
+  // std::runtime_error if the log can't be written or synced.
+  void set_group_size(uint64_t n);
+  void commit(uint64_t lsn);
+  // Make every record appended so far durable.
+  void sync(void);
+
+  // Bytes in the log, durable or not.
+  uint64_t size(void);
+
+private:
+  void sync_locked(std::unique_lock<std::mutex> &lock);
+
+  std::string	filename;
+  int		fd;
+  uint64_t	group_size;
+  std::mutex	mutex;
+  std::condition_variable synced;
+  // Records appended but not yet written, and how many.
+  std::string	unwritten;
+  uint64_t	unwritten_records;
+  // LSNs are offsets of the ends of records.
+  uint64_t	appended_lsn;
+  uint64_t	durable_lsn;
+  bool		syncing;
+  // Set once a write or sync has failed; commit() and sync() throw
+  // from then on.
+  bool		failed;
+};
+
+// Replace filename with a file holding contents, so that after a
+// crash it holds either the old contents or the new ones.
+void replace_file_durably(const std::string &filename, const std::string &contents);
+// Read all of filename into contents.  Returns false if it doesn't
+// exist.
+bool read_file(const std::string &filename, std::string &contents);
+
 #endif // BACKING_STORE_HPP
@@ -0,0 +1,174 @@
+// A small Bloom filter used by the betree to avoid descending into
+// subtrees that cannot contain a key.
+//
+// A default-constructed filter is "unknown": it has no bits and
+// answers "maybe" for every key.  Filters that get too full still
+// answer correctly but filter less and less, so their owner rebuilds
+// them bigger (see is_full() and estimated_keys()).  Filters can be
+// merged by OR-ing their bits, after folding the bigger one down to
+// the size of the smaller one.
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <cmath>
+#include <cassert>
+#include "include/swap_space.hpp"
+
+// Keys can only be put in Bloom filters if std::hash is enabled for
+// them.  Trees of other keys compile, but can't have filters.
+template<class Key>
+constexpr bool bloom_hashable = std::is_default_constructible<std::hash<Key> >::value;
+
+// Hash a key for use with a bloom_filter.  std::hash is the identity
+// for integers on common implementations, so mix the bits a bit.
+template<class Key>
+uint64_t bloom_hash(const Key &k)
+{
+  uint64_t x = 0;
+  if constexpr (bloom_hashable<Key>)
+    x = std::hash<Key>()(k);
+  else
+    assert(0);
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+class bloom_filter : public serializable {
+public:
+  bloom_filter(void) :
+    nhashes(0),
+    nset(0),
+    bits()
+  {}
+
+  // A filter of at least nbits bits (rounded up to a power of two)
+  // using nh hash functions.
+  bloom_filter(uint64_t nbits, uint8_t nh) :
+    nhashes(nh),
+    nset(0),
+    bits()
+  {
+    uint64_t nwords = 1;
+    while (64 * nwords < nbits)
+      nwords *= 2;
+    bits.resize(nwords, 0);
+  }
+
+  bool is_unknown(void) const {
+    return bits.empty();
+  }
+
+  void make_unknown(void) {
+    nset = 0;
+    bits.clear();
+    bits.shrink_to_fit();
+  }
+
+  // More than half the bits are set.
+  bool is_full(void) const {
+    return 2 * nset > 64 * bits.size();
+  }
+
+  // About how many distinct keys have been inserted, going by how
+  // many bits are set.
+  uint64_t estimated_keys(void) const {
+    if (is_unknown())
+      return 0;
+    double m = 64.0 * bits.size();
+    double x = std::min<double>(nset, 0.99 * m);
+    return (uint64_t)(-m / nhashes * std::log(1.0 - x / m));
+  }
+
+  void insert(uint64_t hash) {
+    if (is_unknown())
+      return;
+    uint64_t mask = 64 * bits.size() - 1;
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+    for (unsigned int i = 0; i < nhashes; i++) {
+      uint64_t b = (h1 + i * h2) & mask;
+      if (!(bits[b / 64] & (1ULL << (b % 64)))) {
+	bits[b / 64] |= 1ULL << (b % 64);
+	nset++;
+      }
+    }
+  }
+
+  bool may_contain(uint64_t hash) const {
+    if (is_unknown())
+      return true;
+    uint64_t mask = 64 * bits.size() - 1;
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+    for (unsigned int i = 0; i < nhashes; i++) {
+      uint64_t b = (h1 + i * h2) & mask;
+      if (!(bits[b / 64] & (1ULL << (b % 64))))
+	return false;
+    }
+    return true;
+  }
+
+  // Add everything in other to this filter.  Bit positions are
+  // hashes mod the (power of two) size, so folding a filter in half
+  // keeps every key it had.
+  void merge(const bloom_filter &other) {
+    if (is_unknown())
+      return;
+    if (other.is_unknown() || other.nhashes != nhashes) {
+      make_unknown();
+      return;
+    }
+    if (other.bits.size() < bits.size())
+      fold(other.bits.size());
+    for (size_t i = 0; i < other.bits.size(); i++)
+      bits[i % bits.size()] |= other.bits[i];
+    recount();
+  }
+
+  uint64_t serialized_size(void) const {
+    return 1 + 8 + 8 * bits.size();
+  }
+
+  void _serialize(std::iostream &fs, serialization_context &context) {
+    serialize(fs, context, nhashes);
+    serialize(fs, context, bits);
+  }
+
+  void _deserialize(std::iostream &fs, serialization_context &context) {
+    deserialize(fs, context, nhashes);
+    deserialize(fs, context, bits);
+    recount();
+  }
+
+private:
+  void fold(size_t nwords) {
+    for (size_t i = nwords; i < bits.size(); i++)
+      bits[i % nwords] |= bits[i];
+    bits.resize(nwords);
+  }
+
+  void recount(void) {
+    nset = 0;
+    for (size_t i = 0; i < bits.size(); i++)
+      nset += __builtin_popcountll(bits[i]);
+  }
+
+  uint8_t nhashes;
+  // Not serialized; recounted when loaded.
+  uint64_t nset;
+  std::vector<uint64_t> bits;
+};
+
+inline uint64_t serialized_size(const bloom_filter &f)
+{
+  return f.serialized_size();
+}
+
+#endif // BLOOM_FILTER_HPP
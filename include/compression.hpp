@@ -0,0 +1,56 @@
+// Block compression for the swap_space.
+//
+// Serialized objects can be compressed on their way to the backing
+// store (see swap_space::set_compression()).  A compressed block
+// starts with a header recording the codec and the uncompressed
+// size; anything without one is a raw serialized object.  So a store
+// can hold a mix of raw blocks and blocks from different codecs, and
+// reads don't need to know how the swap_space is configured.
+//
+// Both codecs are LZ77 variants with the same sequence format (a
+// token holding the literal and match lengths, the literals, and the
+// match offset), decoded by the same routine:
+//
+//   FAST_COMPRESSION  greedy matching against a single-entry hash
+//                     table over the last 64KB, in the style of LZ4.
+//   HIGH_COMPRESSION  hash chains and lazy matching over the last
+//                     1MB, followed by a Huffman pass over the
+//                     sequences, in the style of LZ4HC plus zstd's
+//                     entropy stage.  Slower to compress, about as
+//                     fast to decompress.
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+enum compression_codec {
+  NO_COMPRESSION = 0,
+  FAST_COMPRESSION = 1,
+  HIGH_COMPRESSION = 2
+};
+
+// Magic number, codec and uncompressed size.  The magic can't begin
+// a serialized object: in the binary format it would be a node with
+// over a billion pivots, and the text format is ASCII.
+#define COMPRESSED_BLOCK_MAGIC "\xbe\xc0\x4d\x5a"
+#define COMPRESSED_BLOCK_MAGIC_SIZE 4
+#define COMPRESSED_BLOCK_HEADER_SIZE (COMPRESSED_BLOCK_MAGIC_SIZE + 1 + 8)
+
+// Compress in with codec into a block with a header.  Returns in
+// itself, raw, for NO_COMPRESSION or if compressing doesn't make it
+// smaller.
+std::string compress_block(compression_codec codec, const std::string &in);
+
+// Whether a block starting with the n bytes at p is compressed.
+bool is_compressed_block(const char *p, size_t n);
+
+// Decompress a block for which is_compressed_block() is true.
+// Throws std::runtime_error if it is corrupt.
+std::string decompress_block(const std::string &in);
+// The same for the n bytes at in.
+std::string decompress_block(const char *in, size_t n);
+
+#endif
@@ -25,11 +25,12 @@
 // always move a batch of size at least (B-B^e) / B^e = B^(1-e) - 1
 // messages.
 
-// In this implementation, nodes have a fixed maximum size.  Whenever
-// a leaf exceeds this max size, it splits.  Whenever an internal node
-// exceeds this maximum size, it checks to see if it can flush a large
-// batch of elements to one of its children.  If it can, it does so.
-// If it cannot, then it splits.
+// In this implementation, nodes have a fixed maximum size, measured
+// either in messages or in serialized bytes.  Whenever a leaf exceeds
+// this max size, it splits.  Whenever an internal node exceeds this
+// maximum size, it checks to see if it can flush a large batch of
+// elements to one of its children.  If it can, it does so.  If it
+// cannot, then it splits.
 
 // In-memory nodes may temporarily exceed the maximum size
 // restriction.  During a flush, we move all the incoming messages
@@ -37,7 +38,10 @@
 // max size.  The flushing procedure then performs further flushes or
 // splits to restore the max-size invariant.  Thus, whenever a flush
 // returns, all the nodes in the subtree of that node are guaranteed
-// to satisfy the max-size requirement.
+// to satisfy the max-size requirement.  (With concurrent writers, a
+// node that would split only after a flush its parent didn't wait
+// for stays oversized until the next flush into it; see
+// betree::set_concurrent().)
 
 // This implementation also optimizes I/O based on which nodes are
 // on-disk, clean in memory, or dirty in memory.  For example,
@@ -51,10 +55,22 @@
 // to an on-disk node requires reading it in and writing it out.
 
 #include <map>
+#include <set>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <filesystem>
 #include <cassert>
 #include "include/swap_space.hpp"
 #include "include/backing_store.hpp"
+#include "include/bloom_filter.hpp"
+#include "include/flat_map.hpp"
 
 ////////////////// Upserts
 
@@ -90,12 +106,12 @@ public:
   }
 
   void _serialize(std::iostream &fs, serialization_context &context) const {
-    fs << timestamp << " ";
+    serialize(fs, context, timestamp);
     serialize(fs, context, key);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> timestamp;
+    deserialize(fs, context, timestamp);
     deserialize(fs, context, key);
   }
 
@@ -103,6 +119,11 @@ public:
   uint64_t timestamp;
 };
 
+template<class Key>
+uint64_t serialized_size(const MessageKey<Key> &mkey) {
+  return 8 + serialized_size(mkey.key);
+}
+
 template<class Key>
 bool operator<(const MessageKey<Key> & mkey1, const MessageKey<Key> & mkey2) {
   return mkey1.key < mkey2.key ||
@@ -148,12 +169,14 @@ public:
   {}
   
   void _serialize(std::iostream &fs, serialization_context &context) {
-    fs << opcode << " ";
+    serialize(fs, context, (uint8_t)opcode);
     serialize(fs, context, val);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> opcode;
+    uint8_t opc;
+    deserialize(fs, context, opc);
+    opcode = opc;
     deserialize(fs, context, val);
   }
 
@@ -166,6 +189,19 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
   return a.opcode == b.opcode && a.val == b.val;
 }
 
+template<class Value>
+uint64_t serialized_size(const Message<Value> &msg) {
+  return 1 + serialized_size(msg.val);
+}
+
+// Node sizes, and the size limits passed to betree, can be measured
+// either in messages (each buffered message and each pivot counts as
+// one) or in serialized bytes.  With variable-length keys or values,
+// byte limits keep the on-disk node size, and hence the I/O unit,
+// predictable.
+#define NODE_SIZE_IN_MESSAGES (0)
+#define NODE_SIZE_IN_BYTES (1)
+
 // Measured in messages.
 #define DEFAULT_MAX_NODE_SIZE (1ULL<<18)
 
@@ -174,41 +210,100 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 // Note: we will flush MIN_FLUSH_SIZE/2 items to a clean in-memory child.
 #define DEFAULT_MIN_FLUSH_SIZE (DEFAULT_MAX_NODE_SIZE / 16ULL)
 
+// The same defaults for trees measured in bytes.
+#define DEFAULT_MAX_NODE_BYTES (1ULL<<22)
+#define DEFAULT_MIN_FLUSH_BYTES (DEFAULT_MAX_NODE_BYTES / 16ULL)
+
+// For trees opened with betree::open(): the cache size, in nodes, and
+// how many bytes of log to write between checkpoints.
+#define DEFAULT_OPEN_CACHE_SIZE 1024ULL
+#define DEFAULT_CHECKPOINT_INTERVAL (1ULL<<26)
 
-template<class Key, class Value> class betree {
+
+// Node layouts.  A layout picks the associative container used for a
+// node's pivots and message buffer.
+//
+// map_node_layout uses std::map: cheap single-message inserts, but
+// one heap allocation and several pointers per entry.
+class map_node_layout {
+public:
+  template<class K, class V> using map = std::map<K, V>;
+  static const bool merge_batches = false;
+  // Memory used per entry on top of the entry itself: the tree node's
+  // links and color, plus malloc's header.
+  static const uint64_t entry_overhead = 48;
+};
+
+// flat_node_layout uses sorted arrays (a key array with a parallel
+// array of children or messages).  Entries are packed and lookups are
+// binary searches, but each single insert moves the tail of the
+// buffer, so incoming batches are merged into the buffer in one pass.
+// Works best with batched upserts.
+class flat_node_layout {
+public:
+  template<class K, class V> using map = flat_map<K, V>;
+  static const bool merge_batches = true;
+  static const uint64_t entry_overhead = 0;
+};
+
+template<class Key, class Value, class Layout = map_node_layout> class betree {
 private:
 
   class node;
   // We let a swap_space handle all the I/O.
   typedef typename swap_space::pointer<node> node_pointer;
+  struct flush_job;
+  typedef std::vector<flush_job> flush_jobs;
   class child_info : public serializable {
   public:
     child_info(void)
       : child(),
-	child_size(0)
+	child_size(0),
+	buffered(0),
+	buffered_bytes(0)
     {}
     
     child_info(node_pointer child, uint64_t child_size)
       : child(child),
-	child_size(child_size)
+	child_size(child_size),
+	buffered(0),
+	buffered_bytes(0)
     {}
 
     void _serialize(std::iostream &fs, serialization_context &context) {
       serialize(fs, context, child);
-      fs << " ";
       serialize(fs, context, child_size);
+      serialize(fs, context, buffered);
+      serialize(fs, context, buffered_bytes);
+      serialize(fs, context, filter);
     }
 
     void _deserialize(std::iostream &fs, serialization_context &context) {
       deserialize(fs, context, child);
       deserialize(fs, context, child_size);
+      deserialize(fs, context, buffered);
+      deserialize(fs, context, buffered_bytes);
+      deserialize(fs, context, filter);
+    }
+
+    uint64_t serialized_size(void) const {
+      return 8 + 3 * 8 + ::serialized_size(filter);
     }
     
     node_pointer child;
+    // In the tree's node size unit.
     uint64_t child_size;
+    // Number and serialized size of the messages in the parent's
+    // buffer destined for child.
+    uint64_t buffered;
+    uint64_t buffered_bytes;
+    // Covers every key buffered in or below child, sized for the
+    // keys in child's subtree (see node::subtree_filter()).  Unknown
+    // (i.e. "maybe" for every key) when filters are disabled.
+    bloom_filter filter;
   };
-  typedef typename std::map<Key, child_info> pivot_map;
-  typedef typename std::map<MessageKey<Key>, Message<Value> > message_map;
+  typedef typename Layout::template map<Key, child_info> pivot_map;
+  typedef typename Layout::template map<MessageKey<Key>, Message<Value> > message_map;
     
   class node : public serializable {
   public:
@@ -216,11 +311,101 @@ private:
     // Child pointers
     pivot_map pivots;
     message_map elements;
+    // Serialized size of elements and pivots.  Kept up to date
+    // incrementally as messages come and go, and recounted from
+    // scratch when nodes are built, split or loaded.
+    uint64_t element_bytes = 0;
+    uint64_t pivot_bytes = 0;
+    // Serialized size of our children's filters.  Left out of
+    // pivot_bytes, since a filter for a big subtree can be bigger
+    // than a node and would have us split forever.
+    uint64_t filter_bytes = 0;
+    // In concurrent mode, readers hold this shared and the writer
+    // holds it exclusively (see betree::set_concurrent()).
+    mutable std::shared_mutex latch;
+    // The tree's generation when we were made (see
+    // betree::snapshot()).  Not serialized: a node loaded from disk
+    // may be shared with a snapshot, so it counts as old.
+    uint64_t generation = 0;
 
     bool is_leaf(void) const {
       return pivots.empty();
     }
 
+    // Snapshots only read frozen nodes, which nothing writes, so
+    // they don't latch.
+    std::shared_lock<std::shared_mutex> read_latch(const betree &bet,
+						   bool frozen = false) const {
+      if (!bet.concurrent || frozen)
+	return std::shared_lock<std::shared_mutex>();
+      return std::shared_lock<std::shared_mutex>(latch);
+    }
+
+    std::unique_lock<std::shared_mutex> write_latch(const betree &bet) {
+      if (!bet.concurrent)
+	return std::unique_lock<std::shared_mutex>();
+      return std::unique_lock<std::shared_mutex>(latch);
+    }
+
+    // For the swap_space's byte budget.  Uses the serialized size of
+    // the entries as an estimate of their in-memory size.
+    uint64_t memory_footprint(void) const {
+      return sizeof(node) + element_bytes + pivot_bytes + filter_bytes +
+	Layout::entry_overhead * (elements.size() + pivots.size());
+    }
+
+    // Our size in the tree's node size unit.
+    uint64_t size(const betree &bet) const {
+      if (bet.size_unit == NODE_SIZE_IN_BYTES)
+	return element_bytes + pivot_bytes;
+      return elements.size() + pivots.size();
+    }
+
+    // The part of our buffer destined for the child in ci, in the
+    // tree's node size unit.
+    static uint64_t buffered_size(const betree &bet, const child_info &ci) {
+      return bet.size_unit == NODE_SIZE_IN_BYTES ? ci.buffered_bytes : ci.buffered;
+    }
+
+    static uint64_t message_bytes(const MessageKey<Key> &mkey,
+				  const Message<Value> &msg) {
+      return serialized_size(mkey) + serialized_size(msg);
+    }
+
+    static uint64_t pivot_entry_bytes(const Key &k, const child_info &ci) {
+      return serialized_size(k) + ci.serialized_size() -
+	::serialized_size(ci.filter);
+    }
+
+    // Total size of the messages for key k in elts.
+    static uint64_t key_bytes(const message_map &elts, const Key &k) {
+      uint64_t bytes = 0;
+      for (auto it = elts.lower_bound(MessageKey<Key>::range_start(k));
+	   it != elts.end() && it->first.key == k; ++it)
+	bytes += message_bytes(it->first, it->second);
+      return bytes;
+    }
+
+    void recount_filter_bytes(void) {
+      filter_bytes = 0;
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	filter_bytes += ::serialized_size(it->second.filter);
+    }
+
+    void recount_pivot_bytes(void) {
+      pivot_bytes = 0;
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	pivot_bytes += pivot_entry_bytes(it->first, it->second);
+      recount_filter_bytes();
+    }
+
+    void recount_bytes(void) {
+      element_bytes = 0;
+      for (auto it = elements.begin(); it != elements.end(); ++it)
+	element_bytes += message_bytes(it->first, it->second);
+      recount_pivot_bytes();
+    }
+
     // Holy frick-a-moly.  We want to write a const function that
     // returns a const_iterator when called from a const function and
     // a non-const function that returns a (non-const_)iterator when
@@ -278,6 +463,22 @@ private:
     // Apply a message to ourself.
     void apply(const MessageKey<Key> &mkey, const Message<Value> &elt,
 	       Value &default_value) {
+      uint64_t before = elements.size();
+      uint64_t before_bytes = key_bytes(elements, mkey.key);
+      apply_to(elements, is_leaf(), mkey, elt, default_value);
+      uint64_t delta_bytes = key_bytes(elements, mkey.key) - before_bytes;
+      element_bytes += delta_bytes;
+      if (!is_leaf()) {
+	auto pivot = get_pivot(mkey.key);
+	pivot->second.buffered += elements.size() - before;
+	pivot->second.buffered_bytes += delta_bytes;
+      }
+    }
+
+    // Apply a message to the message buffer of a leaf or internal node.
+    static void apply_to(message_map &elements, bool leaf,
+			 const MessageKey<Key> &mkey, const Message<Value> &elt,
+			 Value &default_value) {
       switch (elt.opcode) {
       case INSERT:
 	elements.erase(elements.lower_bound(mkey.range_start()),
@@ -288,7 +489,7 @@ private:
       case DELETE:
 	elements.erase(elements.lower_bound(mkey.range_start()),
 		       elements.upper_bound(mkey.range_end()));
-	if (!is_leaf())
+	if (!leaf)
 	  elements[mkey] = elt;
 	break;
 
@@ -298,18 +499,19 @@ private:
 	  if (iter != elements.begin())
 	    iter--;
 	  if (iter == elements.end() || iter->first.key != mkey.key)
-	    if (is_leaf()) {
+	    if (leaf) {
 	      Value dummy = default_value;
-	      apply(mkey, Message<Value>(INSERT, dummy + elt.val),
-		    default_value);
+	      apply_to(elements, leaf, mkey, Message<Value>(INSERT, dummy + elt.val),
+		       default_value);
 	    } else {
 	      elements[mkey] = elt;
 	    }
 	  else {
 	    assert(iter != elements.end() && iter->first.key == mkey.key);
 	    if (iter->second.opcode == INSERT) {
-	      apply(mkey, Message<Value>(INSERT, iter->second.val + elt.val),
-		    default_value);	  
+	      apply_to(elements, leaf, mkey,
+		       Message<Value>(INSERT, iter->second.val + elt.val),
+		       default_value);
 	    } else {
 	      elements[mkey] = elt;	      
 	    }
@@ -322,73 +524,132 @@ private:
       }
     }
     
+    // Apply a batch of messages.  With a flat layout, inserting
+    // messages one at a time costs O(buffer size) apiece, so batches
+    // are instead merged into the buffer in a single pass.
+    void apply_batch(const message_map &elts, Value &default_value) {
+      if constexpr (Layout::merge_batches) {
+	if (elts.size() > 1) {
+	  message_map merged;
+	  message_map group;
+	  merged.reserve(elements.size() + elts.size());
+	  auto old_it = elements.begin();
+	  auto new_it = elts.begin();
+	  while (new_it != elts.end()) {
+	    Key k = new_it->first.key;
+	    while (old_it != elements.end() && old_it->first.key < k) {
+	      merged.emplace_hint(merged.end(), old_it->first, old_it->second);
+	      ++old_it;
+	    }
+	    group.clear();
+	    while (old_it != elements.end() && old_it->first.key == k) {
+	      group.emplace_hint(group.end(), old_it->first, old_it->second);
+	      ++old_it;
+	    }
+	    uint64_t before = group.size();
+	    uint64_t before_bytes = key_bytes(group, k);
+	    while (new_it != elts.end() && new_it->first.key == k) {
+	      apply_to(group, is_leaf(), new_it->first, new_it->second,
+		       default_value);
+	      ++new_it;
+	    }
+	    uint64_t delta_bytes = key_bytes(group, k) - before_bytes;
+	    element_bytes += delta_bytes;
+	    if (!is_leaf()) {
+	      auto pivot = get_pivot(k);
+	      pivot->second.buffered += group.size() - before;
+	      pivot->second.buffered_bytes += delta_bytes;
+	    }
+	    merged.insert(group.begin(), group.end());
+	  }
+	  merged.insert(old_it, elements.end());
+	  elements.swap(merged);
+	  return;
+	}
+      }
+      for (auto it = elts.begin(); it != elts.end(); ++it)
+	apply(it->first, it->second, default_value);
+    }
+
     // Requires: there are less than MIN_FLUSH_SIZE things in elements
     //           destined for each child in pivots);
     pivot_map split(betree &bet) {
-      assert(pivots.size() + elements.size() >= bet.max_node_size);
+      assert(size(bet) >= bet.max_node_size);
+      bool bytes = bet.size_unit == NODE_SIZE_IN_BYTES;
+      uint64_t total = size(bet);
       // This size split does a good job of causing the resulting
       // nodes to have size between 0.4 * MAX_NODE_SIZE and 0.6 * MAX_NODE_SIZE.
-      int num_new_leaves =
-	(pivots.size() + elements.size())  / (10 * bet.max_node_size / 24);
-      int things_per_new_leaf =
-	(pivots.size() + elements.size() + num_new_leaves - 1) / num_new_leaves;
+      uint64_t num_new_leaves = total / (10 * bet.max_node_size / 24);
+      uint64_t things_per_new_leaf =
+	(total + num_new_leaves - 1) / num_new_leaves;
 
       pivot_map result;
       auto pivot_idx = pivots.begin();
       auto elt_idx = elements.begin();
-      int things_moved = 0;
-      for (int i = 0; i < num_new_leaves; i++) {
+      uint64_t things_moved = 0;
+      for (uint64_t i = 0; i < num_new_leaves; i++) {
 	if (pivot_idx == pivots.end() && elt_idx == elements.end())
 	  break;
-	node_pointer new_node = bet.ss->allocate(new node);
+	node_pointer new_node = bet.allocate_node(new node);
 	result[pivot_idx != pivots.end() ?
 	       pivot_idx->first :
-	       elt_idx->first.key] = child_info(new_node,
-						new_node->elements.size() +
-						new_node->pivots.size());
-	while(things_moved < (i+1) * things_per_new_leaf &&
+	       elt_idx->first.key] = child_info(new_node, 0);
+	// The last new node takes whatever is left over.
+	while((things_moved < (i+1) * things_per_new_leaf ||
+	       i == num_new_leaves - 1) &&
 	      (pivot_idx != pivots.end() || elt_idx != elements.end())) {
 	  if (pivot_idx != pivots.end()) {
 	    new_node->pivots[pivot_idx->first] = pivot_idx->second;
+	    things_moved += bytes ?
+	      pivot_entry_bytes(pivot_idx->first, pivot_idx->second) : 1;
 	    ++pivot_idx;
-	    things_moved++;
 	    auto elt_end = get_element_begin(pivot_idx);
 	    while (elt_idx != elt_end) {
 	      new_node->elements[elt_idx->first] = elt_idx->second;
+	      things_moved += bytes ?
+		message_bytes(elt_idx->first, elt_idx->second) : 1;
 	      ++elt_idx;
-	      things_moved++;
 	    }
 	  } else {
 	    // Must be a leaf
 	    assert(pivots.size() == 0);
 	    new_node->elements[elt_idx->first] = elt_idx->second;
+	    things_moved += bytes ?
+	      message_bytes(elt_idx->first, elt_idx->second) : 1;
 	    ++elt_idx;
-	    things_moved++;	    
 	  }
 	}
       }
       
-      for (auto it = result.begin(); it != result.end(); ++it)
-	it->second.child_size = it->second.child->elements.size() +
-	  it->second.child->pivots.size();
+      // Building a filter for an internal node means reading its
+      // subtree, whose nodes our writer may have latched for queued
+      // flushes by now, so those are left to flush_child().
+      for (auto it = result.begin(); it != result.end(); ++it) {
+	it->second.child->recount_bytes();
+	it->second.child_size = it->second.child->size(bet);
+	if (it->second.child->is_leaf())
+	  it->second.filter = it->second.child->subtree_filter(bet);
+      }
       
       assert(pivot_idx == pivots.end());
       assert(elt_idx == elements.end());
       pivots.clear();
       elements.clear();
+      recount_bytes();
       return result;
     }
 
     node_pointer merge(betree &bet,
 		       typename pivot_map::iterator begin,
 		       typename pivot_map::iterator end) {
-      node_pointer new_node = bet.ss->allocate(new node);
+      node_pointer new_node = bet.allocate_node(new node);
       for (auto it = begin; it != end; ++it) {
 	new_node->elements.insert(it->second.child->elements.begin(),
 				  it->second.child->elements.end());
 	new_node->pivots.insert(it->second.child->pivots.begin(),
 				  it->second.child->pivots.end());
       }
+      new_node->recount_bytes();
       return new_node;
     }
 
@@ -410,20 +671,103 @@ private:
 	  for (auto tmp = beginit; tmp != endit; ++tmp) {
 	    tmp->second.child->elements.clear();
 	    tmp->second.child->pivots.clear();
+	    tmp->second.child->recount_bytes();
 	  }
 	  Key key = beginit->first;
+	  uint64_t buffered = 0;
+	  uint64_t buffered_bytes = 0;
+	  bloom_filter filter = beginit->second.filter;
+	  for (auto tmp = beginit; tmp != endit; ++tmp) {
+	    buffered += tmp->second.buffered;
+	    buffered_bytes += tmp->second.buffered_bytes;
+	    filter.merge(tmp->second.filter);
+	  }
 	  pivots.erase(beginit, endit);
-	  pivots[key] = child_info(merged_node, merged_node->pivots.size() + merged_node->elements.size());
+	  pivots[key] = child_info(merged_node, merged_node->size(bet));
+	  pivots[key].buffered = buffered;
+	  pivots[key].buffered_bytes = buffered_bytes;
+	  pivots[key].filter = filter;
+	  recount_pivot_bytes();
 	  beginit = pivots.lower_bound(key);
 	}
       }
     }
     
+    // The size of elts in the tree's node size unit.
+    static uint64_t batch_size(const betree &bet, const message_map &elts) {
+      if (bet.size_unit != NODE_SIZE_IN_BYTES)
+	return elts.size();
+      uint64_t bytes = 0;
+      for (auto it = elts.begin(); it != elts.end(); ++it)
+	bytes += message_bytes(it->first, it->second);
+      return bytes;
+    }
+
+    // Flush elts into the child in ci, with the child latched for
+    // writing.  The caller has us latched, so readers can't be on
+    // their way into the child.  Returns the child's split, if any;
+    // otherwise ci's size and filter are brought up to date.  A
+    // filter that is missing or full is rebuilt first (see
+    // subtree_filter()), before anything below the child is queued,
+    // so the rebuild never waits on a latch of ours.
+    //
+    // If jobs is non-NULL and elts can't make the child split, the
+    // flush is queued on jobs instead, with the child still latched,
+    // so the writer can let go of us and our ancestors first.
+    //
+    // A child that a snapshot may share is replaced with a copy
+    // first, and the copy is flushed into instead.
+    static pivot_map flush_child(betree &bet, child_info &ci,
+				 message_map &elts, flush_jobs *jobs)
+    {
+      swap_space::pin<node> pn = ci.child.get_pin();
+      const swap_space::pin<node> &cpn = pn;
+      if (bet.is_frozen(*cpn.operator->())) {
+	// Keeps the old child alive until it is unpinned.
+	node_pointer old_child = ci.child;
+	ci.child = bet.copy_node(*cpn.operator->());
+	pn = ci.child.get_pin();
+      }
+      node *c = pn.operator->();
+      std::unique_lock<std::shared_mutex> l = c->write_latch(bet);
+      if (bet.bloom_bits_per_key > 0 &&
+	  (ci.filter.is_unknown() || ci.filter.is_full()))
+	ci.filter = c->subtree_filter(bet);
+      uint64_t new_size = c->size(bet) + batch_size(bet, elts);
+      if (jobs && new_size < bet.max_node_size) {
+	ci.child_size = new_size;
+	add_to_filter(ci.filter, elts);
+	jobs->push_back(flush_job(ci.child, std::move(pn), c, std::move(l),
+				  std::move(elts)));
+	return pivot_map();
+      }
+      pivot_map new_children = c->flush(bet, elts, jobs);
+      add_to_filter(ci.filter, elts);
+      if (new_children.empty()) {
+	ci.child_size = c->size(bet);
+	return new_children;
+      }
+      // Until they're rebuilt, the pieces of an internal child make
+      // do with the filter for all of it.
+      for (auto it = new_children.begin(); it != new_children.end(); ++it)
+	if (it->second.filter.is_unknown())
+	  it->second.filter = ci.filter;
+      return new_children;
+    }
+
     // Receive a collection of new messages and perform recursive
-    // flushes or splits as necessary.  If we split, return a
+    // flushes or splits as necessary.  The caller holds our latch for
+    // writing.  If we split, return a
     // map with the new pivot keys pointing to the new nodes.
     // Otherwise return an empty map.
-    pivot_map flush(betree &bet, message_map &elts)
+    //
+    // In concurrent mode, flushes to children are queued on jobs
+    // where possible (see flush_child()).  Queued flushes run with
+    // our parent unlatched, so they pass can_split = false and leave
+    // us oversized rather than split us; the next flush from our
+    // parent that can't be queued splits us.
+    pivot_map flush(betree &bet, message_map &elts, flush_jobs *jobs = NULL,
+		    bool can_split = true)
     {
       debug(std::cout << "Flushing " << this << std::endl);
       pivot_map result;
@@ -434,9 +778,8 @@ private:
       }
 
       if (is_leaf()) {
-	for (auto it = elts.begin(); it != elts.end(); ++it)
-	  apply(it->first, it->second, bet.default_value);
-	if (elements.size() + pivots.size() >= bet.max_node_size)
+	apply_batch(elts, bet.default_value);
+	if (size(bet) >= bet.max_node_size && can_split)
 	  result = split(bet);
 	return result;
       }	
@@ -447,8 +790,10 @@ private:
       Key oldmin = pivots.begin()->first;
       MessageKey<Key> newmin = elts.begin()->first;
       if (newmin < oldmin) {
-	pivots[newmin.key] = pivots[oldmin];
+	child_info first_child = pivots.begin()->second;
 	pivots.erase(oldmin);
+	pivots[newmin.key] = first_child;
+	recount_pivot_bytes();
       }
 
       // If everything is going to a single dirty child, go ahead
@@ -457,67 +802,86 @@ private:
       auto last_pivot_idx = get_pivot((--elts.end())->first.key);
       if (first_pivot_idx == last_pivot_idx &&
 	  first_pivot_idx->second.child.is_dirty()) {
-      	// There shouldn't be anything in our buffer for this child,
-      	// but lets assert that just to be safe.
+	// We usually have nothing buffered for a dirty child, but a
+	// split of this node or a large batch can leave some behind.
+	// Send those along too, so they get applied before the new
+	// messages.
 	{
-	  auto next_pivot_idx = next(first_pivot_idx);
+	  auto next_pivot_idx = std::next(first_pivot_idx);
 	  auto elt_start = get_element_begin(first_pivot_idx);
 	  auto elt_end = get_element_begin(next_pivot_idx); 
-	  assert(elt_start == elt_end);
+	  if (elt_start != elt_end) {
+	    elts.insert(elt_start, elt_end);
+	    elements.erase(elt_start, elt_end);
+	    element_bytes -= first_pivot_idx->second.buffered_bytes;
+	    first_pivot_idx->second.buffered = 0;
+	    first_pivot_idx->second.buffered_bytes = 0;
+	  }
 	}
-      	pivot_map new_children = first_pivot_idx->second.child->flush(bet, elts);
+      	pivot_map new_children = flush_child(bet, first_pivot_idx->second, elts, jobs);
       	if (!new_children.empty()) {
       	  pivots.erase(first_pivot_idx);
       	  pivots.insert(new_children.begin(), new_children.end());
-      	} else {
-	  first_pivot_idx->second.child_size =
-	    first_pivot_idx->second.child->pivots.size() +
-	    first_pivot_idx->second.child->elements.size();
-	}
+	  recount_pivot_bytes();
+      	}
 
       } else {
 	
-	for (auto it = elts.begin(); it != elts.end(); ++it)
-	  apply(it->first, it->second, bet.default_value);
-
-	// Now flush to out-of-core or clean children as necessary
-	while (elements.size() + pivots.size() >= bet.max_node_size) {
-	  // Find the child with the largest set of messages in our buffer
-	  unsigned int max_size = 0;
-	  auto child_pivot = pivots.begin();
-	  auto next_pivot = pivots.begin();
-	  for (auto it = pivots.begin(); it != pivots.end(); ++it) {
-	    auto it2 = next(it);
-	    auto elt_it = get_element_begin(it); 
-	    auto elt_it2 = get_element_begin(it2); 
-	    unsigned int dist = distance(elt_it, elt_it2);
-	    if (dist > max_size) {
-	      child_pivot = it;
-	      next_pivot = it2;
-	      max_size = dist;
-	    }
-	  }
+	apply_batch(elts, bet.default_value);
+
+	// Now flush to out-of-core or clean children as necessary.
+	// Nothing gets added to our buffer while we do this, so a heap
+	// of the per-child buffer sizes, built once, always tells us
+	// which child has the largest set of messages in our buffer.
+	std::vector<std::pair<uint64_t, Key> > heaviest;
+	if (size(bet) >= bet.max_node_size) {
+	  heaviest.reserve(pivots.size());
+	  for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	    if (it->second.buffered > 0)
+	      heaviest.push_back(std::make_pair(buffered_size(bet, it->second),
+						it->first));
+	  std::make_heap(heaviest.begin(), heaviest.end());
+	}
+	while (size(bet) >= bet.max_node_size && !heaviest.empty()) {
+	  std::pop_heap(heaviest.begin(), heaviest.end());
+	  uint64_t max_size = heaviest.back().first;
+	  auto child_pivot = pivots.lower_bound(heaviest.back().second);
+	  heaviest.pop_back();
+	  assert(child_pivot != pivots.end() &&
+		 buffered_size(bet, child_pivot->second) == max_size);
+	  auto next_pivot = std::next(child_pivot);
 	  if (!(max_size > bet.min_flush_size ||
 		(max_size > bet.min_flush_size/2 &&
 		 child_pivot->second.child.is_in_memory())))
 	    break; // We need to split because we have too many pivots
+	  // Start reading the child, and the one we'll flush to next if
+	  // this flush doesn't get us under the limit, while we copy
+	  // messages and flush.
+	  bet.ss->prefetch(child_pivot->second.child);
+	  if (!heaviest.empty() && heaviest.front().first > bet.min_flush_size &&
+	      size(bet) - max_size >= bet.max_node_size)
+	    bet.ss->prefetch(pivots.lower_bound(heaviest.front().second)->second.child);
 	  auto elt_child_it = get_element_begin(child_pivot);
 	  auto elt_next_it = get_element_begin(next_pivot);
 	  message_map child_elts(elt_child_it, elt_next_it);
-	  pivot_map new_children = child_pivot->second.child->flush(bet, child_elts);
+	  assert(child_elts.size() == child_pivot->second.buffered);
+	  pivot_map new_children = flush_child(bet, child_pivot->second, child_elts, jobs);
 	  elements.erase(elt_child_it, elt_next_it);
+	  element_bytes -= child_pivot->second.buffered_bytes;
+	  child_pivot->second.buffered = 0;
+	  child_pivot->second.buffered_bytes = 0;
 	  if (!new_children.empty()) {
 	    pivots.erase(child_pivot);
 	    pivots.insert(new_children.begin(), new_children.end());
-	  } else {
-	    first_pivot_idx->second.child_size =
-	      child_pivot->second.child->pivots.size() +
-	      child_pivot->second.child->elements.size();
+	    recount_pivot_bytes();
 	  }
 	}
 
+	// flush_child() may have rebuilt some of their filters.
+	recount_filter_bytes();
+
 	// We have too many pivots to efficiently flush stuff down, so split
-	if (elements.size() + pivots.size() > bet.max_node_size) {
+	if (size(bet) > bet.max_node_size && can_split) {
 	  result = split(bet);
 	}
       }
@@ -528,37 +892,48 @@ private:
       return result;
     }
 
-    Value query(const betree & bet, const Key k) const
+    void pivot_keys(const betree &bet, std::vector<Key> &keys) const
+    {
+      std::shared_lock<std::shared_mutex> l = read_latch(bet);
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	keys.push_back(it->first);
+    }
+
+    // Look up k in the subtree rooted at this node, applying any
+    // buffered updates on the way back up.  Returns false (leaving v
+    // unspecified) if k does not exist in this subtree.  Snapshots
+    // pass frozen = true.
+    bool query(const betree & bet, const Key k, Value &v,
+	       bool frozen = false) const
     {
       debug(std::cout << "Querying " << this << std::endl);
+      std::shared_lock<std::shared_mutex> l = read_latch(bet, frozen);
       if (is_leaf()) {
 	auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
 	if (it != elements.end() && it->first.key == k) {
 	  assert(it->second.opcode == INSERT);
-	  return it->second.val;
-	} else {
-	  throw std::out_of_range("Key does not exist");
+	  v = it->second.val;
+	  return true;
 	}
+	return false;
       }
 
       ///////////// Non-leaf
       
       auto message_iter = get_element_begin(k);
-      Value v = bet.default_value;
+      v = bet.default_value;
 
       if (message_iter == elements.end() || k < message_iter->first)
 	// If we don't have any messages for this key, just search
 	// further down the tree.
-	v = get_pivot(k)->second.child->query(bet, k);
+	return query_child(bet, k, v, frozen);
       else if (message_iter->second.opcode == UPDATE) {
 	// We have some updates for this key.  Search down the tree.
 	// If it has something, then apply our updates to that.  If it
 	// doesn't have anything, then apply our updates to the
 	// default initial value.
-	try {
-	  Value t = get_pivot(k)->second.child->query(bet, k);
-	  v = t;
-	} catch (std::out_of_range & e) {}
+	if (!query_child(bet, k, v, frozen))
+	  v = bet.default_value;
       } else if (message_iter->second.opcode == DELETE) {
 	// We have a delete message, so we don't need to look further
 	// down the tree.  If we don't have any further update or
@@ -566,7 +941,7 @@ private:
 	// this subtree).
 	message_iter++;
 	if (message_iter == elements.end() || k < message_iter->first)
-	  throw std::out_of_range("Key does not exist");
+	  return false;
       } else if (message_iter->second.opcode == INSERT) {
 	// We have an insert message, so we don't need to look further
 	// down the tree.  We'll apply any updates to this value.
@@ -581,48 +956,180 @@ private:
 	message_iter++;
       }
 
-      return v;
+      return true;
+    }
+
+    bool query_child(const betree & bet, const Key k, Value &v,
+		     bool frozen) const
+    {
+      // Keys smaller than our first pivot can't be anywhere below us.
+      if (k < pivots.begin()->first)
+	return false;
+      auto pivot = get_pivot(k);
+      const child_info &ci = pivot->second;
+      if (ci.filter.is_unknown())
+	return ci.child->query(bet, k, v, frozen);
+
+      bet.bloom_probes++;
+      if (!ci.filter.may_contain(bloom_hash(k))) {
+	bet.bloom_negatives++;
+	if (!ci.child.is_in_memory())
+	  bet.bloom_loads_avoided++;
+	return false;
+      }
+      if (!ci.child->query(bet, k, v, frozen)) {
+	bet.bloom_false_positives++;
+	return false;
+      }
+      return true;
+    }
+
+    // Build a filter covering everything buffered in or below this
+    // node, sized for twice the keys there.  The keys are read from
+    // the whole subtree, since filters for different subtrees can't
+    // be combined into a bigger one without losing what they filter.
+    // flush_child() only rebuilds a filter once the keys added to it
+    // since it was built are about as many as it was built with, so
+    // this reads each message about once per level of the tree it
+    // passes through.
+    //
+    // The caller has us latched for writing (or is splitting us);
+    // our descendants are latched for reading on the way down.
+    bloom_filter subtree_filter(const betree &bet) const
+    {
+      bloom_filter f = bet.new_filter(2 * estimated_subtree_keys(bet));
+      if (f.is_unknown())
+	return f;
+      uint64_t nkeys = add_subtree_keys(bet, f, false);
+      if (f.is_full()) {
+	// Our guess was too low.
+	f = bet.new_filter(2 * nkeys);
+	add_subtree_keys(bet, f, false);
+      }
+      return f;
+    }
+
+    // Going by our buffer and our children's filters.
+    uint64_t estimated_subtree_keys(const betree &bet) const
+    {
+      uint64_t n = elements.size();
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	n += it->second.filter.is_unknown() ?
+	  bet.guess_keys(it->second.child_size) :
+	  it->second.filter.estimated_keys();
+      return n;
     }
 
-    std::pair<MessageKey<Key>, Message<Value> >
-    get_next_message_from_children(const MessageKey<Key> *mkey) const {
+    // Add the keys of the messages in and below us to f, and return
+    // how many messages there were.
+    uint64_t add_subtree_keys(const betree &bet, bloom_filter &f,
+			      bool latch = true) const
+    {
+      std::shared_lock<std::shared_mutex> l;
+      if (latch)
+	l = read_latch(bet);
+      uint64_t n = elements.size();
+      for (auto it = elements.begin(); it != elements.end(); ++it)
+	f.insert(bloom_hash(it->first.key));
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	n += it->second.child->add_subtree_keys(bet, f);
+      return n;
+    }
+
+    static void add_to_filter(bloom_filter &f, const message_map &elts)
+    {
+      if (f.is_unknown())
+	return;
+      for (auto it = elts.begin(); it != elts.end(); ++it)
+	f.insert(bloom_hash(it->first.key));
+    }
+
+    // Find the first message after *mkey (or the first message, if
+    // mkey is NULL) in our children.  Returns false if there is none.
+    bool get_next_message_from_children(const MessageKey<Key> *mkey,
+					std::pair<MessageKey<Key>, Message<Value> > &msg) const {
       if (mkey && *mkey < pivots.begin()->first)
 	mkey = NULL;
       auto it = mkey ? get_pivot(mkey->key) : pivots.begin();
       while (it != pivots.end()) {
-	try {
-	  return it->second.child->get_next_message(mkey);
-	} catch (std::out_of_range & e) {}
+	if (it->second.child->get_next_message(mkey, msg))
+	  return true;
 	++it;
       }
-      throw std::out_of_range("No more messages in any children");
+      return false;
     }
     
-    std::pair<MessageKey<Key>, Message<Value> >
-    get_next_message(const MessageKey<Key> *mkey) const {
+    // Find the first message after *mkey (or the first message, if
+    // mkey is NULL) in this subtree.  Returns false if there is none.
+    bool get_next_message(const MessageKey<Key> *mkey,
+			  std::pair<MessageKey<Key>, Message<Value> > &msg) const {
       auto it = mkey ? elements.upper_bound(*mkey) : elements.begin();
 
       if (is_leaf()) {
 	if (it == elements.end())
-	  throw std::out_of_range("No more messages in sub-tree");
-	return std::make_pair(it->first, it->second);
+	  return false;
+	msg = std::make_pair(it->first, it->second);
+	return true;
       }
 
       if (it == elements.end())
-	return get_next_message_from_children(mkey);
+	return get_next_message_from_children(mkey, msg);
       
-      try {
-	auto kids = get_next_message_from_children(mkey);
-	if (kids.first < it->first)
-	  return kids;
-	else 
-	  return std::make_pair(it->first, it->second);
-      } catch (std::out_of_range & e) {
-	return std::make_pair(it->first, it->second);	
-      }
+      if (get_next_message_from_children(mkey, msg) && msg.first < it->first)
+	return true;
+      msg = std::make_pair(it->first, it->second);
+      return true;
     }
     
+    // In the binary format the message buffer is written column by
+    // column (keys, timestamps, opcodes, values), so that buffers of
+    // plain-old-data keys and values turn into a handful of bulk
+    // writes instead of one small write per field.
+    void serialize_elements(std::iostream &fs, serialization_context &context) {
+      std::vector<Key> keys;
+      std::vector<uint64_t> timestamps;
+      std::vector<uint8_t> opcodes;
+      std::vector<Value> vals;
+      keys.reserve(elements.size());
+      timestamps.reserve(elements.size());
+      opcodes.reserve(elements.size());
+      vals.reserve(elements.size());
+      for (auto it = elements.begin(); it != elements.end(); ++it) {
+	keys.push_back(it->first.key);
+	timestamps.push_back(it->first.timestamp);
+	opcodes.push_back(it->second.opcode);
+	vals.push_back(it->second.val);
+      }
+      serialize(fs, context, keys);
+      serialize(fs, context, timestamps);
+      serialize(fs, context, opcodes);
+      serialize(fs, context, vals);
+    }
+
+    void deserialize_elements(std::iostream &fs, serialization_context &context) {
+      std::vector<Key> keys;
+      std::vector<uint64_t> timestamps;
+      std::vector<uint8_t> opcodes;
+      std::vector<Value> vals;
+      deserialize(fs, context, keys);
+      deserialize(fs, context, timestamps);
+      deserialize(fs, context, opcodes);
+      deserialize(fs, context, vals);
+      assert(keys.size() == timestamps.size() &&
+	     keys.size() == opcodes.size() &&
+	     keys.size() == vals.size());
+      for (size_t i = 0; i < keys.size(); i++)
+	elements.emplace_hint(elements.end(),
+			      MessageKey<Key>(keys[i], timestamps[i]),
+			      Message<Value>(opcodes[i], vals[i]));
+    }
+
     void _serialize(std::iostream &fs, serialization_context &context) {
+      if (context.format == BINARY_SERIALIZATION) {
+	serialize(fs, context, pivots);
+	serialize_elements(fs, context);
+	return;
+      }
       fs << "pivots:" << std::endl;
       serialize(fs, context, pivots);
       fs << "elements:" << std::endl;
@@ -630,48 +1137,644 @@ private:
     }
     
     void _deserialize(std::iostream &fs, serialization_context &context) {
-      std::string dummy;
-      fs >> dummy;
-      deserialize(fs, context, pivots);
-      fs >> dummy;
-      deserialize(fs, context, elements);
+      if (context.format == BINARY_SERIALIZATION) {
+	deserialize(fs, context, pivots);
+	deserialize_elements(fs, context);
+      } else {
+	std::string dummy;
+	fs >> dummy;
+	deserialize(fs, context, pivots);
+	fs >> dummy;
+	deserialize(fs, context, elements);
+      }
+      recount_bytes();
     }
 
     
   };
 
+  // A flush queued by node::flush_child(), which holds the node it
+  // flushes into pinned and latched until it runs.  Nothing latches
+  // the node's parent by then, so once the latch is dropped another
+  // writer may split the node and its parent let go of it; the job's
+  // own reference keeps it around until it is unpinned.
+  struct flush_job {
+    node_pointer child;
+    swap_space::pin<node> pn;
+    node *n;
+    std::unique_lock<std::shared_mutex> latch;
+    message_map elts;
+
+    flush_job(const node_pointer &c, swap_space::pin<node> &&p, node *nd,
+	      std::unique_lock<std::shared_mutex> &&l, message_map &&e)
+      : child(c),
+	pn(std::move(p)),
+	n(nd),
+	latch(std::move(l)),
+	elts(std::move(e))
+    {}
+  };
+
+public:
+  // Counters for the per-child Bloom filters.
+  class bloom_filter_stats {
+  public:
+    uint64_t probes = 0;          // filter lookups during queries
+    uint64_t negatives = 0;       // descents skipped by a filter
+    uint64_t false_positives = 0; // descents that found nothing
+    uint64_t loads_avoided = 0;   // skipped descents into on-disk children
+
+    double false_positive_rate(void) const {
+      uint64_t absent = negatives + false_positives;
+      return absent ? (double)false_positives / absent : 0.0;
+    }
+  };
+
+private:
+  static void check_bloom_bits_per_key(uint64_t bits) {
+    if (bits > 0 && !bloom_hashable<Key>)
+      throw std::invalid_argument("Bloom filters need std::hash of the key type");
+  }
+
+  // A filter with room for nkeys keys.
+  bloom_filter new_filter(uint64_t nkeys) const {
+    if (bloom_bits_per_key == 0)
+      return bloom_filter();
+    uint8_t nhashes = (uint8_t)std::max<uint64_t>(1, bloom_bits_per_key * 69 / 100);
+    return bloom_filter(bloom_bits_per_key * nkeys, nhashes);
+  }
+
+  // How many messages fit in size, in the tree's node size unit.  In
+  // byte mode, guess at 32 bytes per message.
+  uint64_t guess_keys(uint64_t size) const {
+    return size_unit == NODE_SIZE_IN_BYTES ? size / 32 : size;
+  }
+
+  // Set for trees made by open(), which own them.  Declared before
+  // root so that they outlive it.
+  std::unique_ptr<backing_store> owned_store;
+  std::unique_ptr<swap_space> owned_ss;
   swap_space *ss;
   uint64_t min_flush_size;
   uint64_t max_node_size;
   uint64_t min_node_size;
+  uint64_t bloom_bits_per_key;
+  int size_unit;
   node_pointer root;
+  // Only touched with the root latched (see stamp()).
   uint64_t next_timestamp = 1; // Nothing has a timestamp of 0
   Value default_value;
+  // The bloom_filter_stats counters, bumped by concurrent readers.
+  mutable std::atomic<uint64_t> bloom_probes{0};
+  mutable std::atomic<uint64_t> bloom_negatives{0};
+  mutable std::atomic<uint64_t> bloom_false_positives{0};
+  mutable std::atomic<uint64_t> bloom_loads_avoided{0};
+  bool concurrent = false;
+  // Protects root in concurrent mode.
+  mutable std::mutex root_mutex;
+  // Readers pass through this before reading root.  Writers hold it
+  // while waiting for the root's latch, so readers can't starve them.
+  mutable std::mutex turnstile;
+  // Bumped whenever root changes.  A reader that finds it unchanged
+  // after latching the root it read knows that it latched the root,
+  // without taking root_mutex (which the writer may be holding while
+  // it waits for the reader).
+  std::atomic<uint64_t> root_version{0};
+  // Trees in which this thread has a cursor holding latches.  Only
+  // used to catch nested reads (see set_concurrent()).
+  inline static thread_local std::vector<const betree *> latching_cursors;
+
+  node_pointer load_root(uint64_t &version) const {
+    if (!concurrent) {
+      version = root_version;
+      return root;
+    }
+    assert(std::find(latching_cursors.begin(), latching_cursors.end(), this) ==
+	   latching_cursors.end());
+    { std::lock_guard<std::mutex> wait_for_writer(turnstile); }
+    std::lock_guard<std::mutex> lock(root_mutex);
+    version = root_version;
+    return root;
+  }
+
+  // Persistence, for trees made by open().  The directory holds the
+  // backing store (objects/), the latest checkpoint (checkpoint) and
+  // the log of the upserts since then (log.<n>).  Each checkpoint
+  // starts a new log.
+  std::string dir;
+  std::unique_ptr<write_ahead_log> log;
+  uint64_t log_number = 0;
+  uint64_t log_group_size = 1;
+  uint64_t checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+  // Upserts hold this shared (in concurrent mode or with a log), so
+  // checkpoints and snapshots see no half-done ones.
+  std::shared_mutex upsert_latch;
+
+  // Copy-on-write snapshots (see snapshot()).  Nodes are stamped with
+  // generation when they are made, and each snapshot takes the
+  // current generation and starts a new one.  Nodes of a generation
+  // up to frozen_generation, the newest one a snapshot still uses,
+  // may be shared with it, so writers copy them instead of writing
+  // to them.  Only changed with upsert_latch held exclusively.
+  uint64_t generation = 1;
+  uint64_t frozen_generation = 0;
+  std::set<uint64_t> live_snapshots;
+
+  node_pointer allocate_node(node *n) {
+    n->generation = generation;
+    return ss->allocate(n);
+  }
+
+  bool is_frozen(const node &n) const {
+    return frozen_generation > 0 && n.generation <= frozen_generation;
+  }
+
+  node_pointer copy_node(const node &n) {
+    node *c = new node;
+    c->pivots = n.pivots;
+    c->elements = n.elements;
+    c->element_bytes = n.element_bytes;
+    c->pivot_bytes = n.pivot_bytes;
+    c->filter_bytes = n.filter_bytes;
+    return allocate_node(c);
+  }
+
+  // With the old root latched, so readers never see the new one
+  // before we're done with it.
+  void replace_root(const node_pointer &new_root) {
+    std::unique_lock<std::mutex> lock(root_mutex, std::defer_lock);
+    if (concurrent)
+      lock.lock();
+    root = new_root;
+    root_version++;
+  }
+
+  void release_snapshot(uint64_t g) {
+    std::unique_lock<std::shared_mutex> lock(upsert_latch);
+    live_snapshots.erase(g);
+    frozen_generation = live_snapshots.empty() ? 0 : *live_snapshots.rbegin();
+  }
+
+  // For open(): recover() sets up root.
+  betree(const std::string &path, swap_space *sspace, uint64_t maxnodesize,
+	 uint64_t minnodesize, uint64_t minflushsize, uint64_t bloombitsperkey,
+	 int sizeunit) :
+    ss(sspace),
+    min_flush_size(minflushsize),
+    max_node_size(maxnodesize),
+    min_node_size(minnodesize),
+    bloom_bits_per_key(bloombitsperkey),
+    size_unit(sizeunit),
+    dir(path)
+  {}
+
+  std::string log_filename(uint64_t n) const {
+    return dir + "/log." + std::to_string(n);
+  }
+
+  // A log record holds the first timestamp, as 8 little-endian bytes
+  // that log_record() leaves zero for flush_root() to fill in once it
+  // knows it, followed by the messages with their timestamps made
+  // relative to it.
+  std::string log_record(message_map &elts) {
+    std::stringstream out;
+    serialization_context ctxt(*ss);
+    out.write("\0\0\0\0\0\0\0\0", 8);
+    serialize(out, ctxt, (uint64_t)elts.size());
+    for (auto it = elts.begin(); it != elts.end(); ++it) {
+      MessageKey<Key> mkey = it->first;
+      Message<Value> msg = it->second;
+      serialize(out, ctxt, mkey);
+      serialize(out, ctxt, msg);
+    }
+    return out.str();
+  }
+
+  static void set_log_record_timestamp(std::string &record, uint64_t ts) {
+    for (int i = 0; i < 8; i++)
+      record[i] = (char)((ts >> (8 * i)) & 0xff);
+  }
+
+  void replay_log_record(const std::string &record) {
+    std::stringstream in(record);
+    serialization_context ctxt(*ss);
+    uint64_t ts = 0;
+    for (int i = 0; i < 8; i++)
+      ts |= (uint64_t)(unsigned char)in.get() << (8 * i);
+    uint64_t count;
+    deserialize(in, ctxt, count);
+    message_map elts;
+    for (uint64_t i = 0; i < count; i++) {
+      MessageKey<Key> mkey;
+      Message<Value> msg;
+      deserialize(in, ctxt, mkey);
+      deserialize(in, ctxt, msg);
+      elts.emplace_hint(elts.end(), mkey, msg);
+    }
+    next_timestamp = ts;
+    flush_root(elts);
+  }
+
+  // Load the latest checkpoint, if there is one, and replay the log
+  // that follows it.  Then checkpoint, which starts a fresh log.
+  void recover(void) {
+    std::string contents;
+    if (read_file(dir + "/checkpoint", contents)) {
+      std::stringstream in(contents);
+      serialization_context ctxt(*ss);
+      std::string magic;
+      uint64_t sizeunit;
+      deserialize(in, ctxt, magic);
+      if (magic != "betree-checkpoint-1")
+	throw std::runtime_error("Not a betree checkpoint: " + dir + "/checkpoint");
+      ss->read_checkpoint(in);
+      deserialize(in, ctxt, root);
+      deserialize(in, ctxt, next_timestamp);
+      deserialize(in, ctxt, log_number);
+      deserialize(in, ctxt, max_node_size);
+      deserialize(in, ctxt, min_node_size);
+      deserialize(in, ctxt, min_flush_size);
+      deserialize(in, ctxt, bloom_bits_per_key);
+      deserialize(in, ctxt, sizeunit);
+      size_unit = sizeunit;
+    } else {
+      root = allocate_node(new node);
+    }
+
+    {
+      write_ahead_log old_log(log_filename(log_number));
+      old_log.replay([this](const std::string &record) {
+	  replay_log_record(record);
+	});
+    }
+    write_checkpoint();
+  }
+
+  // Write every dirty node back, record where the root is, and start
+  // a new log.  The old checkpoint and log stay valid until the new
+  // checkpoint file has replaced the old one.  Called with
+  // upsert_latch held exclusively (or before anyone else can use
+  // the tree).
+  void write_checkpoint(void) {
+    uint64_t new_log_number = log_number + 1;
+    std::filesystem::remove(log_filename(new_log_number));
+    std::unique_ptr<write_ahead_log> new_log(new write_ahead_log(log_filename(new_log_number)));
+    new_log->set_group_size(log_group_size);
+    if (log)
+      log->sync();
+
+    std::stringstream out;
+    serialization_context ctxt(*ss);
+    serialize(out, ctxt, std::string("betree-checkpoint-1"));
+    ss->write_checkpoint(out);
+    serialize(out, ctxt, root);
+    serialize(out, ctxt, next_timestamp);
+    serialize(out, ctxt, new_log_number);
+    serialize(out, ctxt, max_node_size);
+    serialize(out, ctxt, min_node_size);
+    serialize(out, ctxt, min_flush_size);
+    serialize(out, ctxt, bloom_bits_per_key);
+    serialize(out, ctxt, (uint64_t)size_unit);
+    replace_file_durably(dir + "/checkpoint", out.str());
+    ss->commit_checkpoint();
+
+    log = std::move(new_log);
+    std::filesystem::remove(log_filename(log_number));
+    log_number = new_log_number;
+  }
+
+  // log is only replaced under upsert_latch, so this tells the
+  // threads that don't hold it whether the tree has one.
+  bool persistent(void) const {
+    return !dir.empty();
+  }
   
 public:
+  // If bloombitsperkey is non-zero, every child pointer carries a
+  // Bloom filter covering the keys in that child's subtree, with
+  // about 2 * bloombitsperkey bits per key, and queries skip children
+  // whose filter rules the key out.  So each level of internal nodes
+  // holds filters for the whole tree below it.  Filters need
+  // std::hash to be enabled for Key; for other keys, bloombitsperkey
+  // must be 0.
+  //
+  // maxnodesize, minnodesize and minflushsize are in messages, or in
+  // serialized bytes if sizeunit is NODE_SIZE_IN_BYTES (see
+  // DEFAULT_MAX_NODE_BYTES and DEFAULT_MIN_FLUSH_BYTES).
   betree(swap_space *sspace,
 	 uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
 	 uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
-	 uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE) :
+	 uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE,
+	 uint64_t bloombitsperkey = 0,
+	 int sizeunit = NODE_SIZE_IN_MESSAGES) :
     ss(sspace),
     min_flush_size(minflushsize),
     max_node_size(maxnodesize),
-    min_node_size(minnodesize)
+    min_node_size(minnodesize),
+    bloom_bits_per_key(bloombitsperkey),
+    size_unit(sizeunit)
+  {
+    check_bloom_bits_per_key(bloombitsperkey);
+    root = allocate_node(new node);
+  }
+
+  // Open the tree persisted in directory path, creating it if it
+  // doesn't exist.  The tree keeps its nodes in a backing store under
+  // path, with a cache of cache_size nodes, and logs every upsert
+  // before it returns (see set_log_group_size()).  Every
+  // checkpoint_interval bytes of log (see set_checkpoint_interval()),
+  // and when the tree is destroyed, it checkpoints: all dirty nodes
+  // are written back and the location of the root is recorded.  The
+  // versions of the nodes that checkpoint names are kept until the
+  // next one, so reopening after a crash loads the last checkpoint
+  // and replays the log from there.  An existing tree keeps the node
+  // sizes and Bloom filter setting it was created with.
+  static std::unique_ptr<betree> open(const std::string &path,
+				      uint64_t cache_size = DEFAULT_OPEN_CACHE_SIZE,
+				      uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
+				      uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
+				      uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE,
+				      uint64_t bloombitsperkey = 0,
+				      int sizeunit = NODE_SIZE_IN_MESSAGES)
+  {
+    check_bloom_bits_per_key(bloombitsperkey);
+    std::filesystem::create_directories(path + "/objects");
+    backing_store *store = new one_file_per_object_backing_store(path + "/objects", true);
+    swap_space *sspace = new swap_space(store, cache_size);
+    // Write-backs between checkpoints needn't be durable.
+    sspace->set_write_group_size(256);
+    std::unique_ptr<betree> t(new betree(path, sspace, maxnodesize, minnodesize,
+					 minflushsize, bloombitsperkey, sizeunit));
+    t->owned_store.reset(store);
+    t->owned_ss.reset(sspace);
+    t->recover();
+    return t;
+  }
+
+  ~betree(void) {
+    assert(live_snapshots.empty());
+    if (log) {
+      checkpoint();
+      log.reset();
+      ss->abandon(root);
+    }
+  }
+
+  // For trees made by open(), checkpoint now (see open()).  For other
+  // trees, this is swap_space::checkpoint().
+  void checkpoint(void) {
+    if (!persistent()) {
+      ss->checkpoint();
+      return;
+    }
+    std::unique_lock<std::shared_mutex> lock(upsert_latch);
+    write_checkpoint();
+  }
+
+  // Make upserts durable in groups of n log records (see
+  // write_ahead_log::set_group_size()).  With the default of 1, an
+  // upsert is durable when it returns, and concurrent upserts share
+  // log syncs.
+  void set_log_group_size(uint64_t n) {
+    assert(n > 0);
+    log_group_size = n;
+    if (log)
+      log->set_group_size(n);
+  }
+
+  void set_checkpoint_interval(uint64_t bytes) {
+    checkpoint_interval = bytes;
+  }
+
+  bloom_filter_stats get_bloom_filter_stats(void) const {
+    bloom_filter_stats s;
+    s.probes = bloom_probes;
+    s.negatives = bloom_negatives;
+    s.false_positives = bloom_false_positives;
+    s.loads_avoided = bloom_loads_avoided;
+    return s;
+  }
+
+  void reset_bloom_filter_stats(void) {
+    bloom_probes = 0;
+    bloom_negatives = 0;
+    bloom_false_positives = 0;
+    bloom_loads_avoided = 0;
+  }
+
+  // Let any number of threads look things up (with find(), query()
+  // or iterators) and upsert at the same time.  Readers hold each
+  // node on their root-to-leaf path latched shared, since a node's
+  // buffered messages are applied to what its children return, and
+  // writers latch every node they flush into exclusively, top down.
+  // A writer only keeps a node latched while flushing into its
+  // children for as long as one of them might split; the rest of the
+  // flush happens after it lets go of the node (and the root), so
+  // writers bound for different subtrees overlap.  An open iterator
+  // keeps its path latched, so writers wait for iterators in their
+  // way to move on or be destroyed.  While a thread
+  // has an iterator open (i.e. not at end()), it must not upsert,
+  // look anything up, or open or copy another iterator on the same
+  // tree, since that would wait on latches it holds itself.  This
+  // makes the swap_space thread-safe too.  Only change it while no other thread
+  // is using the tree.
+  void set_concurrent(bool c) {
+    concurrent = c;
+    ss->set_thread_safe(c);
+  }
+
+private:
+  // Push a set of messages into the root and handle a split of the
+  // root if it occurs.  A large batch can split the root into more
+  // children than fit in a single node, so keep growing the tree
+  // until the new root is small enough.
+  //
+  // The old root stays latched until the new one is in place, so
+  // readers never see a split root with nothing in it.
+  //
+  // The messages in elts are stamped 0, 1, ... in upsert order, and
+  // get their real timestamps once we hold the root, so that
+  // timestamps follow the order in which messages enter the tree even
+  // with several writers.  Otherwise a message could land in the root
+  // after a newer one for the same key had been flushed below it.
+  //
+  // Trees made by open() log the messages, with their timestamps,
+  // right after stamping them, so the log is in timestamp order, and
+  // wait for the log record to be committed at the end.
+  void flush_root(message_map &elts)
   {
-    root = ss->allocate(new node);
+    std::string record;
+    std::shared_lock<std::shared_mutex> upserting(upsert_latch, std::defer_lock);
+    if (concurrent || persistent())
+      upserting.lock();
+    // Not while replaying the log.
+    if (log)
+      record = log_record(elts);
+
+    // Keeps the old root alive, after a split, until we unpin it.
+    node_pointer old_root;
+    swap_space::pin<node> pn;
+    node *r;
+    std::unique_lock<std::shared_mutex> l;
+    while (true) {
+      l = std::unique_lock<std::shared_mutex>();
+      pn = swap_space::pin<node>();
+      uint64_t version;
+      std::unique_lock<std::mutex> block_readers(turnstile, std::defer_lock);
+      if (concurrent)
+	block_readers.lock();
+      old_root = load_root_for_writing(version);
+      pn = old_root.get_pin();
+      r = pn.operator->();
+      l = r->write_latch(*this);
+      if (!concurrent || root_version == version)
+	break;
+    }
+    if (is_frozen(*r)) {
+      // A snapshot shares the root, so write to a copy of it.
+      node_pointer copy = copy_node(*r);
+      swap_space::pin<node> cpn = copy.get_pin();
+      node *c = cpn.operator->();
+      std::unique_lock<std::shared_mutex> cl = c->write_latch(*this);
+      replace_root(copy);
+      l = std::move(cl);
+      pn = cpn;
+      old_root = copy;
+      r = c;
+    }
+    uint64_t lsn = 0;
+    if (log) {
+      set_log_record_timestamp(record, next_timestamp);
+      lsn = log->append(record);
+    }
+    stamp(elts);
+
+    flush_jobs jobs;
+    pivot_map new_nodes = r->flush(*this, elts, concurrent ? &jobs : NULL);
+    if (!new_nodes.empty()) {
+      node_pointer new_root;
+      while (new_nodes.size() > 0) {
+	new_root = allocate_node(new node);
+	new_root->pivots = new_nodes;
+	new_root->recount_bytes();
+	new_nodes.clear();
+	if (new_root->size(*this) >= max_node_size)
+	  new_nodes = new_root->split(*this);
+      }
+      replace_root(new_root);
+    }
+    l = std::unique_lock<std::shared_mutex>();
+    pn = swap_space::pin<node>();
+
+    // Each job's node stays latched until its own flush is done, and
+    // queues its children's flushes latched, so jobs still go top
+    // down.
+    while (!jobs.empty()) {
+      flush_job job = std::move(jobs.back());
+      jobs.pop_back();
+      pivot_map split = job.n->flush(*this, job.elts, &jobs, false);
+      assert(split.empty());
+    }
+
+    if (log) {
+      log->commit(lsn);
+      bool full = log->size() >= checkpoint_interval;
+      upserting.unlock();
+      if (full) {
+	std::unique_lock<std::shared_mutex> lock(upsert_latch);
+	if (log->size() >= checkpoint_interval)
+	  write_checkpoint();
+      }
+    }
   }
 
+  node_pointer load_root_for_writing(uint64_t &version) {
+    if (!concurrent) {
+      version = root_version;
+      return root;
+    }
+    assert(std::find(latching_cursors.begin(), latching_cursors.end(), this) ==
+	   latching_cursors.end());
+    std::lock_guard<std::mutex> lock(root_mutex);
+    version = root_version;
+    return root;
+  }
+
+  // Replace the per-call timestamps 0, 1, ... in elts with fresh
+  // ones from next_timestamp, keeping their order.
+  void stamp(message_map &elts) {
+    message_map stamped;
+    for (auto it = elts.begin(); it != elts.end(); ++it)
+      stamped.emplace_hint(stamped.end(),
+			   MessageKey<Key>(it->first.key,
+					   next_timestamp + it->first.timestamp),
+			   it->second);
+    next_timestamp += elts.size();
+    elts.swap(stamped);
+  }
+
+public:
   // Insert the specified message and handle a split of the root if it
   // occurs.
   void upsert(int opcode, Key k, Value v)
   {
     message_map tmp;
-    tmp[MessageKey<Key>(k, next_timestamp++)] = Message<Value>(opcode, v);
-    pivot_map new_nodes = root->flush(*this, tmp);
-    if (new_nodes.size() > 0) {
-      root = ss->allocate(new node);
-      root->pivots = new_nodes;
-    }
+    tmp[MessageKey<Key>(k, 0)] = Message<Value>(opcode, v);
+    flush_root(tmp);
+  }
+
+  // Batched upserts.  The messages in [first, last) get consecutive
+  // timestamps (so later messages for the same key win) and are
+  // pushed into the tree as a single message_map, so the whole batch
+  // reaches the leaves in one descent.  Batches sorted by key are
+  // cheapest to build.
+  //
+  // upsert_batch takes std::pair<Key, Message<Value> >s,
+  // insert_batch and update_batch take std::pair<Key, Value>s and
+  // erase_batch takes Keys.
+  template<class InputIterator>
+  void upsert_batch(InputIterator first, InputIterator last)
+  {
+    message_map tmp;
+    for (uint64_t i = 0; first != last; ++first, ++i)
+      tmp.emplace_hint(tmp.end(),
+		       MessageKey<Key>(first->first, i),
+		       first->second);
+    flush_root(tmp);
+  }
+
+  template<class InputIterator>
+  void upsert_batch(int opcode, InputIterator first, InputIterator last)
+  {
+    message_map tmp;
+    for (uint64_t i = 0; first != last; ++first, ++i)
+      tmp.emplace_hint(tmp.end(),
+		       MessageKey<Key>(first->first, i),
+		       Message<Value>(opcode, first->second));
+    flush_root(tmp);
+  }
+
+  template<class InputIterator>
+  void insert_batch(InputIterator first, InputIterator last)
+  {
+    upsert_batch(INSERT, first, last);
+  }
+
+  template<class InputIterator>
+  void update_batch(InputIterator first, InputIterator last)
+  {
+    upsert_batch(UPDATE, first, last);
+  }
+
+  template<class InputIterator>
+  void erase_batch(InputIterator first, InputIterator last)
+  {
+    message_map tmp;
+    for (uint64_t i = 0; first != last; ++first, ++i)
+      tmp.emplace_hint(tmp.end(),
+		       MessageKey<Key>(*first, i),
+		       Message<Value>(DELETE, default_value));
+    flush_root(tmp);
   }
 
   void insert(Key k, Value v)
@@ -689,10 +1792,47 @@ public:
     upsert(DELETE, k, default_value);
   }
   
+  // Look up k.  Returns an empty optional if k is not in the tree.
+  std::optional<Value> find(Key k) const
+  {
+    while (true) {
+      Value v;
+      uint64_t version;
+      node_pointer r = load_root(version);
+      bool found = r->query(*this, k, v);
+      // The root is replaced while the old one is latched, so if it
+      // hasn't been replaced yet, r was the root while we read it.
+      if (!concurrent || root_version == version) {
+	if (found)
+	  return v;
+	return std::nullopt;
+      }
+    }
+  }
+
+  // The keys at which the root's children start, in order (none if
+  // the root is a leaf).  They divide the tree into ranges of roughly
+  // equal size, so they are where sharded_betree splits a shard.
+  std::vector<Key> root_pivots(void) const
+  {
+    while (true) {
+      std::vector<Key> keys;
+      uint64_t version;
+      node_pointer r = load_root(version);
+      r->pivot_keys(*this, keys);
+      if (!concurrent || root_version == version)
+	return keys;
+    }
+  }
+
+  // Compatibility wrapper around find() that throws
+  // std::out_of_range if k is not in the tree.
   Value query(Key k)
   {
-    Value v = root->query(*this, k);
-    return v;
+    std::optional<Value> v = find(k);
+    if (!v)
+      throw std::out_of_range("Key does not exist");
+    return *v;
   }
 
   void dump_messages(void) {
@@ -700,23 +1840,269 @@ public:
 
     std::cout << "############### BEGIN DUMP ##############" << std::endl;
     
-    try {
-      current = root->get_next_message(NULL);
-      do { 
-	std::cout << current.first.key       << " "
-		  << current.first.timestamp << " "
-		  << current.second.opcode   << " "
-		  << current.second.val      << std::endl;
-	current = root->get_next_message(&current.first);
-      } while (1);
-    } catch (std::out_of_range e) {}
+    bool valid = root->get_next_message(NULL, current);
+    while (valid) {
+      std::cout << current.first.key       << " "
+		<< current.first.timestamp << " "
+		<< current.second.opcode   << " "
+		<< current.second.val      << std::endl;
+      MessageKey<Key> prev = current.first;
+      valid = root->get_next_message(&prev, current);
+    }
   }
 
+  // A merging cursor over all the messages in the tree, in
+  // MessageKey order.  It keeps the current root-to-leaf path pinned,
+  // with one frame per level holding an iterator into that node's
+  // buffer and an iterator to the child being scanned below it.  The
+  // buffer heads of all the frames are merged with a small heap.
+  // When the leaf is used up, only the levels that have run out of
+  // children are unpinned, and we descend again from the lowest level
+  // that still has children left, so a scan touches each node on
+  // the way roughly once instead of walking down from the root for
+  // every message.
+  //
+  // Upserts to the tree invalidate any open cursors.  In concurrent
+  // mode, the pinned path is latched shared, so upserts wait for the
+  // cursor instead.  Cursors over a snapshot (frozen_root non-NULL)
+  // need neither.
+  class cursor {
+  public:
+    cursor(const betree &bet, const node_pointer *frozen_root = NULL)
+      : bet(bet),
+	frozen_root(frozen_root),
+	frames(),
+	heap(),
+	resume_valid(false),
+	resume()
+    {}
+
+    // Copies are re-positioned from scratch, since the pins and
+    // buffer iterators can't be shared.
+    cursor(const cursor &other)
+      : bet(other.bet),
+	frozen_root(other.frozen_root),
+	frames(),
+	heap(),
+	resume_valid(false),
+	resume()
+    {
+      if (!other.frames.empty())
+	seek(other.resume_valid ? &other.resume : NULL);
+    }
+
+    cursor &operator=(const cursor &other) = delete;
+
+    ~cursor(void) {
+      frames.clear();
+      set_latching(false);
+    }
+
+    // Position the cursor so that next() returns the first message
+    // strictly after *mkey, or the first message in the tree if mkey
+    // is NULL.
+    void seek(const MessageKey<Key> *mkey) {
+      resume_valid = mkey != NULL;
+      if (mkey)
+	resume = *mkey;
+      if (frozen_root) {
+	frames.clear();
+	heap.clear();
+	descend(*frozen_root, false, Key(), mkey);
+	return;
+      }
+      while (true) {
+	frames.clear();
+	heap.clear();
+	set_latching(false);
+	uint64_t version;
+	node_pointer r = bet.load_root(version);
+	descend(r, false, Key(), mkey);
+	if (!bet.concurrent || bet.root_version == version)
+	  break;
+      }
+      set_latching(bet.concurrent);
+    }
+
+    // Fetch the next message.  Returns false once the cursor has run
+    // off the end of the tree, at which point all pins are released.
+    bool next(std::pair<MessageKey<Key>, Message<Value> > &msg) {
+      while (!frames.empty()) {
+	// Everything below the upper bound of the leaf's key range is
+	// covered by the frames on the current path.
+	const frame &leaf = frames.back();
+	if (!heap.empty()) {
+	  frame &f = frames[heap.front()];
+	  if (!leaf.has_hi || f.elt->first < leaf.hi) {
+	    std::pop_heap(heap.begin(), heap.end(), heap_cmp(frames));
+	    msg = std::make_pair(f.elt->first, f.elt->second);
+	    ++f.elt;
+	    if (f.elt != f.elt_end)
+	      std::push_heap(heap.begin(), heap.end(), heap_cmp(frames));
+	    else
+	      heap.pop_back();
+	    resume_valid = true;
+	    resume = msg.first;
+	    return true;
+	  }
+	}
+	advance();
+      }
+      return false;
+    }
+
+  private:
+    class frame {
+    public:
+      frame(const node_pointer &np)
+	: np(np),
+	  pn(&this->np),
+	  has_hi(false),
+	  hi()
+      {}
+
+      frame(const frame &other) = delete;
+      frame &operator=(const frame &other) = delete;
+
+      node_pointer np;
+      swap_space::pin<node> pn;
+      std::shared_lock<std::shared_mutex> latch;
+      typename message_map::const_iterator elt;
+      typename message_map::const_iterator elt_end;
+      typename pivot_map::const_iterator child;
+      typename pivot_map::const_iterator child_end;
+      // Exclusive upper bound on the keys in this node's subtree.
+      bool has_hi;
+      Key hi;
+    };
+
+    // Orders frame indices so that the heap yields the frame with the
+    // smallest buffer head first.
+    class heap_cmp {
+    public:
+      heap_cmp(const std::deque<frame> &frames) : frames(frames) {}
+      bool operator()(size_t a, size_t b) const {
+	return frames[b].elt->first < frames[a].elt->first;
+      }
+      const std::deque<frame> &frames;
+    };
+
+    // Pin the path from np down to a leaf, positioning each level
+    // just after mkey (or at its beginning if mkey is NULL).
+    void descend(node_pointer np, bool has_hi, Key hi,
+		 const MessageKey<Key> *mkey) {
+      while (true) {
+	frames.emplace_back(np);
+	frame &f = frames.back();
+	f.has_hi = has_hi;
+	f.hi = hi;
+	const swap_space::pin<node> &cpn = f.pn;
+	const node *n = cpn.operator->();
+	f.latch = n->read_latch(bet, frozen_root != NULL);
+	f.elt = mkey ? n->elements.upper_bound(*mkey) : n->elements.begin();
+	f.elt_end = n->elements.end();
+	if (f.elt != f.elt_end) {
+	  heap.push_back(frames.size() - 1);
+	  std::push_heap(heap.begin(), heap.end(), heap_cmp(frames));
+	}
+	if (n->is_leaf())
+	  return;
+
+	f.child_end = n->pivots.end();
+	if (mkey && !(mkey->key < n->pivots.begin()->first))
+	  f.child = n->get_pivot(mkey->key);
+	else
+	  f.child = n->pivots.begin();
+	child_bounds(f, has_hi, hi);
+	prefetch_next_child(f);
+	np = f.child->second.child;
+      }
+    }
+
+    void child_bounds(const frame &f, bool &has_hi, Key &hi) {
+      auto next_child = std::next(f.child);
+      if (next_child != f.child_end) {
+	has_hi = true;
+	hi = next_child->first;
+      } else {
+	has_hi = f.has_hi;
+	hi = f.hi;
+      }
+    }
+
+    // Start reading the child after f's current one while we scan
+    // this one.
+    void prefetch_next_child(const frame &f) {
+      auto next_child = std::next(f.child);
+      if (next_child != f.child_end)
+	bet.ss->prefetch(next_child->second.child);
+    }
+
+    // The leaf's key range is exhausted: unpin it and every ancestor
+    // that has no children left, then descend into the next child.
+    void advance(void) {
+      frames.pop_back();
+      while (!frames.empty()) {
+	frame &f = frames.back();
+	++f.child;
+	if (f.child != f.child_end) {
+	  rebuild_heap();
+	  bool has_hi;
+	  Key hi;
+	  child_bounds(f, has_hi, hi);
+	  prefetch_next_child(f);
+	  descend(f.child->second.child, has_hi, hi, NULL);
+	  return;
+	}
+	frames.pop_back();
+      }
+      heap.clear();
+      set_latching(false);
+    }
+
+    // Keep betree::latching_cursors up to date.
+    void set_latching([[maybe_unused]] bool l) {
+#ifndef NDEBUG
+      if (l == latching)
+	return;
+      latching = l;
+      if (l) {
+	latching_cursors.push_back(&bet);
+      } else {
+	auto it = std::find(latching_cursors.begin(), latching_cursors.end(), &bet);
+	assert(it != latching_cursors.end());
+	latching_cursors.erase(it);
+      }
+#endif
+    }
+
+    void rebuild_heap(void) {
+      heap.erase(std::remove_if(heap.begin(), heap.end(),
+				[this](size_t i) {
+				  return i >= frames.size() ||
+				    frames[i].elt == frames[i].elt_end;
+				}),
+		 heap.end());
+      std::make_heap(heap.begin(), heap.end(), heap_cmp(frames));
+    }
+
+    const betree &bet;
+    const node_pointer *frozen_root;
+    std::deque<frame> frames;
+    std::vector<size_t> heap;
+    // Where to re-position a copy of this cursor.
+    bool resume_valid;
+    MessageKey<Key> resume;
+    // Whether we hold latches, in concurrent mode.
+    bool latching = false;
+  };
+
   class iterator {
   public:
 
     iterator(const betree &bet)
       : bet(bet),
+	cur(bet),
 	position(),
 	is_valid(false),
 	pos_is_valid(false),
@@ -724,19 +2110,20 @@ public:
 	second()
     {}
 
-    iterator(const betree &bet, const MessageKey<Key> *mkey)
+    iterator(const betree &bet, const MessageKey<Key> *mkey,
+	     const node_pointer *frozen_root = NULL)
       : bet(bet),
+	cur(bet, frozen_root),
 	position(),	
 	is_valid(false),
 	pos_is_valid(false),
 	first(),
 	second()
     {
-      try {
-	position = bet.root->get_next_message(mkey);
-	pos_is_valid = true;
+      cur.seek(mkey);
+      pos_is_valid = cur.next(position);
+      if (pos_is_valid)
 	setup_next_element();
-      } catch (std::out_of_range & e) {}
     }
 
     void apply(const MessageKey<Key> &msgkey, const Message<Value> &msg) {
@@ -766,11 +2153,7 @@ public:
       is_valid = false;
       while (pos_is_valid && (!is_valid || position.first.key == first)) {
 	apply(position.first, position.second);
-	try {
-	  position = bet.root->get_next_message(&position.first);
-	} catch (std::exception & e) {
-	  pos_is_valid = false;
-	}
+	pos_is_valid = cur.next(position);
       }
     }
 
@@ -792,6 +2175,7 @@ public:
     }
     
     const betree &bet;
+    cursor cur;
     std::pair<MessageKey<Key>, Message<Value> > position;
     bool is_valid;
     bool pos_is_valid;
@@ -816,4 +2200,95 @@ public:
   iterator end(void) const {
     return iterator(*this);
   }
+
+  // A read-only view of the tree as of the snapshot() call that made
+  // it.  Its iterators must not outlive it.
+  class snapshot_handle {
+  public:
+    snapshot_handle(snapshot_handle &&other)
+      : bet(other.bet),
+	root(other.root),
+	generation(other.generation)
+    {
+      other.bet = NULL;
+    }
+
+    snapshot_handle(const snapshot_handle &other) = delete;
+    snapshot_handle &operator=(const snapshot_handle &other) = delete;
+
+    ~snapshot_handle(void) {
+      if (bet == NULL)
+	return;
+      // Free whatever only we were using before letting writers
+      // write to what's left.
+      root = node_pointer();
+      bet->release_snapshot(generation);
+    }
+
+    std::optional<Value> find(Key k) const
+    {
+      Value v;
+      if (root->query(*bet, k, v, true))
+	return v;
+      return std::nullopt;
+    }
+
+    Value query(Key k) const
+    {
+      std::optional<Value> v = find(k);
+      if (!v)
+	throw std::out_of_range("Key does not exist");
+      return *v;
+    }
+
+    iterator begin(void) const {
+      return iterator(*bet, NULL, &root);
+    }
+
+    iterator lower_bound(Key key) const {
+      MessageKey<Key> tmp = MessageKey<Key>::range_start(key);
+      return iterator(*bet, &tmp, &root);
+    }
+
+    iterator upper_bound(Key key) const {
+      MessageKey<Key> tmp = MessageKey<Key>::range_end(key);
+      return iterator(*bet, &tmp, &root);
+    }
+
+    iterator end(void) const {
+      return iterator(*bet);
+    }
+
+  private:
+    friend class betree;
+
+    snapshot_handle(betree *bet, const node_pointer &root, uint64_t generation)
+      : bet(bet),
+	root(root),
+	generation(generation)
+    {}
+
+    betree *bet;
+    node_pointer root;
+    uint64_t generation;
+  };
+
+  // Freeze the tree as it is now.  The snapshot shares every node
+  // with the tree; upserts copy a shared node, and the path above
+  // it, before writing to it, so the snapshot never changes and old
+  // versions of nodes live as long as a snapshot uses them.  Reading
+  // a snapshot takes no latches, so scans of it neither wait for
+  // writers nor hold them up, and may be mixed with reads of the
+  // live tree in the same thread.  Release every snapshot before
+  // destroying the tree.  Snapshots don't survive reopening a tree
+  // made by open(); the nodes only they use leak if it crashes while
+  // one is open.
+  snapshot_handle snapshot(void)
+  {
+    std::unique_lock<std::shared_mutex> lock(upsert_latch);
+    uint64_t g = generation++;
+    live_snapshots.insert(g);
+    frozen_generation = g;
+    return snapshot_handle(this, root, g);
+  }
 };
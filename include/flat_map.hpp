@@ -0,0 +1,228 @@
+// A sorted-array replacement for std::map.
+//
+// Keys and values are kept in two parallel, contiguous, sorted
+// arrays, so lookups are a binary search over the key array and
+// iteration is sequential in memory.  There is no per-entry heap
+// allocation.  In exchange, inserting or erasing in the middle costs
+// O(size) element moves, and iterators are invalidated by any insert
+// or erase (like std::vector, unlike std::map).  Bulk loads in key
+// order (range construction, insert of sorted ranges and
+// emplace_hint at end()) are O(1) amortized per entry.
+
+// Only the subset of the std::map interface used by the betree is
+// provided.  Since the entries are not stored as pairs, iterators
+// hand out a small proxy with first and second members.
+
+#ifndef FLAT_MAP_HPP
+#define FLAT_MAP_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include "include/swap_space.hpp"
+
+template<class K, class V>
+class flat_map {
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef std::pair<K, V> value_type;
+
+  template<bool Const>
+  class iter_base {
+    friend class flat_map;
+    template<bool> friend class iter_base;
+    typedef typename std::conditional<Const, const flat_map, flat_map>::type map_type;
+    typedef typename std::conditional<Const, const V, V>::type value_ref_type;
+
+  public:
+    class proxy {
+    public:
+      proxy(const K &k, value_ref_type &v) : first(k), second(v) {}
+      const proxy *operator->(void) const { return this; }
+      operator std::pair<K, V>(void) const { return std::pair<K, V>(first, second); }
+      const K &first;
+      value_ref_type &second;
+    };
+
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef std::pair<K, V> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef proxy reference;
+    typedef proxy pointer;
+
+    iter_base(void) : m(NULL), i(0) {}
+
+    // iterator -> const_iterator
+    template<bool C2, class = typename std::enable_if<Const && !C2>::type>
+    iter_base(const iter_base<C2> &other) : m(other.m), i(other.i) {}
+
+    proxy operator*(void) const { return proxy(m->keys[i], m->vals[i]); }
+    proxy operator->(void) const { return **this; }
+
+    iter_base &operator++(void) { ++i; return *this; }
+    iter_base &operator--(void) { --i; return *this; }
+    iter_base operator++(int) { iter_base tmp = *this; ++i; return tmp; }
+    iter_base operator--(int) { iter_base tmp = *this; --i; return tmp; }
+    iter_base &operator+=(difference_type n) { i += n; return *this; }
+    iter_base &operator-=(difference_type n) { i -= n; return *this; }
+    iter_base operator+(difference_type n) const { return iter_base(m, i + n); }
+    iter_base operator-(difference_type n) const { return iter_base(m, i - n); }
+    difference_type operator-(const iter_base &other) const {
+      return (difference_type)i - (difference_type)other.i;
+    }
+    proxy operator[](difference_type n) const { return *(*this + n); }
+
+    bool operator==(const iter_base &other) const { return i == other.i && m == other.m; }
+    bool operator!=(const iter_base &other) const { return !operator==(other); }
+    bool operator<(const iter_base &other) const { return i < other.i; }
+    bool operator>(const iter_base &other) const { return i > other.i; }
+    bool operator<=(const iter_base &other) const { return i <= other.i; }
+    bool operator>=(const iter_base &other) const { return i >= other.i; }
+
+  private:
+    iter_base(map_type *mp, size_t idx) : m(mp), i(idx) {}
+    map_type *m;
+    size_t i;
+  };
+
+  typedef iter_base<false> iterator;
+  typedef iter_base<true> const_iterator;
+
+  flat_map(void) {}
+
+  template<class InputIterator>
+  flat_map(InputIterator first, InputIterator last) {
+    insert(first, last);
+  }
+
+  size_t size(void) const { return keys.size(); }
+  bool empty(void) const { return keys.empty(); }
+
+  void clear(void) {
+    keys.clear();
+    vals.clear();
+  }
+
+  void reserve(size_t n) {
+    keys.reserve(n);
+    vals.reserve(n);
+  }
+
+  void swap(flat_map &other) {
+    keys.swap(other.keys);
+    vals.swap(other.vals);
+  }
+
+  iterator begin(void) { return iterator(this, 0); }
+  iterator end(void) { return iterator(this, keys.size()); }
+  const_iterator begin(void) const { return const_iterator(this, 0); }
+  const_iterator end(void) const { return const_iterator(this, keys.size()); }
+
+  iterator lower_bound(const K &k) {
+    return iterator(this, std::lower_bound(keys.begin(), keys.end(), k) - keys.begin());
+  }
+
+  const_iterator lower_bound(const K &k) const {
+    return const_iterator(this, std::lower_bound(keys.begin(), keys.end(), k) - keys.begin());
+  }
+
+  iterator upper_bound(const K &k) {
+    return iterator(this, std::upper_bound(keys.begin(), keys.end(), k) - keys.begin());
+  }
+
+  const_iterator upper_bound(const K &k) const {
+    return const_iterator(this, std::upper_bound(keys.begin(), keys.end(), k) - keys.begin());
+  }
+
+  V & operator[](const K &k) {
+    size_t i = std::lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+    if (i == keys.size() || k < keys[i]) {
+      keys.insert(keys.begin() + i, k);
+      vals.insert(vals.begin() + i, V());
+    }
+    return vals[i];
+  }
+
+  // Like std::map::emplace_hint(hint, k, v): does nothing if k is
+  // already present.  Cheap when hint is the right place for k.
+  iterator emplace_hint(const_iterator hint, const K &k, const V &v) {
+    size_t i = hint.i;
+    if ((i < keys.size() && !(k < keys[i])) ||
+	(i > 0 && !(keys[i-1] < k)))
+      i = std::lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+    if (i < keys.size() && !(k < keys[i]))
+      return iterator(this, i);
+    if (i == keys.size()) {
+      keys.push_back(k);
+      vals.push_back(v);
+    } else {
+      keys.insert(keys.begin() + i, k);
+      vals.insert(vals.begin() + i, v);
+    }
+    return iterator(this, i);
+  }
+
+  // Insert the entries in [first, last) whose keys aren't already
+  // present.
+  template<class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      emplace_hint(end(), first->first, first->second);
+  }
+
+  iterator erase(const_iterator pos) {
+    keys.erase(keys.begin() + pos.i);
+    vals.erase(vals.begin() + pos.i);
+    return iterator(this, pos.i);
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    keys.erase(keys.begin() + first.i, keys.begin() + last.i);
+    vals.erase(vals.begin() + first.i, vals.begin() + last.i);
+    return iterator(this, first.i);
+  }
+
+  size_t erase(const K &k) {
+    auto it = lower_bound(k);
+    if (it == end() || k < it->first)
+      return 0;
+    erase(it);
+    return 1;
+  }
+
+  std::vector<K> & key_array(void) { return keys; }
+  std::vector<V> & value_array(void) { return vals; }
+
+private:
+  std::vector<K> keys;
+  std::vector<V> vals;
+};
+
+template<class K, class V> void serialize(std::iostream &fs,
+					  serialization_context &context,
+					  flat_map<K, V> &mp)
+{
+  if (context.format == TEXT_SERIALIZATION)
+    fs << "flat_map ";
+  serialize(fs, context, mp.key_array());
+  serialize(fs, context, mp.value_array());
+}
+
+template<class K, class V> void deserialize(std::iostream &fs,
+					    serialization_context &context,
+					    flat_map<K, V> &mp)
+{
+  if (context.format == TEXT_SERIALIZATION) {
+    std::string dummy;
+    fs >> dummy;
+  }
+  deserialize(fs, context, mp.key_array());
+  deserialize(fs, context, mp.value_array());
+  assert(mp.key_array().size() == mp.value_array().size());
+}
+
+#endif // FLAT_MAP_HPP
@@ -0,0 +1,168 @@
+// Cache replacement policies for the swap_space.
+//
+// A policy decides which in-memory object to evict next.  It sees
+// each object as a cache_entry, which swap_space::object derives
+// from, and keeps entries on intrusive cache_lists, so every policy
+// operation is O(1).  The swap_space tells the policy about:
+//
+//   admit(e)    e was just brought into memory, either because it was
+//               created or because it was loaded on a miss.
+//   touch(e)    e was accessed while already in memory (a hit).
+//   hold(e)     e was pinned; it can't be evicted until released.
+//   release(e)  e was unpinned and may be evicted again.
+//   victim()    which evictable entry should go next?
+//   coldest(n)  and the n after that, roughly?  Used to clean dirty
+//               objects before they are evicted.
+//   evict(e)    e (a victim) was written back and dropped from memory.
+//   forget(e)   e was destroyed.
+//
+// Pinned entries are kept off the lists, so victim() never has to
+// skip over them.  Policies with history (2Q, ARC) keep "ghost"
+// entries for recently evicted objects, which works because evicted
+// swap_space objects stay around until they're freed.
+
+#ifndef REPLACEMENT_POLICY_HPP
+#define REPLACEMENT_POLICY_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+class cache_list;
+
+class cache_entry {
+public:
+  cache_entry *cache_prev = NULL;
+  cache_entry *cache_next = NULL;
+  // The list this entry is linked into, if any.
+  cache_list *cache_owner = NULL;
+  // Which of the policy's queues the entry belongs to, including
+  // while it is pinned and not linked anywhere.
+  uint8_t cache_queue = 0;
+};
+
+// Intrusive doubly-linked list of cache_entries, least recently
+// inserted at the front.
+class cache_list {
+public:
+  cache_entry * front(void) const { return head; }
+  uint64_t size(void) const { return n; }
+  bool empty(void) const { return n == 0; }
+
+  void push_back(cache_entry *e);
+  void remove(cache_entry *e);
+  cache_entry * pop_front(void);
+
+private:
+  cache_entry *head = NULL;
+  cache_entry *tail = NULL;
+  uint64_t n = 0;
+};
+
+class replacement_policy {
+public:
+  virtual ~replacement_policy(void) {}
+  // The number of objects the cache can hold.
+  virtual void set_capacity(uint64_t c) = 0;
+  virtual void admit(cache_entry *e) = 0;
+  virtual void touch(cache_entry *e) = 0;
+  virtual void hold(cache_entry *e);
+  virtual void release(cache_entry *e) = 0;
+  virtual cache_entry * victim(void) = 0;
+  // Append up to n evictable entries to out, in about the order
+  // victim() would pick them.
+  virtual void coldest(uint64_t n, std::vector<cache_entry *> &out) = 0;
+  virtual void evict(cache_entry *e) = 0;
+  virtual void forget(cache_entry *e) = 0;
+
+protected:
+  static void coldest_in(const cache_list &l, uint64_t n,
+			 std::vector<cache_entry *> &out);
+};
+
+// Plain LRU, by the time at which entries were last unpinned.
+class lru_policy : public replacement_policy {
+public:
+  void set_capacity(uint64_t c);
+  void admit(cache_entry *e);
+  void touch(cache_entry *e);
+  void release(cache_entry *e);
+  cache_entry * victim(void);
+  void coldest(uint64_t n, std::vector<cache_entry *> &out);
+  void evict(cache_entry *e);
+  void forget(cache_entry *e);
+
+private:
+  cache_list lru;
+};
+
+// The full 2Q algorithm of Johnson and Shasha.  Newly admitted
+// entries go on a FIFO (A1in) that gets a quarter of the cache; when
+// they fall off it they are remembered in a ghost FIFO (A1out) half
+// the size of the cache.  Only entries that are missed on again while
+// in A1out are promoted to the main LRU queue (Am), so a one-time
+// scan can only churn A1in.
+class two_q_policy : public replacement_policy {
+public:
+  void set_capacity(uint64_t c);
+  void admit(cache_entry *e);
+  void touch(cache_entry *e);
+  void release(cache_entry *e);
+  cache_entry * victim(void);
+  void coldest(uint64_t n, std::vector<cache_entry *> &out);
+  void evict(cache_entry *e);
+  void forget(cache_entry *e);
+
+private:
+  enum { NONE, A1IN, A1OUT, AM };
+  cache_list & list_for(cache_entry *e);
+
+  uint64_t in_capacity = 1;
+  uint64_t out_capacity = 1;
+  // Resident entries per queue, pinned or not.
+  uint64_t resident[4] = { 0, 0, 0, 0 };
+  cache_list a1in;
+  cache_list a1out;
+  cache_list am;
+};
+
+// ARC, by Megiddo and Modha.  T1 holds entries seen once recently and
+// T2 entries seen at least twice; B1 and B2 are ghosts of entries
+// evicted from them.  Misses that hit a ghost list shift the target
+// size p of T1 towards the list that would have kept the entry.
+class arc_policy : public replacement_policy {
+public:
+  void set_capacity(uint64_t c);
+  void admit(cache_entry *e);
+  void touch(cache_entry *e);
+  void release(cache_entry *e);
+  cache_entry * victim(void);
+  void coldest(uint64_t n, std::vector<cache_entry *> &out);
+  void evict(cache_entry *e);
+  void forget(cache_entry *e);
+
+private:
+  enum { NONE, T1, B1, T2, B2 };
+  cache_list & list_for(cache_entry *e);
+  void trim_ghosts(void);
+
+  uint64_t capacity = 1;
+  uint64_t p = 0;
+  bool last_admit_from_b2 = false;
+  // Resident entries per queue, pinned or not.
+  uint64_t resident[5] = { 0, 0, 0, 0, 0 };
+  cache_list t1;
+  cache_list b1;
+  cache_list t2;
+  cache_list b2;
+};
+
+enum replacement_policy_kind {
+  LRU_REPLACEMENT,
+  TWO_Q_REPLACEMENT,
+  ARC_REPLACEMENT
+};
+
+replacement_policy * make_replacement_policy(replacement_policy_kind kind);
+
+#endif // REPLACEMENT_POLICY_HPP
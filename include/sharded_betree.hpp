@@ -0,0 +1,1061 @@
+// Scale-out by key range.  A sharded_betree routes each key to the
+// shard whose range holds it, where a shard is a betree with its own
+// swap_space and backing store, living on some node.  The router
+// only talks to nodes through a shard_transport, so a node can be a
+// shard_host in the same process or a shard_host in another process
+// (or machine) behind a shard_server, reached with a
+// socket_transport.
+//
+// Range scans fan out to every shard the range overlaps and merge
+// what comes back in key order.  A shard that gets too hot can be
+// split online, at one of its root's pivots, into a new shard on any
+// node; see sharded_betree::split().
+//
+// The shard map lives in the router only: it isn't persisted, and
+// only one router should use a set of shards.
+
+#ifndef SHARDED_BETREE_HPP
+#define SHARDED_BETREE_HPP
+
+#include <map>
+#include <vector>
+#include <queue>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <filesystem>
+#include "include/db-tree.hpp"
+
+// A range of keys: from start (or the beginning, without has_start),
+// excluding start itself if start_open, up to but not including end
+// (or through the end, without has_end).
+template<class Key>
+class key_range {
+public:
+  bool has_start = false;
+  bool start_open = false;
+  Key start = Key();
+  bool has_end = false;
+  Key end = Key();
+
+  bool contains(const Key &k) const {
+    if (has_start && (start_open ? !(start < k) : k < start))
+      return false;
+    return !has_end || k < end;
+  }
+};
+
+// How the router reaches the shards on one node.  Shards are named by
+// ids the router hands out.  Scans read snapshots (see
+// betree::snapshot()), so that a scan that takes many calls sees each
+// shard as it was when it started and holds up no writers.
+// Implementations must let several threads call them at once, and
+// report failures by throwing.
+template<class Key, class Value>
+class shard_transport {
+public:
+  typedef std::pair<Key, Message<Value> > message;
+
+  virtual ~shard_transport(void) {}
+
+  virtual void create_shard(uint64_t shard) = 0;
+  // Apply msgs in order, as betree::upsert_batch() does.
+  virtual void upsert(uint64_t shard, const std::vector<message> &msgs) = 0;
+  virtual bool find(uint64_t shard, const Key &k, Value &v) = 0;
+  virtual uint64_t open_snapshot(uint64_t shard) = 0;
+  virtual void close_snapshot(uint64_t shard, uint64_t snapshot) = 0;
+  // Append up to limit of the pairs in range, in key order, from
+  // snapshot of shard to out.
+  virtual void scan(uint64_t shard, uint64_t snapshot,
+		    const key_range<Key> &range, uint64_t limit,
+		    std::vector<std::pair<Key, Value> > &out) = 0;
+  // betree::root_pivots() of the shard.
+  virtual void root_pivots(uint64_t shard, std::vector<Key> &pivots) = 0;
+};
+
+// The shards on this node, which is also the transport for reaching
+// them from the same process.
+template<class Key, class Value, class Layout = map_node_layout>
+class shard_host : public shard_transport<Key, Value> {
+public:
+  typedef typename shard_transport<Key, Value>::message message;
+  typedef betree<Key, Value, Layout> tree;
+  // Makes the backing store for a new shard.
+  typedef std::function<backing_store *(uint64_t shard)> store_factory;
+
+  shard_host(store_factory factory,
+	     uint64_t cache_size = DEFAULT_OPEN_CACHE_SIZE,
+	     uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
+	     uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
+	     uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE)
+    : make_store(factory),
+      cache_size(cache_size),
+      max_node_size(maxnodesize),
+      min_node_size(minnodesize),
+      min_flush_size(minflushsize)
+  {}
+
+  // Each shard in a write-behind one_file_per_object_backing_store in
+  // dir/shard.<id>.
+  shard_host(const std::string &dir,
+	     uint64_t cache_size = DEFAULT_OPEN_CACHE_SIZE,
+	     uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
+	     uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
+	     uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE)
+    : shard_host([dir](uint64_t shard) {
+	  std::string path = dir + "/shard." + std::to_string(shard);
+	  std::filesystem::create_directories(path);
+	  return new one_file_per_object_backing_store(path, true);
+	}, cache_size, maxnodesize, minnodesize, minflushsize)
+  {}
+
+  void create_shard(uint64_t id) {
+    std::unique_ptr<shard> s(new shard);
+    s->store.reset(make_store(id));
+    s->ss.reset(new swap_space(s->store.get(), cache_size));
+    s->ss->set_write_group_size(256);
+    s->bet.reset(new tree(s->ss.get(), max_node_size, min_node_size,
+			  min_flush_size));
+    s->bet->set_concurrent(true);
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!shards.emplace(id, std::move(s)).second)
+      throw std::invalid_argument("Shard " + std::to_string(id) + " already exists");
+  }
+
+  void upsert(uint64_t id, const std::vector<message> &msgs) {
+    if (msgs.empty())
+      return;
+    get(id).bet->upsert_batch(msgs.begin(), msgs.end());
+  }
+
+  bool find(uint64_t id, const Key &k, Value &v) {
+    std::optional<Value> found = get(id).bet->find(k);
+    if (found)
+      v = *found;
+    return found.has_value();
+  }
+
+  uint64_t open_snapshot(uint64_t id) {
+    shard &s = get(id);
+    typename tree::snapshot_handle snap = s.bet->snapshot();
+    std::lock_guard<std::mutex> lock(s.snapshot_mutex);
+    uint64_t n = s.next_snapshot++;
+    s.snapshots.emplace(n, std::move(snap));
+    return n;
+  }
+
+  void close_snapshot(uint64_t id, uint64_t snapshot) {
+    shard &s = get(id);
+    std::lock_guard<std::mutex> lock(s.snapshot_mutex);
+    s.snapshots.erase(snapshot);
+  }
+
+  void scan(uint64_t id, uint64_t snapshot, const key_range<Key> &range,
+	    uint64_t limit, std::vector<std::pair<Key, Value> > &out) {
+    shard &s = get(id);
+    const typename tree::snapshot_handle *snap;
+    {
+      std::lock_guard<std::mutex> lock(s.snapshot_mutex);
+      auto it = s.snapshots.find(snapshot);
+      if (it == s.snapshots.end())
+	throw std::out_of_range("No such snapshot");
+      snap = &it->second;
+    }
+    typename tree::iterator it = !range.has_start ? snap->begin() :
+      range.start_open ? snap->upper_bound(range.start) :
+      snap->lower_bound(range.start);
+    typename tree::iterator end = snap->end();
+    for (uint64_t n = 0; n < limit && it != end; ++n, ++it) {
+      if (range.has_end && !(it.first < range.end))
+	break;
+      out.emplace_back(it.first, it.second);
+    }
+  }
+
+  void root_pivots(uint64_t id, std::vector<Key> &pivots) {
+    pivots = get(id).bet->root_pivots();
+  }
+
+private:
+  // Members in this order so that snapshots go before their tree,
+  // and the tree before its swap_space and store.
+  struct shard {
+    std::unique_ptr<backing_store> store;
+    std::unique_ptr<swap_space> ss;
+    std::unique_ptr<tree> bet;
+    std::mutex snapshot_mutex;
+    uint64_t next_snapshot = 1;
+    std::map<uint64_t, typename tree::snapshot_handle> snapshots;
+  };
+
+  shard &get(uint64_t id) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = shards.find(id);
+    if (it == shards.end())
+      throw std::out_of_range("No such shard: " + std::to_string(id));
+    return *it->second;
+  }
+
+  store_factory make_store;
+  uint64_t cache_size;
+  uint64_t max_node_size;
+  uint64_t min_node_size;
+  uint64_t min_flush_size;
+  // Guards shards, not the shards themselves, which are never removed.
+  std::shared_mutex mutex;
+  std::map<uint64_t, std::unique_ptr<shard> > shards;
+};
+
+////////////////// Sockets
+
+// A connected Unix-domain stream socket carrying messages, each sent
+// as its length in 8 little-endian bytes followed by its bytes.
+class message_socket {
+public:
+  // Connect to the message_listener at path.  Throws
+  // std::runtime_error if it can't.
+  explicit message_socket(const std::string &path);
+  explicit message_socket(int fd);
+  ~message_socket(void);
+
+  // Both return false if the connection is gone.
+  bool send(const std::string &msg);
+  bool receive(std::string &msg);
+
+  // Make every send() and receive() on this connection, at either
+  // end, fail from now on, including ones blocked in other threads.
+  void shutdown(void);
+
+private:
+  int fd;
+};
+
+class message_listener {
+public:
+  // Listen at path, replacing whatever socket was there before.
+  explicit message_listener(const std::string &path);
+  ~message_listener(void);
+
+  // Wait for a connection.  Returns NULL once shutdown() is called.
+  message_socket *accept(void);
+  void shutdown(void);
+
+private:
+  std::string path;
+  int fd;
+};
+
+// Requests are an opcode, the shard id and the arguments, and replies
+// are a status byte followed by the results or an error message, all
+// in the swap_space binary format.  The swap_space a codec keeps is
+// only there to make serialization_contexts; it never holds objects.
+template<class Key, class Value>
+class shard_codec {
+public:
+  typedef std::pair<Key, Message<Value> > message;
+
+  enum {
+    CREATE_SHARD,
+    UPSERT,
+    FIND,
+    OPEN_SNAPSHOT,
+    CLOSE_SNAPSHOT,
+    SCAN,
+    ROOT_PIVOTS
+  };
+  enum {
+    REPLY_OK,
+    REPLY_ERROR
+  };
+
+  shard_codec(void) : ss(NULL, 1, BINARY_SERIALIZATION) {}
+
+  void put(std::iostream &fs, uint64_t x) {
+    serialization_context ctxt(ss);
+    serialize(fs, ctxt, x);
+  }
+
+  void get(std::iostream &fs, uint64_t &x) {
+    serialization_context ctxt(ss);
+    deserialize(fs, ctxt, x);
+  }
+
+  template<class X>
+  void put(std::iostream &fs, X x) {
+    serialization_context ctxt(ss);
+    serialize(fs, ctxt, x);
+  }
+
+  template<class X>
+  void get(std::iostream &fs, X &x) {
+    serialization_context ctxt(ss);
+    deserialize(fs, ctxt, x);
+  }
+
+  void put(std::iostream &fs, const key_range<Key> &r) {
+    put(fs, (uint64_t)(r.has_start | r.start_open << 1 | r.has_end << 2));
+    put(fs, r.start);
+    put(fs, r.end);
+  }
+
+  void get(std::iostream &fs, key_range<Key> &r) {
+    uint64_t flags;
+    get(fs, flags);
+    r.has_start = flags & 1;
+    r.start_open = flags & 2;
+    r.has_end = flags & 4;
+    get(fs, r.start);
+    get(fs, r.end);
+  }
+
+  template<class A, class B>
+  void put(std::iostream &fs, const std::vector<std::pair<A, B> > &v) {
+    put(fs, (uint64_t)v.size());
+    for (auto it = v.begin(); it != v.end(); ++it) {
+      put(fs, it->first);
+      put(fs, it->second);
+    }
+  }
+
+  template<class A, class B>
+  void get(std::iostream &fs, std::vector<std::pair<A, B> > &v) {
+    uint64_t n;
+    get(fs, n);
+    v.resize(n);
+    for (uint64_t i = 0; i < n; i++) {
+      get(fs, v[i].first);
+      get(fs, v[i].second);
+    }
+  }
+
+  void put(std::iostream &fs, const std::vector<Key> &v) {
+    put(fs, (uint64_t)v.size());
+    for (auto it = v.begin(); it != v.end(); ++it)
+      put(fs, *it);
+  }
+
+  void get(std::iostream &fs, std::vector<Key> &v) {
+    uint64_t n;
+    get(fs, n);
+    v.resize(n);
+    for (uint64_t i = 0; i < n; i++)
+      get(fs, v[i]);
+  }
+
+private:
+  swap_space ss;
+};
+
+// Serves the shards of a transport, usually a shard_host, to
+// socket_transports, with a thread per connection.
+template<class Key, class Value>
+class shard_server {
+public:
+  typedef shard_codec<Key, Value> codec;
+  typedef typename codec::message message;
+
+  shard_server(shard_transport<Key, Value> *backend, const std::string &path)
+    : backend(backend),
+      listener(path)
+  {
+    acceptor = std::thread([this]() { accept_connections(); });
+  }
+
+  ~shard_server(void) {
+    listener.shutdown();
+    acceptor.join();
+    std::vector<std::thread> threads;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto it = connections.begin(); it != connections.end(); ++it)
+	(*it)->shutdown();
+      threads.swap(handlers);
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+  }
+
+private:
+  void accept_connections(void) {
+    while (message_socket *sock = listener.accept()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      connections.emplace_back(sock);
+      handlers.emplace_back([this, sock]() { serve(sock); });
+    }
+  }
+
+  void serve(message_socket *sock) {
+    std::string request;
+    while (sock->receive(request)) {
+      std::stringstream in(request);
+      std::stringstream out;
+      try {
+	handle(in, out);
+      } catch (std::exception &e) {
+	out.str(std::string());
+	wire.put(out, (uint64_t)codec::REPLY_ERROR);
+	wire.put(out, std::string(e.what()));
+      }
+      if (!sock->send(out.str()))
+	break;
+    }
+  }
+
+  void handle(std::stringstream &in, std::stringstream &out) {
+    uint64_t op, shard;
+    wire.get(in, op);
+    wire.get(in, shard);
+    std::stringstream results;
+    switch (op) {
+    case codec::CREATE_SHARD:
+      backend->create_shard(shard);
+      break;
+    case codec::UPSERT: {
+      std::vector<message> msgs;
+      wire.get(in, msgs);
+      backend->upsert(shard, msgs);
+      break;
+    }
+    case codec::FIND: {
+      Key k;
+      Value v = Value();
+      wire.get(in, k);
+      bool found = backend->find(shard, k, v);
+      wire.put(results, (uint64_t)found);
+      wire.put(results, v);
+      break;
+    }
+    case codec::OPEN_SNAPSHOT:
+      wire.put(results, backend->open_snapshot(shard));
+      break;
+    case codec::CLOSE_SNAPSHOT: {
+      uint64_t snapshot;
+      wire.get(in, snapshot);
+      backend->close_snapshot(shard, snapshot);
+      break;
+    }
+    case codec::SCAN: {
+      uint64_t snapshot, limit;
+      key_range<Key> range;
+      std::vector<std::pair<Key, Value> > pairs;
+      wire.get(in, snapshot);
+      wire.get(in, range);
+      wire.get(in, limit);
+      backend->scan(shard, snapshot, range, limit, pairs);
+      wire.put(results, pairs);
+      break;
+    }
+    case codec::ROOT_PIVOTS: {
+      std::vector<Key> pivots;
+      backend->root_pivots(shard, pivots);
+      wire.put(results, pivots);
+      break;
+    }
+    default:
+      throw std::invalid_argument("Unknown shard request " + std::to_string(op));
+    }
+    wire.put(out, (uint64_t)codec::REPLY_OK);
+    std::string r = results.str();
+    out.write(r.data(), r.size());
+  }
+
+  shard_transport<Key, Value> *backend;
+  codec wire;
+  message_listener listener;
+  std::thread acceptor;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<message_socket> > connections;
+  std::vector<std::thread> handlers;
+};
+
+// Reaches the shards a shard_server serves.  Each call takes an idle
+// connection, or opens one, so calls from different threads proceed
+// in parallel.
+template<class Key, class Value>
+class socket_transport : public shard_transport<Key, Value> {
+public:
+  typedef shard_codec<Key, Value> codec;
+  typedef typename codec::message message;
+
+  explicit socket_transport(const std::string &path) : path(path) {}
+
+  void create_shard(uint64_t shard) {
+    std::stringstream req, rep;
+    start(req, codec::CREATE_SHARD, shard);
+    call(req, rep);
+  }
+
+  void upsert(uint64_t shard, const std::vector<message> &msgs) {
+    std::stringstream req, rep;
+    start(req, codec::UPSERT, shard);
+    wire.put(req, msgs);
+    call(req, rep);
+  }
+
+  bool find(uint64_t shard, const Key &k, Value &v) {
+    std::stringstream req, rep;
+    start(req, codec::FIND, shard);
+    wire.put(req, k);
+    call(req, rep);
+    uint64_t found;
+    wire.get(rep, found);
+    Value tmp;
+    wire.get(rep, tmp);
+    if (found)
+      v = tmp;
+    return found;
+  }
+
+  uint64_t open_snapshot(uint64_t shard) {
+    std::stringstream req, rep;
+    start(req, codec::OPEN_SNAPSHOT, shard);
+    call(req, rep);
+    uint64_t snapshot;
+    wire.get(rep, snapshot);
+    return snapshot;
+  }
+
+  void close_snapshot(uint64_t shard, uint64_t snapshot) {
+    std::stringstream req, rep;
+    start(req, codec::CLOSE_SNAPSHOT, shard);
+    wire.put(req, snapshot);
+    call(req, rep);
+  }
+
+  void scan(uint64_t shard, uint64_t snapshot, const key_range<Key> &range,
+	    uint64_t limit, std::vector<std::pair<Key, Value> > &out) {
+    std::stringstream req, rep;
+    start(req, codec::SCAN, shard);
+    wire.put(req, snapshot);
+    wire.put(req, range);
+    wire.put(req, limit);
+    call(req, rep);
+    std::vector<std::pair<Key, Value> > pairs;
+    wire.get(rep, pairs);
+    out.insert(out.end(), pairs.begin(), pairs.end());
+  }
+
+  void root_pivots(uint64_t shard, std::vector<Key> &pivots) {
+    std::stringstream req, rep;
+    start(req, codec::ROOT_PIVOTS, shard);
+    call(req, rep);
+    wire.get(rep, pivots);
+  }
+
+private:
+  void start(std::stringstream &req, uint64_t op, uint64_t shard) {
+    wire.put(req, op);
+    wire.put(req, shard);
+  }
+
+  // Send req and leave rep positioned at the results.
+  void call(std::stringstream &req, std::stringstream &rep) {
+    std::unique_ptr<message_socket> sock;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!idle.empty()) {
+	sock = std::move(idle.back());
+	idle.pop_back();
+      }
+    }
+    if (!sock)
+      sock.reset(new message_socket(path));
+    std::string reply;
+    if (!sock->send(req.str()) || !sock->receive(reply))
+      throw std::runtime_error("Lost connection to shard server at " + path);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      idle.push_back(std::move(sock));
+    }
+    rep.str(reply);
+    uint64_t status;
+    wire.get(rep, status);
+    if (status != codec::REPLY_OK) {
+      std::string error;
+      wire.get(rep, error);
+      throw std::runtime_error(error);
+    }
+  }
+
+  std::string path;
+  codec wire;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<message_socket> > idle;
+};
+
+////////////////// The router
+
+template<class Key, class Value>
+class sharded_betree {
+public:
+  typedef shard_transport<Key, Value> transport;
+  typedef typename transport::message message;
+
+  // Start with one shard, holding every key, on node.
+  sharded_betree(transport *node) {
+    first = std::make_shared<shard>(next_shard_id++, node);
+    node->create_shard(first->id);
+  }
+
+  void upsert(int opcode, Key k, Value v)
+  {
+    std::vector<message> msgs(1, message(k, Message<Value>(opcode, v)));
+    std::shared_lock<std::shared_mutex> lock = read_map();
+    shard &s = *route(k);
+    s.operations++;
+    if (s.splitting && !(k < s.split_pivot)) {
+      // Record the upsert for the new shard in the order the old one
+      // applies it (see split()).
+      std::lock_guard<std::mutex> l(s.moved_mutex);
+      s.node->upsert(s.id, msgs);
+      s.moved_upserts.push_back(msgs[0]);
+      return;
+    }
+    s.node->upsert(s.id, msgs);
+  }
+
+  void insert(Key k, Value v)
+  {
+    upsert(INSERT, k, v);
+  }
+
+  void update(Key k, Value v)
+  {
+    upsert(UPDATE, k, v);
+  }
+
+  void erase(Key k)
+  {
+    upsert(DELETE, k, Value());
+  }
+
+  std::optional<Value> find(Key k)
+  {
+    std::shared_lock<std::shared_mutex> lock = read_map();
+    shard &s = *route(k);
+    s.operations++;
+    Value v;
+    if (s.node->find(s.id, k, v))
+      return v;
+    return std::nullopt;
+  }
+
+  Value query(Key k)
+  {
+    std::optional<Value> v = find(k);
+    if (!v)
+      throw std::out_of_range("Key does not exist");
+    return *v;
+  }
+
+  // Pairs are fetched from each shard scan_batch at a time.
+  void set_scan_batch_size(uint64_t n) {
+    assert(n > 0);
+    scan_batch = n;
+  }
+
+  uint64_t shard_count(void) {
+    std::shared_lock<std::shared_mutex> lock = read_map();
+    return 1 + starts.size();
+  }
+
+  // The shard with the most upserts and lookups since it was made or
+  // last split.
+  uint64_t hottest_shard(void) {
+    std::shared_lock<std::shared_mutex> lock = read_map();
+    shard *hottest = first.get();
+    for (auto it = starts.begin(); it != starts.end(); ++it)
+      if (it->second->operations > hottest->operations)
+	hottest = it->second.get();
+    return hottest->id;
+  }
+
+  // Move the upper part of shard id to a new shard on node, while
+  // upserts and lookups carry on.  The split point is the middle one
+  // of the shard's root pivots that falls inside its range.  Returns
+  // false, changing nothing, if there is no such pivot (e.g. the
+  // shard's root is still a leaf).
+  //
+  // The new shard is filled from a snapshot of the old one.  Upserts
+  // to the moving keys that come in while it is copied go to the old
+  // shard, as before, and are also recorded, and once the copy is
+  // done the recorded ones are replayed into the new shard and the
+  // shard map switched over, with upserts held off.  (The snapshot and
+  // the recording start together, so each upsert reaches the new
+  // shard exactly once, which matters for UPDATEs.)  The old shard's
+  // copies of the moved keys are erased afterwards.
+  bool split(uint64_t id, transport *node)
+  {
+    std::lock_guard<std::mutex> one_at_a_time(split_mutex);
+    std::shared_ptr<shard> old;
+    key_range<Key> range;
+    {
+      std::shared_lock<std::shared_mutex> lock = read_map();
+      for_each_shard([&](const std::shared_ptr<shard> &s, const key_range<Key> &r) {
+	  if (s->id == id) {
+	    old = s;
+	    range = r;
+	  }
+	});
+    }
+    if (!old)
+      throw std::out_of_range("No such shard: " + std::to_string(id));
+
+    std::vector<Key> pivots;
+    old->node->root_pivots(old->id, pivots);
+    std::vector<Key> inside;
+    for (auto it = pivots.begin(); it != pivots.end(); ++it)
+      if (range.contains(*it) && (!range.has_start || range.start < *it))
+	inside.push_back(*it);
+    if (inside.empty())
+      return false;
+
+    std::shared_ptr<shard> upper = std::make_shared<shard>(next_shard_id++, node);
+    node->create_shard(upper->id);
+    key_range<Key> moved = range;
+    moved.has_start = true;
+    moved.start_open = false;
+    moved.start = inside[inside.size() / 2];
+
+    uint64_t snap;
+    {
+      std::unique_lock<std::shared_mutex> lock = write_map();
+      snap = old->node->open_snapshot(old->id);
+      old->split_pivot = moved.start;
+      old->splitting = true;
+    }
+    try {
+      copy_range(*old, snap, moved, [&](std::vector<message> &msgs) {
+	  node->upsert(upper->id, msgs);
+	});
+      old->node->close_snapshot(old->id, snap);
+    } catch (...) {
+      // Leave the old shard as it was (the new one, never used, stays
+      // on node).
+      std::unique_lock<std::shared_mutex> lock = write_map();
+      old->moved_upserts.clear();
+      old->splitting = false;
+      throw;
+    }
+
+    {
+      std::unique_lock<std::shared_mutex> lock = write_map();
+      if (!old->moved_upserts.empty())
+	node->upsert(upper->id, old->moved_upserts);
+      old->moved_upserts.clear();
+      old->splitting = false;
+      old->operations = 0;
+      starts.emplace(moved.start, upper);
+    }
+
+    // Nothing reads the moved keys from the old shard any more.
+    snap = old->node->open_snapshot(old->id);
+    copy_range(*old, snap, moved, [&](std::vector<message> &msgs) {
+	for (auto it = msgs.begin(); it != msgs.end(); ++it)
+	  it->second = Message<Value>(DELETE, Value());
+	old->node->upsert(old->id, msgs);
+      });
+    old->node->close_snapshot(old->id, snap);
+    return true;
+  }
+
+private:
+  class shard;
+
+public:
+  // Merges the scans of every shard the range overlaps.  Each shard
+  // is read from a snapshot taken when the iterator is made, so
+  // splits don't disturb it, but the shards' snapshots aren't taken
+  // at one instant.  Iterators can't be copied, and must not outlive
+  // the sharded_betree.
+  class iterator {
+  public:
+    iterator(void) : first(), second() {}
+
+    iterator(sharded_betree &sbt, const key_range<Key> &range)
+      : first(),
+	second()
+    {
+      {
+	std::shared_lock<std::shared_mutex> lock = sbt.read_map();
+	sbt.for_each_shard([&](const std::shared_ptr<shard> &s, key_range<Key> r) {
+	    if (!intersect(r, range))
+	      return;
+	    uint64_t snapshot = s->node->open_snapshot(s->id);
+	    streams.emplace_back(new stream(s->node, s->id, snapshot, r,
+					    sbt.scan_batch));
+	  });
+      }
+      // Fetch the first batch from every shard at once.
+      std::vector<std::future<void> > fills;
+      for (size_t i = 0; i < streams.size(); i++)
+	fills.push_back(std::async(std::launch::async,
+				   [this, i]() { streams[i]->fill(); }));
+      for (size_t i = 0; i < fills.size(); i++)
+	fills[i].get();
+      for (size_t i = 0; i < streams.size(); i++)
+	if (!streams[i]->done())
+	  heads.push(head(streams[i]->current().first, i));
+      advance();
+    }
+
+    iterator(iterator &&other) = default;
+    iterator(const iterator &other) = delete;
+    iterator &operator=(const iterator &other) = delete;
+
+    bool at_end(void) const {
+      return !valid;
+    }
+
+    bool operator==(const iterator &other) const {
+      return valid == other.valid && (!valid || first == other.first);
+    }
+
+    bool operator!=(const iterator &other) const {
+      return !operator==(other);
+    }
+
+    iterator &operator++(void) {
+      advance();
+      return *this;
+    }
+
+    Key first;
+    Value second;
+
+  private:
+    struct stream {
+      stream(transport *node, uint64_t shard_id, uint64_t snapshot,
+	     const key_range<Key> &range, uint64_t batch)
+	: node(node),
+	  shard_id(shard_id),
+	  snapshot(snapshot),
+	  batch(batch),
+	  range(range)
+      {}
+
+      // Can't throw from here, and a node we can't reach has no
+      // snapshot to free anyway.
+      ~stream(void) {
+	try {
+	  node->close_snapshot(shard_id, snapshot);
+	} catch (std::exception &e) {
+	}
+      }
+
+      transport *node;
+      uint64_t shard_id;
+      uint64_t snapshot;
+      uint64_t batch;
+      // What is left to fetch.
+      key_range<Key> range;
+      std::vector<std::pair<Key, Value> > pairs;
+      size_t pos = 0;
+      bool exhausted = false;
+
+      void fill(void) {
+	pairs.clear();
+	pos = 0;
+	node->scan(shard_id, snapshot, range, batch, pairs);
+	if (pairs.size() < batch)
+	  exhausted = true;
+	else {
+	  range.has_start = true;
+	  range.start = pairs.back().first;
+	  range.start_open = true;
+	}
+      }
+
+      bool done(void) const {
+	return pos == pairs.size();
+      }
+
+      const std::pair<Key, Value> &current(void) const {
+	return pairs[pos];
+      }
+    };
+
+    // The smallest key first.
+    struct head {
+      head(const Key &k, size_t i) : key(k), index(i) {}
+      Key key;
+      size_t index;
+      bool operator<(const head &other) const {
+	return other.key < key;
+      }
+    };
+
+    // Narrow r to its overlap with range.  Returns false if they
+    // don't overlap.
+    static bool intersect(key_range<Key> &r, const key_range<Key> &range) {
+      if (range.has_start &&
+	  (!r.has_start || r.start < range.start ||
+	   (!(range.start < r.start) && range.start_open))) {
+	r.has_start = true;
+	r.start = range.start;
+	r.start_open = range.start_open;
+      }
+      if (range.has_end && (!r.has_end || range.end < r.end)) {
+	r.has_end = true;
+	r.end = range.end;
+      }
+      if (r.has_start && r.has_end)
+	return r.start < r.end;
+      return true;
+    }
+
+    void advance(void) {
+      valid = !heads.empty();
+      if (!valid)
+	return;
+      size_t i = heads.top().index;
+      heads.pop();
+      stream &st = *streams[i];
+      first = st.current().first;
+      second = st.current().second;
+      st.pos++;
+      if (st.done() && !st.exhausted)
+	st.fill();
+      if (!st.done())
+	heads.push(head(st.current().first, i));
+    }
+
+    std::vector<std::unique_ptr<stream> > streams;
+    std::priority_queue<head> heads;
+    bool valid = false;
+  };
+
+  iterator begin(void) {
+    return iterator(*this, key_range<Key>());
+  }
+
+  iterator lower_bound(Key key) {
+    key_range<Key> r;
+    r.has_start = true;
+    r.start = key;
+    return iterator(*this, r);
+  }
+
+  iterator upper_bound(Key key) {
+    key_range<Key> r;
+    r.has_start = true;
+    r.start_open = true;
+    r.start = key;
+    return iterator(*this, r);
+  }
+
+  // Only [lo, hi).
+  iterator range(Key lo, Key hi) {
+    key_range<Key> r;
+    r.has_start = true;
+    r.start = lo;
+    r.has_end = true;
+    r.end = hi;
+    return iterator(*this, r);
+  }
+
+  iterator end(void) {
+    return iterator();
+  }
+
+private:
+  class shard {
+  public:
+    shard(uint64_t id, transport *node) : id(id), node(node) {}
+
+    uint64_t id;
+    transport *node;
+    // Upserts and lookups routed here, for hottest_shard().
+    std::atomic<uint64_t> operations{0};
+    // While split() copies the keys from split_pivot on, the upserts
+    // to them.  splitting and split_pivot only change with map_latch
+    // held exclusively.
+    bool splitting = false;
+    Key split_pivot = Key();
+    std::mutex moved_mutex;
+    std::vector<message> moved_upserts;
+  };
+
+  // Upserts, lookups and new iterators hold map_latch shared, and
+  // split() holds it exclusively while it starts recording upserts
+  // and while it switches the map over.  As with betree::load_root(),
+  // readers pass through the turnstile first, so that a split waiting
+  // for the latch isn't starved.
+  std::shared_lock<std::shared_mutex> read_map(void) {
+    { std::lock_guard<std::mutex> wait_for_split(turnstile); }
+    return std::shared_lock<std::shared_mutex>(map_latch);
+  }
+
+  std::unique_lock<std::shared_mutex> write_map(void) {
+    std::lock_guard<std::mutex> hold_off_readers(turnstile);
+    return std::unique_lock<std::shared_mutex>(map_latch);
+  }
+
+  // These two are called with map_latch held.
+
+  shard *route(const Key &k) {
+    auto it = starts.upper_bound(k);
+    if (it == starts.begin())
+      return first.get();
+    return (--it)->second.get();
+  }
+
+  // Call f(shard, its range) for each shard, in key order.
+  template<class F>
+  void for_each_shard(F f) {
+    key_range<Key> r;
+    std::shared_ptr<shard> s = first;
+    for (auto it = starts.begin(); ; ++it) {
+      r.has_end = it != starts.end();
+      if (r.has_end)
+	r.end = it->first;
+      f(s, r);
+      if (it == starts.end())
+	break;
+      s = it->second;
+      r.has_start = true;
+      r.start = it->first;
+    }
+  }
+
+  // Hand the pairs in range of snapshot snap of s to f, in batches of
+  // INSERT messages.
+  void copy_range(shard &s, uint64_t snap, key_range<Key> range,
+		  std::function<void(std::vector<message> &)> f) {
+    std::vector<std::pair<Key, Value> > pairs;
+    std::vector<message> msgs;
+    do {
+      pairs.clear();
+      s.node->scan(s.id, snap, range, scan_batch, pairs);
+      if (pairs.empty())
+	break;
+      msgs.clear();
+      for (auto it = pairs.begin(); it != pairs.end(); ++it)
+	msgs.push_back(message(it->first, Message<Value>(INSERT, it->second)));
+      f(msgs);
+      range.has_start = true;
+      range.start = pairs.back().first;
+      range.start_open = true;
+    } while (pairs.size() == scan_batch);
+  }
+
+  std::shared_mutex map_latch;
+  std::mutex turnstile;
+  std::mutex split_mutex;
+  // The shard holding the smallest keys, and the others by the first
+  // key they hold.
+  std::shared_ptr<shard> first;
+  std::map<Key, std::shared_ptr<shard> > starts;
+  std::atomic<uint64_t> next_shard_id{0};
+  uint64_t scan_batch = 256;
+};
+
+#endif
@@ -46,9 +46,15 @@
 // Objects are automatically garbage collected.  The garbage collector
 // uses reference counting.
 
-// The current system uses LRU to select items to swap.  The swap
-// space has a user-specified in-memory cache size it.  The cache size
-// can be adjusted dynamically.
+// The swap space has a user-specified in-memory cache size it,
+// measured in objects, in bytes (as reported by each object's
+// memory_footprint()), or both.  The cache size can be adjusted
+// dynamically.  Items to swap out are
+// chosen by a pluggable replacement policy (LRU by default; 2Q and
+// ARC resist being flushed by scans, see replacement_policy.hpp).
+// Only unpinned in-memory objects are candidates for eviction, and
+// touching an object and picking a victim are both O(1).  Optionally,
+// internal nodes are only evicted when no leaf can be.
 
 // Don't try to get your hands on an unwrapped pointer to the object
 // or anything that is swapped in/out as part of the object.  It can
@@ -56,6 +62,12 @@
 // write nice, clean, type-safe, well-encapsulated code and everything
 // should work just fine.
 
+// The swap_space can be made thread-safe (see set_thread_safe()).
+
+// Objects can also be loaded ahead of time: prefetch(p) has a pool of
+// I/O threads read and deserialize p's referent, and the next access
+// to it finds it in memory (or waits for the read already underway).
+
 // Objects managed by this system must be sub-types of class
 // serializable.  This basically defines two methods for serializing
 // and deserializing the object.  See the betree for examples of
@@ -63,9 +75,11 @@
 // a few basic types and STL containers.  Feel free to add more and
 // submit patches as you need them.
 
-// The current implementation serializes to a textual file format.
-// This is just a convenience.  It would be nice to be able to swap in
-// different formats.
+// Two on-disk formats are supported, selectable per swap_space.  The
+// binary format (the default) writes fixed-width little-endian
+// integers, length-prefixed strings and bulk-copies arrays of
+// trivially-copyable types.  The original textual format is kept
+// around because it is handy for debugging.
 
 #ifndef SWAP_SPACE_HPP
 #define SWAP_SPACE_HPP
@@ -76,26 +90,47 @@
 #include <set>
 #include <functional>
 #include <sstream>
+#include <vector>
+#include <type_traits>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <cassert>
 #include "include/backing_store.hpp"
+#include "include/replacement_policy.hpp"
+#include "include/compression.hpp"
 #include "include/debug.hpp"
 
 class swap_space;
 
+enum serialization_format {
+  TEXT_SERIALIZATION,
+  BINARY_SERIALIZATION
+};
+
 class serialization_context {
 public:
-  serialization_context(swap_space &sspace) :
-    ss(sspace),
-    is_leaf(true)
-  {}
+  serialization_context(swap_space &sspace);
   swap_space &ss;
   bool is_leaf;
+  serialization_format format;
+  // Set when deserializing in a prefetch thread, which mustn't look at
+  // the swap_space's tables.
+  bool in_background;
 };
 
 class serializable {
 public:
   virtual void _serialize(std::iostream &fs, serialization_context &context) = 0;
   virtual void _deserialize(std::iostream &fs, serialization_context &context) = 0;
+  // Roughly how many bytes of memory the object uses, including
+  // everything that gets swapped in and out with it.  Called whenever
+  // the object is unpinned, so it should be cheap.  0 means "don't
+  // know", in which case the swap_space charges the object's
+  // serialized size as of its last load or write-back.
+  virtual uint64_t memory_footprint(void) const { return 0; }
   virtual ~serializable(void) {};
 };
 
@@ -105,13 +140,109 @@ void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 void serialize(std::iostream &fs, serialization_context &context, int64_t x);
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x);
 
+void serialize(std::iostream &fs, serialization_context &context, uint8_t x);
+void deserialize(std::iostream &fs, serialization_context &context, uint8_t &x);
+
 void serialize(std::iostream &fs, serialization_context &context, std::string x);
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x);
 
+// Number of bytes x takes up in the binary format.  Used for
+// byte-based size accounting, so it only needs to be cheap and
+// roughly right.  Only trivially copyable types fall back to
+// sizeof; any other key or value type (e.g. one that owns heap data)
+// must provide its own overload.
+inline uint64_t serialized_size(uint64_t) { return 8; }
+inline uint64_t serialized_size(int64_t) { return 8; }
+inline uint64_t serialized_size(uint8_t) { return 1; }
+inline uint64_t serialized_size(const std::string &x) { return 8 + x.size(); }
+template<class X> uint64_t serialized_size(const X &)
+{
+  static_assert(std::is_trivially_copyable<X>::value,
+		"serialized_size() needs an overload for this type");
+  return sizeof(X);
+}
+
+// Arrays of plain-old-data are written with a single write() in the
+// binary format, provided the host byte order matches the on-disk
+// (little-endian) byte order.
+template<class T> struct is_bulk_serializable {
+  static const bool value =
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    std::is_trivially_copyable<T>::value &&
+    !std::is_pointer<T>::value &&
+    !std::is_base_of<serializable, T>::value;
+#else
+    false;
+#endif
+};
+
+template<class T> void serialize_array(std::iostream &fs,
+				       serialization_context &context,
+				       T *a, size_t n)
+{
+  if (context.format == BINARY_SERIALIZATION &&
+      is_bulk_serializable<T>::value) {
+    fs.write((const char *)a, n * sizeof(T));
+    assert(fs.good());
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    serialize(fs, context, a[i]);
+    if (context.format == TEXT_SERIALIZATION)
+      fs << " ";
+  }
+}
+
+template<class T> void deserialize_array(std::iostream &fs,
+					 serialization_context &context,
+					 T *a, size_t n)
+{
+  if (context.format == BINARY_SERIALIZATION &&
+      is_bulk_serializable<T>::value) {
+    fs.read((char *)a, n * sizeof(T));
+    assert(fs.good());
+    return;
+  }
+  for (size_t i = 0; i < n; i++)
+    deserialize(fs, context, a[i]);
+}
+
+template<class T> void serialize(std::iostream &fs,
+				 serialization_context &context,
+				 std::vector<T> &v)
+{
+  if (context.format == TEXT_SERIALIZATION)
+    fs << "vector ";
+  serialize(fs, context, (uint64_t)v.size());
+  serialize_array(fs, context, v.data(), v.size());
+}
+
+template<class T> void deserialize(std::iostream &fs,
+				   serialization_context &context,
+				   std::vector<T> &v)
+{
+  std::string dummy;
+  uint64_t size = 0;
+  if (context.format == TEXT_SERIALIZATION)
+    fs >> dummy;
+  deserialize(fs, context, size);
+  v.resize(size);
+  deserialize_array(fs, context, v.data(), v.size());
+}
+
 template<class Key, class Value> void serialize(std::iostream &fs,
 						serialization_context &context,
 						std::map<Key, Value> &mp)
 {
+  if (context.format == BINARY_SERIALIZATION) {
+    serialize(fs, context, (uint64_t)mp.size());
+    for (auto it = mp.begin(); it != mp.end(); ++it) {
+      serialize(fs, context, it->first);
+      serialize(fs, context, it->second);
+    }
+    return;
+  }
+
   fs << "map " << mp.size() << " {" << std::endl;
   assert(fs.good());
   for (auto it = mp.begin(); it != mp.end(); ++it) {
@@ -128,6 +259,19 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
 						  serialization_context &context,
 						  std::map<Key, Value> &mp)
 {
+  if (context.format == BINARY_SERIALIZATION) {
+    uint64_t size = 0;
+    deserialize(fs, context, size);
+    for (uint64_t i = 0; i < size; i++) {
+      Key k;
+      Value v;
+      deserialize(fs, context, k);
+      deserialize(fs, context, v);
+      mp.emplace_hint(mp.end(), k, v);
+    }
+    return;
+  }
+
   std::string dummy;
   int size = 0;
   fs >> dummy >> size >> dummy;
@@ -145,16 +289,19 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
 
 template<class X> void serialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  fs << "pointer ";
+  if (context.format == TEXT_SERIALIZATION)
+    fs << "pointer ";
   serialize(fs, context, *x);
 }
 
 template<class X> void deserialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  std::string dummy;
   x = new X;
-  fs >> dummy;
-  assert (dummy == "pointer");
+  if (context.format == TEXT_SERIALIZATION) {
+    std::string dummy;
+    fs >> dummy;
+    assert (dummy == "pointer");
+  }
   deserialize(fs, context, *x);
 }
 
@@ -170,7 +317,158 @@ template<class X> void deserialize(std::iostream &fs, serialization_context &con
 
 class swap_space {
 public:
-  swap_space(backing_store *bs, uint64_t n);
+  swap_space(backing_store *bs, uint64_t n,
+	     serialization_format fmt = BINARY_SERIALIZATION);
+
+  serialization_format get_serialization_format(void) const {
+    return format;
+  }
+
+  ~swap_space(void);
+
+  // Allow pointers into the swap_space to be pinned, accessed, copied
+  // and destroyed from several threads at once.  The object table is
+  // then sharded with a lock per shard, and the replacement policy,
+  // the cache's counters and the object states are protected by a
+  // cache lock.  That lock is only taken on misses, on the first pin
+  // and last unpin of an object, and when objects are created or
+  // freed, and it isn't held while reading objects in.  Keeping
+  // threads from modifying an object that another thread is using is
+  // up to the user (see betree::set_concurrent()).  The backing store
+  // must be thread-safe.  Only change this while no other thread is
+  // using the swap_space.
+  void set_thread_safe(bool ts);
+
+  // Keep at most sz objects in memory, evicting right away if
+  // necessary.
+  void set_cache_size(uint64_t sz);
+
+  // Keep at most bytes bytes of objects in memory.  This applies on
+  // top of the limit on the number of objects; set that to
+  // UINT64_MAX to limit memory by bytes alone.  Objects are charged
+  // what they report when they're loaded, created or unpinned, so a
+  // pinned object growing past the budget is only noticed when it's
+  // released.
+  void set_cache_size_in_bytes(uint64_t bytes);
+
+  // Bytes charged to in-memory objects, now and at most so far.
+  uint64_t get_resident_bytes(void) const {
+    return current_in_memory_bytes;
+  }
+
+  uint64_t get_peak_resident_bytes(void) const {
+    return peak_in_memory_bytes;
+  }
+
+  // Switch replacement policies.  If favor_internal_nodes is set,
+  // nodes with swap_space::pointers in them (i.e. everything but
+  // leaves) are only evicted when no leaf can be, and leaves and
+  // internal nodes are each managed by their own instance of the
+  // policy.  Objects that have never been written back count as
+  // leaves until they are.
+  void set_replacement_policy(replacement_policy_kind kind,
+			      bool favor_internal_nodes = false);
+
+  class cache_stats {
+  public:
+    uint64_t hits = 0;     // accesses to objects already in memory
+    uint64_t misses = 0;   // accesses that had to load the object
+    uint64_t evictions = 0;
+    uint64_t dirty_evictions = 0;        // had to write the victim first
+    uint64_t background_writebacks = 0;
+    uint64_t prefetches = 0;     // loads started by prefetch()
+    uint64_t prefetch_hits = 0;  // first accesses to prefetched objects
+    uint64_t prefetch_waits = 0; // of those, ones that had to wait
+    uint64_t bytes_serialized = 0; // by write-backs, before compression
+    uint64_t bytes_stored = 0;     // by write-backs, after compression
+    uint64_t image_loads = 0;  // loads served from retained images
+  };
+
+  cache_stats get_cache_stats(void);
+  void reset_cache_stats(void);
+
+  // Compress objects with codec from now on (see compression.hpp).
+  // Each stored version records how it was compressed, so versions
+  // written with other codecs, or none, can still be read.  With
+  // background write-back, the writer threads do the compressing.
+  void set_compression(compression_codec codec);
+
+  // Keep the stored images of up to n leaves after loading them, so
+  // that loading one again after it has been evicted deserializes it
+  // from memory instead of reading the backing store.  Stores whose
+  // read() maps files (see one_file_per_object_backing_store) hand
+  // out the mappings themselves, which live in the page cache and
+  // aren't charged against the cache size.  A leaf's image is
+  // dropped once a newer version of it is written.  The default of 0
+  // keeps none.
+  void set_retained_leaf_images(uint64_t n);
+
+  // Objects written back by evictions become durable in groups of n
+  // writes: the backing store is sync()ed after every n-th write, and
+  // only then are the versions those writes replaced deallocated.
+  // The default of 1 makes every write-back durable before the old
+  // version goes away.  Use with a write-behind backing store.
+  void set_write_group_size(uint64_t n);
+
+  // Durability barrier: sync the backing store, so that every object
+  // written back so far is durable, and free the versions they
+  // replaced.  Waits for background write-backs in progress.
+  void checkpoint(void);
+
+  // Persistent checkpoints (see betree::open()).  write_checkpoint()
+  // writes every dirty object back, syncs the backing store and
+  // serializes the object table (each object's id, current version
+  // and reference count) to out.  Once the caller has made that
+  // durable, commit_checkpoint() frees the versions only the
+  // previous checkpoint needed.  From the first checkpoint on, the
+  // versions the latest committed one names are kept until the next
+  // commit, even if their objects are written back again or freed.
+  // Nothing may modify objects in between.
+  void write_checkpoint(std::iostream &out);
+  void commit_checkpoint(void);
+  // Fill an empty swap_space with a checkpointed object table.  The
+  // references it counts include the ones that were held from
+  // outside the swap_space (e.g. a tree's root pointer); deserialize
+  // those pointers to take them over.  References held at checkpoint
+  // time by anything not reopened this way leak their objects.
+  void read_checkpoint(std::iostream &in);
+
+  // Clean dirty objects ahead of eviction.  Whenever the cache is
+  // full, the (up to) window unpinned objects closest to eviction are
+  // looked at, and any dirty ones are serialized and handed to a pool
+  // of nthreads threads that write them to the backing store, so that
+  // evictions mostly find clean objects they can just drop.
+  // Serialization still happens in the calling thread, since objects
+  // can't be read while the caller may be modifying them; only the
+  // backing store I/O moves off of it.  The backing store must be
+  // thread-safe.
+  void start_background_writeback(uint64_t nthreads, uint64_t window = 16);
+  // Finish the write-backs in progress and stop the threads.
+  void stop_background_writeback(void);
+
+  // Load objects before they're needed.  prefetch(p) hands p's
+  // referent, if it isn't in memory, to a pool of nthreads threads
+  // that read and deserialize it; it joins the cache the next time
+  // the swap_space looks, or when it's accessed.  At most depth
+  // prefetches are in flight, and requests beyond that are dropped.
+  // The backing store must be thread-safe.
+  void start_prefetching(uint64_t nthreads, uint64_t depth = 16);
+  // Wait for the prefetches in flight and stop the threads.
+  void stop_prefetching(void);
+
+  // Do the I/O of background write-back and prefetching through the
+  // backing store's asynchronous interface (see
+  // backing_store::submit_write()) instead of with threads.  The
+  // dirty objects among the window next victims are serialized,
+  // compressed and submitted together, and up to depth prefetches
+  // are kept in flight.  Finished I/O is reaped whenever the
+  // swap_space looks, and prefetched objects are deserialized by the
+  // thread that reaps them.  Only pays off with a store that really
+  // overlaps I/O, like async_file_backing_store.  Can't be combined
+  // with start_background_writeback() or start_prefetching().
+  void start_async_io(uint64_t window = 16, uint64_t depth = 16);
+  // Wait for the I/O in flight and go back to doing it synchronously.
+  void stop_async_io(void);
 
   template<class Referent> class pointer;
 
@@ -188,19 +486,11 @@ public:
   class pin {
   public:
     const Referent * operator->(void) const {
-      assert(ss->objects.count(target) > 0);
-      debug(std::cout << "Accessing (constly) " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, false);
-      return (const Referent *)ss->objects[target]->target;
+      return (const Referent *)access(target, false);
     }
 
     Referent * operator->(void) {
-      assert(ss->objects.count(target) > 0);
-      debug(std::cout << "Accessing " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, true);
-      return (Referent *)ss->objects[target]->target;
+      return (Referent *)access(target, true);
     }
 
     pin(const pointer<Referent> *p)
@@ -215,6 +505,14 @@ public:
 	target(0)
     {}
 
+    pin(pin &&other)
+      : ss(other.ss),
+	target(other.target)
+    {
+      other.ss = NULL;
+      other.target = 0;
+    }
+
     ~pin(void) {
       unpin();
     }
@@ -224,46 +522,78 @@ public:
 	unpin();
 	dopin(other.ss, other.target);
       }
+      return *this;
     }
     
   private:
 
     //called when pointer no longer accessed - remove pincount and maybe evict from cache.
     void unpin(void) {
-      debug(std::cout << "Unpinning " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
       if (target > 0) {
-	assert(ss->objects.count(target) > 0);
-	ss->objects[target]->pincount--;
-	ss->maybe_evict_something();
+	object *obj = ss->objects.find(target);
+	assert(obj != NULL);
+	debug(std::cout << "Unpinning " << target
+	      << " id " << obj->id << " version " << obj->version << std::endl);
+	// Only the last unpin needs the cache lock (see dopin).
+	uint64_t c = obj->pincount;
+	while (c > 1 && !obj->pincount.compare_exchange_weak(c, c - 1))
+	  ;
+	if (c <= 1) {
+	  std::unique_lock<std::mutex> lock = ss->lock_cache();
+	  if (--obj->pincount == 0 && obj->target != NULL) {
+	    ss->charge(obj);
+	    obj->policy->release(obj);
+	  }
+	  ss->maybe_evict_something();
+	}
       }
       ss = NULL;
       target = 0;
     }
 
-    //Called when creating pin type - assert target exists, then force load in ss.
+    //Called when creating pin type - assert target exists.  The
+    //object is loaded on first access.
     void dopin(swap_space *newss, uint64_t newtarget) {
       assert(ss == NULL && target == 0);
       ss = newss;
       target = newtarget;
       if (target > 0) {
-	assert(ss->objects.count(target) > 0);
+	object *obj = ss->objects.find(target);
+	assert(obj != NULL);
 	debug(std::cout << "Pinning " << target
-	      << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-	ss->objects[target]->pincount++;
+	      << " id " << obj->id << " version " << obj->version << std::endl);
+	// Nothing evicts a pinned object, so pinning an object that's
+	// already pinned needs no lock.  Taking the pin count from 0
+	// to 1 (and back) happens under the cache lock, so eviction
+	// can trust a count of 0.
+	uint64_t c = obj->pincount;
+	while (c > 0 && !obj->pincount.compare_exchange_weak(c, c + 1))
+	  ;
+	if (c == 0) {
+	  std::unique_lock<std::mutex> lock = ss->lock_cache();
+	  if (obj->pincount++ == 0 && obj->target != NULL)
+	    ss->first_pin(obj);
+	}
       }
     }
     
     //Called when accessing object, forces load - requires object to be pinned.
-    void access(uint64_t tgt, bool dirty) const {
-      assert(ss->objects.count(tgt) > 0);
-      object *obj = ss->objects[tgt];
-      ss->lru_pqueue.erase(obj);
-      obj->last_access = ss->next_access_time++;
-      ss->lru_pqueue.insert(obj);
-      obj->target_is_dirty |= dirty;
-      ss->load<Referent>(tgt);
+    serializable * access(uint64_t tgt, bool dirty) const {
+      object *obj = ss->objects.find(tgt);
+      assert(obj != NULL && obj->pincount > 0);
+      debug(std::cout << "Accessing " << tgt
+	    << " id " << obj->id << " version " << obj->version << std::endl);
+      if (dirty)
+	obj->target_is_dirty = true;
+      serializable *t = obj->target;
+      if (t != NULL) {
+	ss->hits++;
+	return t;
+      }
+      std::unique_lock<std::mutex> lock = ss->lock_cache();
+      ss->load<Referent>(obj, lock);
       ss->maybe_evict_something();
+      return obj->target;
     }
   
     swap_space *ss;
@@ -286,8 +616,9 @@ public:
       ss = other.ss;
       target = other.target;
       if (target > 0) {
-	assert(ss->objects.count(target) > 0);
-	ss->objects[target]->refcount++;
+	object *obj = ss->objects.find(target);
+	assert(obj != NULL);
+	obj->refcount++;
       }
     }
 
@@ -298,27 +629,49 @@ public:
     void depoint(void) {
       if (target == 0)
 	return;
-      assert(ss->objects.count(target) > 0);
+      if (detaching) {
+	// Our referent is being evicted, and its on-disk version
+	// holds this reference now.
+	target = 0;
+	return;
+      }
 
-      object *obj = ss->objects[target];
+      object *obj = ss->objects.find(target);
+      assert(obj != NULL);
       assert(obj->refcount > 0);
       if ((--obj->refcount) == 0) {
-	debug(std::cout << "Erasing " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
-	// Load it into memory so we can recursively free stuff
-	if (obj->target == NULL) {
+	debug(std::cout << "Erasing " << target << " id " << obj->id << " version " << obj->version << std::endl);
+	serializable *t;
+	{
+	  std::unique_lock<std::mutex> lock = ss->lock_cache();
+	  // Don't free the version a prefetch thread is reading.
+	  if (obj->prefetch_pending)
+	    ss->wait_for_prefetches(obj);
+	  if (obj->policy)
+	    obj->policy->forget(obj);
+	  ss->objects.erase(target);
+	  t = obj->target;
+	  if (t) {
+	    ss->current_in_memory_objects--;
+	    ss->current_in_memory_bytes -= obj->bytes;
+	  }
+	  if (obj->version > 0 && obj->version == obj->checkpoint_version)
+	    ss->checkpoint_deallocations.push_back(std::make_pair(obj->id, obj->version));
+	}
+	// Load it into memory so we can recursively free stuff.  Its
+	// children's depoints take the cache lock, so we don't hold it.
+	if (t == NULL) {
 	  assert(obj->version > 0);
 	  if (!obj->is_leaf) {
-	    ss->load<Referent>(target);
+	    t = new Referent();
+	    std::shared_ptr<stored_block> block;
+	    ss->read(obj->id, obj->version, block, t, false);
 	  } else {
-	    debug(std::cout << "Skipping load of leaf " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
+	    debug(std::cout << "Skipping load of leaf " << target << " id " << obj->id << " version " << obj->version << std::endl);
 	  }
 	}
-	ss->objects.erase(target);
-	ss->lru_pqueue.erase(obj);
-	if (obj->target)
-	  delete obj->target;
-	ss->current_in_memory_objects--;
-	if (obj->version > 0)
+	delete t;
+	if (obj->version > 0 && obj->version != obj->checkpoint_version)
 	  ss->backstore->deallocate(obj->id, obj->version);
 	delete obj;
       }
@@ -331,8 +684,9 @@ public:
 	ss = other.ss;
 	target = other.target;
 	if (target > 0) {
-	  assert(ss->objects.count(target) > 0);
-	  ss->objects[target]->refcount++;
+	  object *obj = ss->objects.find(target);
+	  assert(obj != NULL);
+	  obj->refcount++;
 	}
       }
       return *this;
@@ -368,20 +722,21 @@ public:
     }
     
     bool is_in_memory(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target != NULL;
+      object *obj = ss->objects.find(target);
+      assert(obj != NULL);
+      return obj->target != NULL;
     }
 
     bool is_dirty(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target && ss->objects[target]->target_is_dirty;
+      object *obj = ss->objects.find(target);
+      assert(obj != NULL);
+      return obj->target != NULL && obj->target_is_dirty;
     }
 
     void _serialize(std::iostream &fs, serialization_context &context) {
       assert(target > 0);
-      assert(context.ss.objects.count(target) > 0);
-      fs << target << " ";
-      target = 0;
+      assert(context.ss.objects.find(target) != NULL);
+      serialize(fs, context, target);
       assert(fs.good());
       context.is_leaf = false;
     }
@@ -389,9 +744,9 @@ public:
     void _deserialize(std::iostream &fs, serialization_context &context) {
       assert(target == 0);
       ss = &context.ss;
-      fs >> target;
+      deserialize(fs, context, target);
       assert(fs.good());
-      assert(context.ss.objects.count(target) > 0);
+      assert(context.in_background || context.ss.objects.find(target) != NULL);
       // We just created a new reference to this object and
       // invalidated the on-disk reference, so the total refcount
       // stays the same.
@@ -406,75 +761,310 @@ public:
     pointer(swap_space *sspace, Referent *tgt)
     {
       ss = sspace;
-      target = sspace->next_id++;
 
       object *o = new object(sspace, tgt);
       assert(o != NULL);
       target = o->id;
-      assert(ss->objects.count(target) == 0);
-      ss->objects[target] = o;
-      ss->lru_pqueue.insert(o);
+      std::unique_lock<std::mutex> lock = ss->lock_cache();
+      ss->objects.insert(o);
+      ss->cache_admit(o);
+      ss->charge(o);
+      o->policy->release(o);
       ss->current_in_memory_objects++;
       ss->maybe_evict_something();
     }
 
   };
+
+  // Let go of p without freeing its referent, which lives on in a
+  // checkpoint.
+  template<class Referent>
+  void abandon(pointer<Referent> &p) {
+    detaching = true;
+    p.depoint();
+    detaching = false;
+  }
+
+  template<class Referent>
+  void prefetch(const pointer<Referent> &p) {
+    if ((readers.empty() && !async_io) || p.target == 0)
+      return;
+    std::unique_lock<std::mutex> cache_lock = lock_cache();
+    object *obj = objects.find(p.target);
+    assert(obj != NULL);
+    if (obj->target != NULL || obj->prefetch_pending || obj->loading)
+      return;
+    if (prefetches_outstanding >= prefetch_depth)
+      apply_finished_prefetches();
+    if (prefetches_outstanding >= prefetch_depth)
+      return;
+    assert(obj->version > 0);
+
+    prefetch_request req;
+    req.id = obj->id;
+    req.version = obj->version;
+    req.make = &construct<Referent>;
+    req.target = NULL;
+    req.serialized_bytes = 0;
+    req.image = obj->image;
+    if (req.image)
+      stats.image_loads++;
+    obj->prefetch_pending = true;
+    prefetches_outstanding++;
+    stats.prefetches++;
+
+    if (async_io) {
+      submit_async_read(req);
+      return;
+    }
+    std::unique_lock<std::mutex> lock(prefetch_mutex);
+    prefetch_queue.push_back(req);
+    prefetch_queued.notify_one();
+  }
   
 private:
   backing_store *backstore;  
+  serialization_format format;
+  // Only changed while no write-backs are in flight.
+  compression_codec compression = NO_COMPRESSION;
 
-  uint64_t next_id = 1;
-  uint64_t next_access_time = 0;
+  // Starts at the store's reserve_object_ids().
+  std::atomic<uint64_t> next_id{1};
   
-  class object {
+  // In thread-safe mode, everything but the atomic fields is
+  // protected by the cache lock, except that whoever has an object
+  // pinned may read target and set target_is_dirty.
+  class object : public cache_entry {
   public:
     
     object(swap_space *sspace, serializable * tgt);
     
-    serializable * target;
+    std::atomic<serializable *> target;
     uint64_t id;
     uint64_t version;
     bool is_leaf;
-    uint64_t refcount;
-    uint64_t last_access;
-    bool target_is_dirty;
-    uint64_t pincount;
+    std::atomic<uint64_t> refcount;
+    std::atomic<bool> target_is_dirty;
+    std::atomic<uint64_t> pincount;
+    // The policy that has been told about this object, if any.
+    replacement_policy *policy;
+    // Bytes charged for the object while it's in memory, and its
+    // serialized size as of its last load or write-back.
+    uint64_t bytes;
+    uint64_t serialized_bytes;
+    // A background write of version+1 is queued or in progress.
+    bool writeback_pending;
+    // A prefetch of the object is queued or in progress, or it was
+    // loaded by one and hasn't been accessed since.
+    bool prefetch_pending;
+    bool prefetched;
+    // A thread is reading the object in for an access.
+    bool loading;
+    // The version the last committed checkpoint names, if any.
+    uint64_t checkpoint_version;
+    // The stored image of version, if it's a leaf and images are
+    // being retained.
+    std::shared_ptr<stored_block> image;
+  };
+
+  // The table of all objects, by id.  In thread-safe mode it's split
+  // into shards with a lock each, so that looking up an object
+  // doesn't need the cache lock.
+  class object_table {
+  public:
+    object * find(uint64_t id);
+    void insert(object *obj);
+    void erase(uint64_t id);
+    template<class F> void for_each(F f) {
+      for (size_t i = 0; i < NSHARDS; i++)
+	for (auto it = shards[i].map.begin(); it != shards[i].map.end(); ++it)
+	  f(it->second);
+    }
+    bool locking = false;
+
+  private:
+    static const size_t NSHARDS = 16;
+    class shard {
+    public:
+      std::mutex mutex;
+      std::unordered_map<uint64_t, object *> map;
+    };
+    shard & shard_for(uint64_t id) { return shards[id % NSHARDS]; }
+    shard shards[NSHARDS];
   };
 
-  static bool cmp_by_last_access(object *a, object *b);
+  // The cache lock, if the swap_space is thread-safe, or an empty
+  // lock otherwise.
+  std::unique_lock<std::mutex> lock_cache(void) {
+    if (!thread_safe)
+      return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(cache_mutex);
+  }
+
+  void cache_admit(object *obj);
+  void charge(object *obj);
+  void first_pin(object *obj);
 
+  //Deserialize version of object id into target, and return how
+  //many bytes that took.  Reads the version into block unless it's
+  //already there.
+  uint64_t read(uint64_t id, uint64_t version,
+		std::shared_ptr<stored_block> &block,
+		serializable *target, bool in_background);
+  void retain_image(object *obj, const std::shared_ptr<stored_block> &block);
+  void trim_retained_images(void);
 
-  //ss load - if the object is not in memory (target != null)
-  //bring into memory.
+  //bring a pinned object into memory if it isn't.  Called with the
+  //cache lock, which is dropped while reading, so other threads
+  //wanting the object wait for this one (or for its prefetch).
   template<class Referent>
-  void load(uint64_t tgt) {
-    assert(objects.count(tgt) > 0);
-    if (objects[tgt]->target == NULL) {
-      object *obj = objects[tgt];
-      debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
-      std::iostream *in = backstore->get(obj->id, obj->version);
-      Referent *r = new Referent();
-      serialization_context ctxt(*this);
-      deserialize(*in, ctxt, *r);
-      backstore->put(in);
-      obj->target = r;
-      current_in_memory_objects++;
+  void load(object *obj, std::unique_lock<std::mutex> &lock) {
+    while (obj->target == NULL && (obj->prefetch_pending || obj->loading)) {
+      if (obj->prefetch_pending) {
+	stats.prefetch_waits++;
+	wait_for_prefetches(obj);
+      } else {
+	object_loaded.wait(lock);
+      }
+    }
+    if (obj->target != NULL) {
+      hits++;
+      return;
     }
+
+    debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
+    stats.misses++;
+    obj->loading = true;
+    uint64_t id = obj->id;
+    uint64_t version = obj->version;
+    std::shared_ptr<stored_block> block = obj->image;
+    if (block)
+      stats.image_loads++;
+    if (thread_safe)
+      lock.unlock();
+    Referent *r = new Referent();
+    uint64_t nbytes = read(id, version, block, r, false);
+    if (thread_safe)
+      lock.lock();
+    obj->loading = false;
+    object_loaded.notify_all();
+    retain_image(obj, block);
+
+    obj->target = r;
+    obj->serialized_bytes = nbytes;
+    current_in_memory_objects++;
+    cache_admit(obj);
+    charge(obj);
   }
 
-  void set_cache_size(uint64_t sz);
-  
   void write_back(object *obj);
   void maybe_evict_something(void);
+  void sync_and_free_old_versions(void);
+  void version_written(object *obj, uint64_t version);
+
+  void queue_writebacks(void);
+  void apply_finished_writebacks(void);
+  void wait_for_writebacks(object *obj);
+  void writer_main(void);
+
+  void apply_finished_prefetches(void);
+  void wait_for_prefetches(object *obj);
+  void reader_main(void);
+
+  class prefetch_request;
+  void submit_async_read(const prefetch_request &req);
+  void finish_async_read(prefetch_request &req);
+  void reap_async_io(size_t min);
   
   uint64_t max_in_memory_objects;
   uint64_t current_in_memory_objects = 0;
+  uint64_t max_in_memory_bytes = UINT64_MAX;
+  uint64_t current_in_memory_bytes = 0;
+  uint64_t peak_in_memory_bytes = 0;
+
+  uint64_t write_group_size = 1;
+  uint64_t unsynced_writes = 0;
+  // (id, version)s superseded by writes that aren't durable yet.
+  std::vector<std::pair<uint64_t, uint64_t> > pending_deallocations;
+  // (id, version)s superseded or freed since the last committed
+  // checkpoint, which still names them.
+  std::vector<std::pair<uint64_t, uint64_t> > checkpoint_deallocations;
+
+  // (id, version)s of the leaves with retained images, oldest first.
+  // Entries for images that have since been dropped stay until
+  // they're trimmed, and count against the limit.
+  uint64_t max_retained_images = 0;
+  std::deque<std::pair<uint64_t, uint64_t> > retained_images;
+
+  // Set while deleting an evicted object.
+  static thread_local bool detaching;
+
+  bool thread_safe = false;
+  std::mutex cache_mutex;
+  std::condition_variable object_loaded;
+
+  // Background write-back.  writeback_mutex protects the queues and
+  // stop_writers; everything else belongs to the thread using the
+  // swap_space.
+  class writeback {
+  public:
+    uint64_t id;
+    uint64_t version;
+    std::string buffer;
+    uint64_t bytes_stored;
+  };
+  std::vector<std::thread> writers;
+  uint64_t writeback_window = 0;
+  std::mutex writeback_mutex;
+  std::condition_variable writeback_queued;
+  std::condition_variable writeback_finished;
+  std::deque<writeback> writeback_queue;
+  std::vector<writeback> finished_writebacks;
+  bool stop_writers = false;
+  // Queued or in progress, and not yet applied.
+  uint64_t writebacks_outstanding = 0;
+
+  // Prefetching, organized the same way: prefetch_mutex protects the
+  // queues and stop_readers.
+  class prefetch_request {
+  public:
+    uint64_t id;
+    uint64_t version;
+    serializable * (*make)(void);
+    serializable *target;
+    uint64_t serialized_bytes;
+    std::shared_ptr<stored_block> image;
+  };
+  template<class Referent> static serializable * construct(void) {
+    return new Referent();
+  }
+  std::vector<std::thread> readers;
+  uint64_t prefetch_depth = 0;
+  std::mutex prefetch_mutex;
+  std::condition_variable prefetch_queued;
+  std::condition_variable prefetch_finished;
+  std::deque<prefetch_request> prefetch_queue;
+  std::vector<prefetch_request> finished_prefetches;
+  bool stop_readers = false;
+  uint64_t prefetches_outstanding = 0;
+
+  // Asynchronous I/O in flight, by tag.  Finished operations go to
+  // finished_writebacks and finished_prefetches like the threads'.
+  bool async_io = false;
+  uint64_t next_io_tag = 0;
+  std::unordered_map<uint64_t, writeback> async_writes;
+  std::unordered_map<uint64_t, prefetch_request> async_reads;
 
 
   //structs used in ss
   //objects is a map from targets->objects (target == obj->id)
-  std::unordered_map<uint64_t, object *> objects;
-  std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+  object_table objects;
+  // The same policy unless internal nodes are favored.
+  replacement_policy *leaf_policy;
+  replacement_policy *internal_policy;
+  cache_stats stats;
+  // Counted without the cache lock.
+  std::atomic<uint64_t> hits{0};
 };
 
 #endif // SWAP_SPACE_HPP
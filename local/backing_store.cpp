@@ -2,24 +2,102 @@
 #include <iostream>
 #include <ext/stdio_filebuf.h>
 #include <unistd.h>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <dirent.h>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/map.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+//Throw if a system call we can't carry on without failed.
+static void check_syscall(bool ok, const std::string &what)
+{
+  if (!ok)
+    throw std::runtime_error(what + ": " + strerror(errno));
+}
+
+//copy the version out of the stream get() returns for it.
+std::shared_ptr<stored_block> backing_store::read(uint64_t obj_id, uint64_t version)
+{
+  std::iostream *ios = get(obj_id, version);
+  std::string contents{std::istreambuf_iterator<char>(*ios),
+		       std::istreambuf_iterator<char>()};
+  put(ios);
+  return std::make_shared<buffered_block>(std::move(contents));
+}
+
+void backing_store::submit_read(uint64_t tag, uint64_t obj_id, uint64_t version)
+{
+  io_completion c;
+  c.tag = tag;
+  c.block = read(obj_id, version);
+  completed.push_back(c);
+}
+
+void backing_store::submit_write(uint64_t tag, uint64_t obj_id, uint64_t version,
+				 std::string contents)
+{
+  std::iostream *out = get(obj_id, version);
+  out->write(contents.data(), contents.length());
+  put(out);
+  io_completion c;
+  c.tag = tag;
+  completed.push_back(c);
+}
+
+//submit_read() and submit_write() complete right away, so there are
+//always at least min completions.
+void backing_store::poll(std::vector<io_completion> &done,
+			 [[maybe_unused]] size_t min)
+{
+  assert(completed.size() >= min);
+  done.insert(done.end(), completed.begin(), completed.end());
+  completed.clear();
+}
 
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
 /////////////////////////////////////////////////////////////
-one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt)
-  : root(rt)
+one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt,
+								     bool writebehind)
+  : root(rt),
+    write_behind(writebehind),
+    unsynced_mutex(),
+    unsynced()
 {}
 
+one_file_per_object_backing_store::~one_file_per_object_backing_store(void)
+{
+  for (size_t i = 0; i < unsynced.size(); i++)
+    close(unsynced[i]);
+}
+
 //allocate space for a new version of an object
 //requires that version be >> any previous version
 //logic for this is now handled by the swap space
 void one_file_per_object_backing_store::allocate(uint64_t obj_id, uint64_t version) {
   //uint64_t id = nextid++;
   std::string filename = get_filename(obj_id, version);
-  std::fstream dummy(filename, std::fstream::out);
-  dummy.flush();
-  assert(dummy.good());
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  assert(fd >= 0);
+  close(fd);
+  if (write_behind) {
+    std::unique_lock<std::mutex> lock(unsynced_mutex);
+    allocated.insert(std::make_pair(obj_id, version));
+  }
   //return id;
 }
 
@@ -41,6 +119,12 @@ std::iostream * one_file_per_object_backing_store::get(uint64_t obj_id, uint64_t
   ios->std::ios::rdbuf(fb);
   ios->exceptions(std::fstream::badbit | std::fstream::failbit | std::fstream::eofbit);
   assert(ios->good());
+
+  if (write_behind) {
+    std::unique_lock<std::mutex> lock(unsynced_mutex);
+    if (allocated.erase(std::make_pair(obj_id, version)))
+      writing.insert(ios);
+  }
   
   return ios;
 }
@@ -50,11 +134,111 @@ void one_file_per_object_backing_store::put(std::iostream *ios)
 {
   ios->flush();
   __gnu_cxx::stdio_filebuf<char> *fb = (__gnu_cxx::stdio_filebuf<char> *)ios->rdbuf();
-  fsync(fb->fd());
+  if (write_behind) {
+    std::unique_lock<std::mutex> lock(unsynced_mutex);
+    if (writing.erase(ios)) {
+      int fd = dup(fb->fd());
+      assert(fd >= 0);
+      unsynced.push_back(fd);
+    }
+  } else {
+    fsync(fb->fd());
+  }
   delete ios;
   delete fb;
 }
 
+// A file mapped read-only.  The mapping outlives the file if the
+// version is deallocated meanwhile.
+class mapped_block : public stored_block {
+public:
+  mapped_block(void *addr, size_t len) {
+    bytes = (const char *)addr;
+    length = len;
+  }
+  ~mapped_block(void) {
+    munmap((void *)bytes, length);
+  }
+};
+
+//map the version's file, populating the mapping up front so that
+//deserializing it doesn't fault on every page.  Files smaller than
+//a page are cheaper to copy than to map.
+std::shared_ptr<stored_block>
+one_file_per_object_backing_store::read(uint64_t obj_id, uint64_t version)
+{
+  std::string filename = get_filename(obj_id, version);
+  int fd = open(filename.c_str(), O_RDONLY);
+  check_syscall(fd >= 0, "Can't open " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int e = errno;
+    close(fd);
+    throw std::runtime_error("Can't stat " + filename + ": " + strerror(e));
+  }
+  size_t length = st.st_size;
+
+  std::shared_ptr<stored_block> block;
+  if (length >= (size_t)sysconf(_SC_PAGESIZE)) {
+    void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    int e = errno;
+    close(fd);
+    if (addr == MAP_FAILED)
+      throw std::runtime_error("Can't map " + filename + ": " + strerror(e));
+    block = std::make_shared<mapped_block>(addr, length);
+  } else {
+    std::string contents(length, '\0');
+    uint64_t done = 0;
+    while (done < length) {
+      ssize_t r = pread(fd, &contents[done], length - done, done);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0) {
+	int e = r < 0 ? errno : EIO;
+	close(fd);
+	throw std::runtime_error("Can't read " + filename + ": " + strerror(e));
+      }
+      done += r;
+    }
+    close(fd);
+    block = std::make_shared<buffered_block>(std::move(contents));
+  }
+  return block;
+}
+
+//fsync everything written since the last sync, plus the directory so
+//that newly created files are durable too.
+void one_file_per_object_backing_store::sync(void)
+{
+  std::vector<int> fds;
+  {
+    std::unique_lock<std::mutex> lock(unsynced_mutex);
+    fds.swap(unsynced);
+  }
+  if (fds.empty())
+    return;
+  for (size_t i = 0; i < fds.size(); i++) {
+    fsync(fds[i]);
+    close(fds[i]);
+  }
+  int dirfd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  assert(dirfd >= 0);
+  fsync(dirfd);
+  close(dirfd);
+}
+
+
+void one_file_per_object_backing_store::written(uint64_t obj_id, uint64_t version,
+						int fd)
+{
+  if (!write_behind) {
+    close(fd);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(unsynced_mutex);
+  allocated.erase(std::make_pair(obj_id, version));
+  unsynced.push_back(fd);
+}
 
 //Given an object and version, return the filename corresponding to it.
 std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uint64_t version){
@@ -62,3 +246,1455 @@ std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uin
   return root + "/" + std::to_string(obj_id) + "_" + std::to_string(version);
 
 }
+
+
+//////////////////////////////////////////////////////
+// Implementation of the async_file_backing_store //
+//////////////////////////////////////////////////////
+
+// A read or write of a whole file, followed for writes by an fsync
+// if sync is set.
+class async_file_backing_store::operation {
+public:
+  uint64_t tag;
+  uint64_t obj_id;
+  uint64_t version;
+  bool write;
+  bool sync;
+  int fd;
+  std::string buffer;
+  // Bytes transferred so far, and whether the fsync is what's left.
+  uint64_t done = 0;
+  bool syncing = false;
+  struct iovec iov;
+
+  // Account for a transfer of res bytes (or an fsync) having
+  // finished.  Returns whether the whole operation has.
+  bool advance(int64_t res) {
+    assert(res >= 0);
+    if (syncing)
+      return true;
+    done += res;
+    if (done < buffer.size()) {
+      // Reading past the end of the file would return 0 forever.
+      assert(res > 0);
+      return false;
+    }
+    syncing = write && sync;
+    return !syncing;
+  }
+};
+
+class async_file_backing_store::io_engine {
+public:
+  virtual ~io_engine(void) {}
+  // Queue op, to be started by the next reap() if not sooner.
+  virtual void start(operation *op) = 0;
+  // Start queued operations and move finished ones to done, waiting
+  // for at least min to finish if that many are outstanding.
+  virtual void reap(std::vector<operation *> &done, size_t min) = 0;
+};
+
+// io_uring without liburing: the submission and completion rings are
+// mapped from the kernel, operations are queued by filling in
+// entries and bumping the submission tail, and io_uring_enter()
+// submits them and waits for completions.
+class uring_engine : public async_file_backing_store::io_engine {
+public:
+  typedef async_file_backing_store::operation operation;
+
+  // Returns NULL if the kernel doesn't support io_uring.
+  static uring_engine * create(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+      return NULL;
+    uring_engine *e = new uring_engine(fd, params);
+    if (!e->mapped) {
+      delete e;
+      return NULL;
+    }
+    return e;
+  }
+
+  ~uring_engine(void) {
+    assert(in_flight == 0);
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+      munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+  }
+
+  void start(operation *op) {
+    pending.push_back(op);
+  }
+
+  void reap(std::vector<operation *> &done, size_t min) {
+    size_t found = 0;
+    while (true) {
+      fill();
+      bool wait = found < min && in_flight > 0;
+      if (unsubmitted > 0 || wait)
+	enter(wait);
+      found += harvest(done);
+      if (found >= min && unsubmitted == 0 &&
+	  (pending.empty() || in_flight == entries))
+	return;
+      if (in_flight == 0 && pending.empty())
+	return;
+    }
+  }
+
+private:
+  uring_engine(int fd, const struct io_uring_params &params)
+    : ring_fd(fd),
+      entries(params.sq_entries)
+  {
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring :
+      mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe *)
+      mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    mapped = sq_ring != MAP_FAILED && cq_ring != MAP_FAILED && sqes != MAP_FAILED;
+    if (!mapped)
+      return;
+
+    char *sq = (char *)sq_ring;
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    char *cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  }
+
+  // Move pending operations into free submission entries.
+  void fill(void) {
+    unsigned tail = *sq_tail;
+    while (!pending.empty() && in_flight < entries) {
+      operation *op = pending.front();
+      pending.pop_front();
+      unsigned i = tail & sq_mask;
+      struct io_uring_sqe *sqe = &sqes[i];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->fd = op->fd;
+      sqe->user_data = (uint64_t)(uintptr_t)op;
+      if (op->syncing) {
+	sqe->opcode = IORING_OP_FSYNC;
+      } else {
+	op->iov.iov_base = &op->buffer[0] + op->done;
+	op->iov.iov_len = op->buffer.size() - op->done;
+	sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+	sqe->len = 1;
+	sqe->off = op->done;
+      }
+      sq_array[i] = i;
+      tail++;
+      in_flight++;
+      unsubmitted++;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  }
+
+  // Submit what fill() queued and, if wait is set, wait for a
+  // completion.
+  void enter(bool wait) {
+    while (true) {
+      int r = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, wait ? 1 : 0,
+		      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (r >= 0) {
+	unsubmitted -= r;
+	if (unsubmitted == 0 || !wait)
+	  return;
+	// Partly submitted; go again for the rest.
+	continue;
+      }
+      assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+      if (errno != EINTR)
+	return;
+    }
+  }
+
+  // Requeue operations that have more to do.  Returns the number of
+  // finished ones added to done.
+  size_t harvest(std::vector<operation *> &done) {
+    size_t found = 0;
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+      operation *op = (operation *)(uintptr_t)cqe->user_data;
+      int64_t res = cqe->res;
+      head++;
+      in_flight--;
+      if (op->advance(res)) {
+	done.push_back(op);
+	found++;
+      } else {
+	pending.push_back(op);
+      }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return found;
+  }
+
+  int ring_fd;
+  unsigned entries;
+  bool mapped = false;
+  void *sq_ring = MAP_FAILED;
+  void *cq_ring = MAP_FAILED;
+  struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // Operations in the rings, and those not yet handed to the kernel.
+  unsigned in_flight = 0;
+  unsigned unsubmitted = 0;
+  std::deque<operation *> pending;
+};
+
+// Blocking I/O in a pool of threads.
+class thread_pool_engine : public async_file_backing_store::io_engine {
+public:
+  typedef async_file_backing_store::operation operation;
+
+  thread_pool_engine(uint64_t nthreads) {
+    for (uint64_t i = 0; i < nthreads; i++)
+      threads.push_back(std::thread(&thread_pool_engine::worker_main, this));
+  }
+
+  ~thread_pool_engine(void) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stop = true;
+    }
+    queued.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+  }
+
+  void start(operation *op) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(op);
+    outstanding++;
+    queued.notify_one();
+  }
+
+  void reap(std::vector<operation *> &done, size_t min) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (completed.size() < std::min<size_t>(min, outstanding))
+      finished.wait(lock);
+    done.insert(done.end(), completed.begin(), completed.end());
+    outstanding -= completed.size();
+    completed.clear();
+  }
+
+private:
+  void worker_main(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      while (queue.empty() && !stop)
+	queued.wait(lock);
+      if (queue.empty())
+	return;
+      operation *op = queue.front();
+      queue.pop_front();
+      lock.unlock();
+
+      while (true) {
+	ssize_t r;
+	if (op->syncing)
+	  r = fsync(op->fd);
+	else if (op->write)
+	  r = pwrite(op->fd, &op->buffer[0] + op->done,
+		     op->buffer.size() - op->done, op->done);
+	else
+	  r = pread(op->fd, &op->buffer[0] + op->done,
+		    op->buffer.size() - op->done, op->done);
+	if (op->advance(r))
+	  break;
+      }
+
+      lock.lock();
+      completed.push_back(op);
+      finished.notify_all();
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable finished;
+  std::deque<operation *> queue;
+  std::vector<operation *> completed;
+  // Started and not yet reaped.
+  size_t outstanding = 0;
+  bool stop = false;
+};
+
+async_file_backing_store::async_file_backing_store(std::string rt,
+						   bool writebehind,
+						   uint64_t depth,
+						   bool use_io_uring)
+  : one_file_per_object_backing_store(rt, writebehind)
+{
+  assert(depth > 0);
+  if (use_io_uring)
+    io.reset(uring_engine::create(depth));
+  engine_kind = io ? IO_URING : THREAD_POOL;
+  if (!io)
+    io.reset(new thread_pool_engine(depth));
+}
+
+async_file_backing_store::~async_file_backing_store(void)
+{}
+
+void async_file_backing_store::submit_read(uint64_t tag, uint64_t obj_id,
+					   uint64_t version)
+{
+  operation *op = new operation;
+  op->tag = tag;
+  op->obj_id = obj_id;
+  op->version = version;
+  op->write = false;
+  op->sync = false;
+  std::string filename = get_filename(obj_id, version);
+  op->fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (op->fd < 0 || fstat(op->fd, &st) != 0) {
+    int e = errno;
+    if (op->fd >= 0)
+      close(op->fd);
+    delete op;
+    throw std::runtime_error("Can't open " + filename + ": " + strerror(e));
+  }
+  op->buffer.resize(st.st_size);
+  io->start(op);
+}
+
+//the version's file was created by allocate().
+void async_file_backing_store::submit_write(uint64_t tag, uint64_t obj_id,
+					    uint64_t version, std::string contents)
+{
+  operation *op = new operation;
+  op->tag = tag;
+  op->obj_id = obj_id;
+  op->version = version;
+  op->write = true;
+  op->sync = !is_write_behind();
+  op->fd = open(get_filename(obj_id, version).c_str(), O_WRONLY);
+  assert(op->fd >= 0);
+  op->buffer = std::move(contents);
+  io->start(op);
+}
+
+void async_file_backing_store::poll(std::vector<io_completion> &done, size_t min)
+{
+  std::vector<operation *> finished;
+  io->reap(finished, min);
+  for (size_t i = 0; i < finished.size(); i++) {
+    operation *op = finished[i];
+    io_completion c;
+    c.tag = op->tag;
+    if (op->write) {
+      written(op->obj_id, op->version, op->fd);
+    } else {
+      close(op->fd);
+      c.block = std::make_shared<buffered_block>(std::move(op->buffer));
+    }
+    done.push_back(c);
+    delete op;
+  }
+}
+
+///////////////////////////////////////////////////////
+// Implementation of the direct_file_backing_store //
+///////////////////////////////////////////////////////
+
+#define DIRECT_FILE_MAGIC "\xbe\xd1\x0d\x1e"
+#define DIRECT_FILE_HEADER_SIZE 16
+
+// Aligned buffers, in power-of-two sizes, kept for reuse.
+class direct_file_backing_store::buffer_pool {
+public:
+  buffer_pool(size_t align, uint64_t maxbytes)
+    : alignment(align),
+      max_bytes(maxbytes)
+  {}
+
+  ~buffer_pool(void) {
+    for (auto it = free_buffers.begin(); it != free_buffers.end(); ++it)
+      for (size_t i = 0; i < it->second.size(); i++)
+	free(it->second[i]);
+  }
+
+  // A buffer of at least n bytes.  Sets capacity to its size.
+  char * get(size_t n, size_t &capacity) {
+    capacity = alignment;
+    while (capacity < n)
+      capacity *= 2;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      std::vector<char *> &v = free_buffers[capacity];
+      if (!v.empty()) {
+	char *p = v.back();
+	v.pop_back();
+	cached_bytes -= capacity;
+	return p;
+      }
+    }
+    void *p;
+    if (posix_memalign(&p, alignment, capacity) != 0)
+      throw std::bad_alloc();
+    return (char *)p;
+  }
+
+  void put(char *p, size_t capacity) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (cached_bytes + capacity > max_bytes) {
+      free(p);
+      return;
+    }
+    free_buffers[capacity].push_back(p);
+    cached_bytes += capacity;
+  }
+
+private:
+  size_t alignment;
+  uint64_t max_bytes;
+  std::mutex mutex;
+  std::map<size_t, std::vector<char *> > free_buffers;
+  uint64_t cached_bytes = 0;
+};
+
+// The contents of a file read into a pooled buffer, which goes back
+// to the pool with the block.
+class pooled_block : public stored_block {
+public:
+  pooled_block(std::shared_ptr<direct_file_backing_store::buffer_pool> p,
+	       char *buf, size_t cap, size_t offset, size_t len)
+    : pool(p),
+      buffer(buf),
+      capacity(cap)
+  {
+    bytes = buf + offset;
+    length = len;
+  }
+  ~pooled_block(void) {
+    pool->put(buffer, capacity);
+  }
+
+private:
+  std::shared_ptr<direct_file_backing_store::buffer_pool> pool;
+  char *buffer;
+  size_t capacity;
+};
+
+//check whether the file system takes O_DIRECT by trying it on a
+//scratch file.
+direct_file_backing_store::direct_file_backing_store(std::string rt,
+						     bool writebehind,
+						     size_t blocksize,
+						     uint64_t pool_bytes)
+  : one_file_per_object_backing_store(rt, writebehind),
+    block_size(blocksize),
+    pool(std::make_shared<buffer_pool>(blocksize, pool_bytes))
+{
+  assert(block_size > 0 && (block_size & (block_size - 1)) == 0);
+  std::string probe = rt + "/direct_probe";
+  int fd = open(probe.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_DIRECT, 0644);
+  direct = fd >= 0;
+  if (fd < 0)
+    fd = open(probe.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  check_syscall(fd >= 0, "Can't create " + probe);
+  close(fd);
+  unlink(probe.c_str());
+}
+
+int direct_file_backing_store::open_file(uint64_t obj_id, uint64_t version,
+					 int flags)
+{
+  std::string filename = get_filename(obj_id, version);
+  int fd = open(filename.c_str(), flags | (direct ? O_DIRECT : 0));
+  check_syscall(fd >= 0, "Can't open " + filename);
+  return fd;
+}
+
+//a stream to fill in if the version has only been allocated (and so
+//is still empty), or holding its contents otherwise.
+std::iostream * direct_file_backing_store::get(uint64_t obj_id, uint64_t version)
+{
+  std::string filename = get_filename(obj_id, version);
+  struct stat st;
+  check_syscall(stat(filename.c_str(), &st) == 0, "Can't stat " + filename);
+  if (st.st_size == 0)
+    return new object_stream(obj_id, version, true, std::string());
+  std::shared_ptr<stored_block> block = read(obj_id, version);
+  return new object_stream(obj_id, version, false,
+			   std::string(block->data(), block->size()));
+}
+
+//write a freshly allocated version out through an aligned buffer.
+void direct_file_backing_store::put(std::iostream *ios)
+{
+  object_stream *os = (object_stream *)ios;
+  if (!os->writing) {
+    delete os;
+    return;
+  }
+  std::string contents = os->str();
+  size_t padded = DIRECT_FILE_HEADER_SIZE + contents.size();
+  padded = (padded + block_size - 1) & ~(block_size - 1);
+
+  size_t capacity;
+  char *buf = pool->get(padded, capacity);
+  memset(buf, 0, DIRECT_FILE_HEADER_SIZE);
+  memcpy(buf, DIRECT_FILE_MAGIC, 4);
+  uint64_t length = contents.size();
+  for (int i = 0; i < 8; i++)
+    buf[8 + i] = (char)((length >> (8 * i)) & 0xff);
+  memcpy(buf + DIRECT_FILE_HEADER_SIZE, contents.data(), contents.size());
+  memset(buf + DIRECT_FILE_HEADER_SIZE + contents.size(), 0,
+	 padded - DIRECT_FILE_HEADER_SIZE - contents.size());
+
+  int fd;
+  try {
+    fd = open_file(os->obj_id, os->version, O_WRONLY);
+  } catch (...) {
+    pool->put(buf, capacity);
+    delete os;
+    throw;
+  }
+  size_t done = 0;
+  bool ok = true;
+  while (ok && done < padded) {
+    ssize_t r = pwrite(fd, buf + done, padded - done, done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    ok = r > 0;
+    if (ok)
+      done += r;
+  }
+  if (ok && !is_write_behind())
+    ok = fsync(fd) == 0;
+  int e = errno;
+  pool->put(buf, capacity);
+  if (!ok) {
+    std::string filename = get_filename(os->obj_id, os->version);
+    close(fd);
+    delete os;
+    throw std::runtime_error("Can't write " + filename + ": " + strerror(e));
+  }
+  if (!direct)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  written(os->obj_id, os->version, fd);
+  delete os;
+}
+
+std::shared_ptr<stored_block>
+direct_file_backing_store::read(uint64_t obj_id, uint64_t version)
+{
+  int fd = open_file(obj_id, version, O_RDONLY);
+  std::string filename = get_filename(obj_id, version);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int e = errno;
+    close(fd);
+    throw std::runtime_error("Can't stat " + filename + ": " + strerror(e));
+  }
+  size_t size = st.st_size;
+  assert(size >= DIRECT_FILE_HEADER_SIZE && size % block_size == 0);
+
+  size_t capacity;
+  char *buf = pool->get(size, capacity);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t r = pread(fd, buf + done, size - done, done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      int e = r < 0 ? errno : EIO;
+      pool->put(buf, capacity);
+      close(fd);
+      throw std::runtime_error("Can't read " + filename + ": " + strerror(e));
+    }
+    done += r;
+  }
+  if (!direct)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  uint64_t length = 0;
+  for (int i = 0; i < 8; i++)
+    length |= (uint64_t)(unsigned char)buf[8 + i] << (8 * i);
+  assert(memcmp(buf, DIRECT_FILE_MAGIC, 4) == 0);
+  assert(length <= size - DIRECT_FILE_HEADER_SIZE);
+  return std::make_shared<pooled_block>(pool, buf, capacity,
+					DIRECT_FILE_HEADER_SIZE, length);
+}
+
+//////////////////////////////////////////////////////////
+// Implementation of the log_structured_backing_store //
+//////////////////////////////////////////////////////////
+
+// The index journal is a sequence of text records, one per line:
+//   + obj_id version segment offset length
+//   - obj_id version
+//   a segment
+// giving the new location of a version, a dead version, and the
+// active segment.  Replaying them in order rebuilds the index.
+
+log_structured_backing_store::log_structured_backing_store(std::string rt,
+							   bool writebehind,
+							   uint64_t segmentsize,
+							   double cleanthreshold)
+  : root(rt),
+    write_behind(writebehind),
+    segment_size(segmentsize),
+    clean_threshold(cleanthreshold),
+    mutex(),
+    index(),
+    pending(),
+    segments(),
+    active_segment(0),
+    dirty_segments(),
+    directory_dirty(false),
+    index_fd(-1),
+    index_records(0),
+    unwritten_records(),
+    cleaner_wakeup(),
+    stop_cleaner(false),
+    cleaner()
+{
+  load_index();
+  cleaner = std::thread(&log_structured_backing_store::cleaner_main, this);
+}
+
+log_structured_backing_store::~log_structured_backing_store(void)
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop_cleaner = true;
+  }
+  cleaner_wakeup.notify_all();
+  cleaner.join();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  sync_locked();
+  for (auto it = segments.begin(); it != segments.end(); ++it)
+    close(it->second.fd);
+  close(index_fd);
+}
+
+std::string log_structured_backing_store::segment_filename(uint64_t seg)
+{
+  return root + "/segment_" + std::to_string(seg);
+}
+
+std::string log_structured_backing_store::index_filename(void)
+{
+  return root + "/index";
+}
+
+void log_structured_backing_store::open_segment(uint64_t seg, bool truncate)
+{
+  std::string filename = segment_filename(seg);
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+  check_syscall(fd >= 0, "Can't open " + filename);
+  struct stat st;
+  check_syscall(fstat(fd, &st) == 0, "Can't stat " + filename);
+  segment s = { fd, (uint64_t)st.st_size, 0 };
+  segments[seg] = s;
+}
+
+void log_structured_backing_store::load_index(void)
+{
+  std::ifstream in(index_filename());
+  std::string op;
+  while (in >> op) {
+    uint64_t obj_id, version, seg;
+    extent e;
+    if (op == "+") {
+      in >> obj_id >> version >> e.segment >> e.offset >> e.length;
+      index[std::make_pair(obj_id, version)] = e;
+    } else if (op == "-") {
+      in >> obj_id >> version;
+      index.erase(std::make_pair(obj_id, version));
+    } else if (op == "a") {
+      in >> seg;
+      active_segment = seg;
+    } else {
+      assert(0);
+    }
+  }
+
+  open_segment(active_segment, false);
+  for (auto it = index.begin(); it != index.end(); ++it) {
+    if (segments.count(it->second.segment) == 0)
+      open_segment(it->second.segment, false);
+    segments[it->second.segment].live += it->second.length;
+  }
+
+  // Segments that nothing refers to were being cleaned or had just
+  // been started when the store was last shut down.
+  DIR *dir = opendir(root.c_str());
+  assert(dir != NULL);
+  while (struct dirent *de = readdir(dir)) {
+    std::string name = de->d_name;
+    if (name.compare(0, 8, "segment_") == 0 &&
+	segments.count(strtoull(name.c_str() + 8, NULL, 10)) == 0)
+      unlink((root + "/" + name).c_str());
+  }
+  closedir(dir);
+
+  // Start the journal over with just the live entries.
+  rewrite_index();
+}
+
+// Replace the journal with a compact one describing the current
+// index.  The segments must already be durable.
+void log_structured_backing_store::rewrite_index(void)
+{
+  std::string tmpname = index_filename() + ".tmp";
+  std::ofstream out(tmpname, std::ofstream::trunc);
+  out << "a " << active_segment << "\n";
+  for (auto it = index.begin(); it != index.end(); ++it)
+    out << "+ " << it->first.first << " " << it->first.second << " "
+	<< it->second.segment << " " << it->second.offset << " "
+	<< it->second.length << "\n";
+  out.close();
+  if (!out.good())
+    throw std::runtime_error("Can't write " + tmpname);
+
+  int fd = open(tmpname.c_str(), O_RDWR | O_APPEND);
+  check_syscall(fd >= 0, "Can't open " + tmpname);
+  check_syscall(fsync(fd) == 0, "Can't fsync " + tmpname);
+  check_syscall(rename(tmpname.c_str(), index_filename().c_str()) == 0,
+		"Can't rename " + tmpname);
+  int dirfd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  check_syscall(dirfd >= 0, "Can't open " + root);
+  int r = fsync(dirfd);
+  close(dirfd);
+  check_syscall(r == 0, "Can't fsync " + root);
+
+  if (index_fd >= 0)
+    close(index_fd);
+  index_fd = fd;
+  index_records = index.size() + 1;
+  unwritten_records.clear();
+}
+
+// Append contents to the active segment, starting a new one if the
+// active segment is full.
+log_structured_backing_store::extent
+log_structured_backing_store::append(const std::string &contents)
+{
+  segment *s = &segments[active_segment];
+  if (s->size > 0 && s->size + contents.size() > segment_size) {
+    uint64_t sealed = active_segment;
+    active_segment = segments.rbegin()->first + 1;
+    open_segment(active_segment, true);
+    directory_dirty = true;
+    unwritten_records += "a " + std::to_string(active_segment) + "\n";
+    index_records++;
+    s = &segments[active_segment];
+    if (needs_cleaning(sealed))
+      cleaner_wakeup.notify_one();
+  }
+
+  extent e = { active_segment, s->size, contents.size() };
+  uint64_t done = 0;
+  while (done < contents.size()) {
+    ssize_t r = pwrite(s->fd, contents.data() + done, contents.size() - done,
+		       e.offset + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    check_syscall(r > 0, "Can't write " + segment_filename(active_segment));
+    done += r;
+  }
+  s->size += e.length;
+  s->live += e.length;
+  dirty_segments.insert(active_segment);
+  return e;
+}
+
+// The contents of an extent.  Called with the mutex, which keeps
+// the cleaner from deleting its segment.
+std::string log_structured_backing_store::read_extent(const extent &e)
+{
+  std::string contents(e.length, '\0');
+  uint64_t done = 0;
+  while (done < contents.size()) {
+    ssize_t r = pread(segments[e.segment].fd, &contents[done],
+		      contents.size() - done, e.offset + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r == 0)
+      throw std::runtime_error("Short read from " + segment_filename(e.segment));
+    check_syscall(r > 0, "Can't read " + segment_filename(e.segment));
+    done += r;
+  }
+  return contents;
+}
+
+// Account for an extent that no longer holds a live version.
+void log_structured_backing_store::kill(const extent &e)
+{
+  segments[e.segment].live -= e.length;
+  if (needs_cleaning(e.segment))
+    cleaner_wakeup.notify_one();
+}
+
+bool log_structured_backing_store::needs_cleaning(uint64_t seg)
+{
+  const segment &s = segments[seg];
+  return seg != active_segment && s.live < clean_threshold * s.size;
+}
+
+// Move the live extents of seg to the active segment and delete it.
+void log_structured_backing_store::clean_segment(uint64_t seg)
+{
+  for (auto it = index.begin(); it != index.end(); ++it) {
+    if (it->second.segment != seg)
+      continue;
+    std::string contents = read_extent(it->second);
+    segments[seg].live -= it->second.length;
+    it->second = append(contents);
+    unwritten_records += "+ " + std::to_string(it->first.first) + " "
+      + std::to_string(it->first.second) + " "
+      + std::to_string(it->second.segment) + " "
+      + std::to_string(it->second.offset) + " "
+      + std::to_string(it->second.length) + "\n";
+    index_records++;
+  }
+  assert(segments[seg].live == 0);
+
+  // The durable index must not refer to seg by the time it's gone.
+  sync_locked();
+  close(segments[seg].fd);
+  dirty_segments.erase(seg);
+  segments.erase(seg);
+  check_syscall(unlink(segment_filename(seg).c_str()) == 0,
+		"Can't remove " + segment_filename(seg));
+}
+
+void log_structured_backing_store::cleaner_main(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stop_cleaner) {
+    uint64_t victim = 0;
+    bool found = false;
+    for (auto it = segments.begin(); it != segments.end(); ++it) {
+      if (needs_cleaning(it->first) &&
+	  (!found || it->second.live < segments[victim].live)) {
+	victim = it->first;
+	found = true;
+      }
+    }
+    if (found)
+      clean_segment(victim);
+    else
+      cleaner_wakeup.wait(lock);
+  }
+}
+
+void log_structured_backing_store::clean(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  std::vector<uint64_t> victims;
+  for (auto it = segments.begin(); it != segments.end(); ++it)
+    if (needs_cleaning(it->first))
+      victims.push_back(it->first);
+  for (size_t i = 0; i < victims.size(); i++)
+    clean_segment(victims[i]);
+}
+
+void log_structured_backing_store::allocate(uint64_t obj_id, uint64_t version)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  object_version ov(obj_id, version);
+  assert(index.count(ov) == 0);
+  pending.insert(ov);
+}
+
+void log_structured_backing_store::deallocate(uint64_t obj_id, uint64_t version)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  object_version ov(obj_id, version);
+  if (pending.erase(ov))
+    return;
+  auto it = index.find(ov);
+  assert(it != index.end());
+  extent e = it->second;
+  index.erase(it);
+  unwritten_records += "- " + std::to_string(obj_id) + " "
+    + std::to_string(version) + "\n";
+  index_records++;
+  kill(e);
+}
+
+//return a stream holding the version's contents, or an empty one to
+//be filled in if the version has only been allocated.
+std::iostream * log_structured_backing_store::get(uint64_t obj_id, uint64_t version)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  object_version ov(obj_id, version);
+  if (pending.count(ov))
+    return new object_stream(obj_id, version, std::string());
+
+  auto it = index.find(ov);
+  assert(it != index.end());
+  return new object_stream(obj_id, version, read_extent(it->second));
+}
+
+//the version's contents, read straight into the block rather than
+//into a stream.
+std::shared_ptr<stored_block>
+log_structured_backing_store::read(uint64_t obj_id, uint64_t version)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = index.find(object_version(obj_id, version));
+  assert(it != index.end());
+  return std::make_shared<buffered_block>(read_extent(it->second));
+}
+
+//append the contents of a freshly allocated version to the log.
+//Streams of versions that were already written were only read, so
+//there is nothing to put.
+void log_structured_backing_store::put(std::iostream *ios)
+{
+  object_stream *os = (object_stream *)ios;
+  std::unique_lock<std::mutex> lock(mutex);
+  object_version ov(os->obj_id, os->version);
+  if (pending.erase(ov)) {
+    extent e = append(os->str());
+    index[ov] = e;
+    unwritten_records += "+ " + std::to_string(ov.first) + " "
+      + std::to_string(ov.second) + " "
+      + std::to_string(e.segment) + " "
+      + std::to_string(e.offset) + " "
+      + std::to_string(e.length) + "\n";
+    index_records++;
+    if (!write_behind)
+      sync_locked();
+  }
+  delete os;
+}
+
+void log_structured_backing_store::sync(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  sync_locked();
+}
+
+//fsync the segments written since the last sync, then make the
+//index records describing them durable.
+void log_structured_backing_store::sync_locked(void)
+{
+  for (auto it = dirty_segments.begin(); it != dirty_segments.end(); ++it)
+    check_syscall(fsync(segments[*it].fd) == 0,
+		  "Can't fsync " + segment_filename(*it));
+  dirty_segments.clear();
+  if (directory_dirty) {
+    int dirfd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    check_syscall(dirfd >= 0, "Can't open " + root);
+    int r = fsync(dirfd);
+    close(dirfd);
+    check_syscall(r == 0, "Can't fsync " + root);
+    directory_dirty = false;
+  }
+
+  if (index_records > 2 * index.size() + 1024) {
+    rewrite_index();
+    return;
+  }
+  if (unwritten_records.empty())
+    return;
+  uint64_t done = 0;
+  while (done < unwritten_records.size()) {
+    ssize_t r = write(index_fd, unwritten_records.data() + done,
+		      unwritten_records.size() - done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    check_syscall(r > 0, "Can't write " + index_filename());
+    done += r;
+  }
+  check_syscall(fsync(index_fd) == 0, "Can't fsync " + index_filename());
+  unwritten_records.clear();
+}
+
+uint64_t log_structured_backing_store::live_bytes(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  uint64_t total = 0;
+  for (auto it = segments.begin(); it != segments.end(); ++it)
+    total += it->second.live;
+  return total;
+}
+
+uint64_t log_structured_backing_store::total_bytes(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  uint64_t total = 0;
+  for (auto it = segments.begin(); it != segments.end(); ++it)
+    total += it->second.size;
+  return total;
+}
+
+uint64_t log_structured_backing_store::segment_count(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return segments.size();
+}
+
+/////////////////////////////////////////////////////////
+// Implementation of the shared_memory_backing_store //
+/////////////////////////////////////////////////////////
+
+namespace bip = boost::interprocess;
+
+// What the stores sharing a segment share: the index, and the mutex
+// protecting it and the blobs' headers.
+class shared_memory_backing_store::shared_state {
+public:
+  typedef bip::managed_shared_memory::segment_manager segment_manager;
+  typedef bip::managed_shared_memory::handle_t handle;
+  typedef std::pair<uint64_t, uint64_t> object_version;
+
+  // Each blob starts with a header.  A deallocated blob is freed
+  // once no block refers to it.
+  class blob_header {
+  public:
+    uint64_t length;
+    uint64_t refs;
+    bool dead;
+  };
+
+  class entry {
+  public:
+    handle blob;
+    // Allocated versions have no blob until they're put().
+    bool written;
+  };
+
+  typedef bip::allocator<std::pair<const object_version, entry>,
+			 segment_manager> index_allocator;
+  typedef bip::map<object_version, entry, std::less<object_version>,
+		   index_allocator> index_map;
+
+  shared_state(segment_manager *sm)
+    : index(std::less<object_version>(), index_allocator(sm))
+  {}
+
+  bip::interprocess_mutex mutex;
+  index_map index;
+  // Start of the next range reserve_object_ids() hands out.
+  uint64_t next_id_range = 1;
+};
+
+typedef bip::scoped_lock<bip::interprocess_mutex> shared_lock;
+
+// A version's blob, read in place.
+class shared_memory_backing_store::shared_block : public stored_block {
+public:
+  shared_block(std::shared_ptr<bip::managed_shared_memory> seg,
+	       shared_state *st, shared_state::blob_header *h)
+    : segment(seg),
+      state(st),
+      header(h)
+  {
+    bytes = (const char *)(header + 1);
+    length = header->length;
+  }
+
+  ~shared_block(void) {
+    shared_lock lock(state->mutex);
+    if (--header->refs == 0 && header->dead)
+      segment->deallocate(header);
+  }
+
+private:
+  std::shared_ptr<bip::managed_shared_memory> segment;
+  shared_state *state;
+  shared_state::blob_header *header;
+};
+
+shared_memory_backing_store::shared_memory_backing_store(std::string name,
+							 uint64_t size)
+{
+  if (size == 0)
+    segment = std::make_shared<bip::managed_shared_memory>(bip::open_only, name.c_str());
+  else
+    segment = std::make_shared<bip::managed_shared_memory>(bip::open_or_create,
+							   name.c_str(), size);
+  state = segment->find_or_construct<shared_state>("betree_backing_store")
+    (segment->get_segment_manager());
+}
+
+shared_memory_backing_store::~shared_memory_backing_store(void)
+{}
+
+void shared_memory_backing_store::remove(std::string name)
+{
+  bip::shared_memory_object::remove(name.c_str());
+}
+
+uint64_t shared_memory_backing_store::free_bytes(void)
+{
+  return segment->get_free_memory();
+}
+
+uint64_t shared_memory_backing_store::reserve_object_ids(void)
+{
+  shared_lock lock(state->mutex);
+  uint64_t first = state->next_id_range;
+  state->next_id_range += OBJECT_ID_RANGE;
+  return first;
+}
+
+//free a written version's blob, or leave that to its last reader.
+//Called with the state's mutex held.
+static void release_blob(bip::managed_shared_memory &segment,
+			 shared_memory_backing_store::shared_state::entry &e)
+{
+  typedef shared_memory_backing_store::shared_state::blob_header blob_header;
+  if (!e.written)
+    return;
+  blob_header *h = (blob_header *)segment.get_address_from_handle(e.blob);
+  h->dead = true;
+  if (h->refs == 0)
+    segment.deallocate(h);
+  e.written = false;
+}
+
+//allocating a version that exists empties it, as O_TRUNC does for
+//the file stores.
+void shared_memory_backing_store::allocate(uint64_t obj_id, uint64_t version)
+{
+  shared_state::entry e;
+  e.blob = 0;
+  e.written = false;
+  shared_lock lock(state->mutex);
+  auto result = state->index.insert(std::make_pair(std::make_pair(obj_id, version), e));
+  if (!result.second)
+    release_blob(*segment, result.first->second);
+}
+
+void shared_memory_backing_store::deallocate(uint64_t obj_id, uint64_t version)
+{
+  shared_lock lock(state->mutex);
+  auto it = state->index.find(std::make_pair(obj_id, version));
+  assert(it != state->index.end());
+  release_blob(*segment, it->second);
+  state->index.erase(it);
+}
+
+//return a stream holding the version's contents, or an empty one to
+//be filled in if the version has only been allocated.
+std::iostream * shared_memory_backing_store::get(uint64_t obj_id, uint64_t version)
+{
+  shared_lock lock(state->mutex);
+  auto it = state->index.find(std::make_pair(obj_id, version));
+  assert(it != state->index.end());
+  if (!it->second.written)
+    return new object_stream(obj_id, version, true, std::string());
+  shared_state::blob_header *h =
+    (shared_state::blob_header *)segment->get_address_from_handle(it->second.blob);
+  return new object_stream(obj_id, version, false,
+			   std::string((const char *)(h + 1), h->length));
+}
+
+//copy a freshly allocated version into a blob of its own.
+void shared_memory_backing_store::put(std::iostream *ios)
+{
+  object_stream *os = (object_stream *)ios;
+  if (!os->writing) {
+    delete os;
+    return;
+  }
+  std::string contents = os->str();
+  shared_state::blob_header *h = (shared_state::blob_header *)
+    segment->allocate(sizeof(shared_state::blob_header) + contents.size(), std::nothrow);
+  if (h == NULL) {
+    delete os;
+    throw std::bad_alloc();
+  }
+  h->length = contents.size();
+  h->refs = 0;
+  h->dead = false;
+  memcpy(h + 1, contents.data(), contents.size());
+
+  shared_lock lock(state->mutex);
+  auto it = state->index.find(std::make_pair(os->obj_id, os->version));
+  assert(it != state->index.end() && !it->second.written);
+  it->second.blob = segment->get_handle_from_address(h);
+  it->second.written = true;
+  delete os;
+}
+
+std::shared_ptr<stored_block>
+shared_memory_backing_store::read(uint64_t obj_id, uint64_t version)
+{
+  shared_lock lock(state->mutex);
+  auto it = state->index.find(std::make_pair(obj_id, version));
+  assert(it != state->index.end() && it->second.written);
+  shared_state::blob_header *h =
+    (shared_state::blob_header *)segment->get_address_from_handle(it->second.blob);
+  h->refs++;
+  return std::make_shared<shared_block>(segment, state, h);
+}
+
+/////////////////////////////////////////////////////////////
+// Implementation of the write_ahead_log                   //
+/////////////////////////////////////////////////////////////
+
+//CRC-32 (the zlib/Ethernet one), table-driven.
+static uint32_t crc32(const char *data, size_t n)
+{
+  static const std::vector<uint32_t> table = [] {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+	c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  uint32_t c = 0xffffffff;
+  for (size_t i = 0; i < n; i++)
+    c = table[(c ^ (unsigned char)data[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffff;
+}
+
+static void put_le32(std::string &s, uint32_t x)
+{
+  for (int i = 0; i < 4; i++)
+    s.push_back((char)((x >> (8 * i)) & 0xff));
+}
+
+static uint32_t get_le32(const char *p)
+{
+  uint32_t x = 0;
+  for (int i = 0; i < 4; i++)
+    x |= ((uint32_t)(unsigned char)p[i]) << (8 * i);
+  return x;
+}
+
+static void write_all(int fd, const char *data, size_t n,
+		      const std::string &filename)
+{
+  size_t done = 0;
+  while (done < n) {
+    ssize_t r = write(fd, data + done, n - done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    check_syscall(r > 0, "Can't write " + filename);
+    done += r;
+  }
+}
+
+static void fsync_directory_of(const std::string &filename)
+{
+  size_t slash = filename.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash);
+  int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  check_syscall(dirfd >= 0, "Can't open " + dir);
+  int r = fsync(dirfd);
+  close(dirfd);
+  check_syscall(r == 0, "Can't fsync " + dir);
+}
+
+write_ahead_log::write_ahead_log(std::string fname)
+  : filename(fname),
+    group_size(1),
+    unwritten_records(0),
+    syncing(false),
+    failed(false)
+{
+  fd = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  check_syscall(fd >= 0, "Can't open " + filename);
+  struct stat st;
+  check_syscall(fstat(fd, &st) == 0, "Can't stat " + filename);
+  appended_lsn = durable_lsn = st.st_size;
+}
+
+write_ahead_log::~write_ahead_log(void)
+{
+  if (!failed)
+    sync();
+  close(fd);
+}
+
+uint64_t write_ahead_log::replay(std::function<void(const std::string &)> f)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  assert(unwritten.empty());
+  std::string contents;
+  read_file(filename, contents);
+
+  uint64_t offset = 0;
+  uint64_t nrecords = 0;
+  while (offset + 8 <= contents.size()) {
+    uint32_t length = get_le32(&contents[offset]);
+    uint32_t crc = get_le32(&contents[offset + 4]);
+    if (offset + 8 + length > contents.size() ||
+	crc32(&contents[offset + 8], length) != crc)
+      break;
+    f(contents.substr(offset + 8, length));
+    offset += 8 + length;
+    nrecords++;
+  }
+
+  if (offset < contents.size()) {
+    check_syscall(ftruncate(fd, offset) == 0, "Can't truncate " + filename);
+    check_syscall(fdatasync(fd) == 0, "Can't fsync " + filename);
+  }
+  appended_lsn = durable_lsn = offset;
+  return nrecords;
+}
+
+uint64_t write_ahead_log::append(const std::string &record)
+{
+  std::string header;
+  put_le32(header, record.size());
+  put_le32(header, crc32(record.data(), record.size()));
+  std::unique_lock<std::mutex> lock(mutex);
+  unwritten += header;
+  unwritten += record;
+  unwritten_records++;
+  appended_lsn += header.size() + record.size();
+  return appended_lsn;
+}
+
+void write_ahead_log::set_group_size(uint64_t n)
+{
+  assert(n > 0);
+  std::unique_lock<std::mutex> lock(mutex);
+  group_size = n;
+}
+
+void write_ahead_log::commit(uint64_t lsn)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (durable_lsn < lsn) {
+    if (failed) {
+      throw std::runtime_error("Can't commit to " + filename +
+			       ": an earlier write or sync failed");
+    } else if (syncing) {
+      synced.wait(lock);
+    } else if (unwritten_records < group_size) {
+      return;
+    } else {
+      sync_locked(lock);
+    }
+  }
+}
+
+void write_ahead_log::sync(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (durable_lsn < appended_lsn) {
+    if (failed)
+      throw std::runtime_error("Can't sync " + filename +
+			       ": an earlier write or sync failed");
+    if (syncing)
+      synced.wait(lock);
+    else
+      sync_locked(lock);
+  }
+}
+
+//write and sync everything appended so far, without the lock, so
+//that others can append meanwhile.  If either fails, the records
+//may or may not have reached the disk, and retrying the sync can't
+//tell us, so the log is marked failed for good.
+void write_ahead_log::sync_locked(std::unique_lock<std::mutex> &lock)
+{
+  syncing = true;
+  std::string data;
+  data.swap(unwritten);
+  unwritten_records = 0;
+  uint64_t lsn = appended_lsn;
+  lock.unlock();
+
+  try {
+    write_all(fd, data.data(), data.size(), filename);
+    check_syscall(fdatasync(fd) == 0, "Can't fsync " + filename);
+  } catch (...) {
+    lock.lock();
+    failed = true;
+    syncing = false;
+    synced.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  durable_lsn = lsn;
+  syncing = false;
+  synced.notify_all();
+}
+
+uint64_t write_ahead_log::size(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return appended_lsn;
+}
+
+void replace_file_durably(const std::string &filename, const std::string &contents)
+{
+  std::string tmpname = filename + ".tmp";
+  int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  check_syscall(fd >= 0, "Can't open " + tmpname);
+  int r;
+  try {
+    write_all(fd, contents.data(), contents.size(), tmpname);
+    r = fsync(fd);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  check_syscall(r == 0, "Can't fsync " + tmpname);
+  check_syscall(rename(tmpname.c_str(), filename.c_str()) == 0,
+		"Can't rename " + tmpname);
+  fsync_directory_of(filename);
+}
+
+bool read_file(const std::string &filename, std::string &contents)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  contents.clear();
+  char buf[1 << 16];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0)
+    contents.append(buf, r);
+  assert(r == 0);
+  close(fd);
+  return true;
+}
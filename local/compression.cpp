@@ -0,0 +1,550 @@
+#include "include/compression.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+// Sequence format, shared by both codecs.  Each sequence is
+//
+//   token      literal count (high nibble) and match length - 4 (low
+//              nibble), 15 meaning "15 plus the following bytes, up
+//              to and including the first one that isn't 255"
+//   literals
+//   offset     varint, how far back the match starts
+//
+// and the last one stops after its literals.
+#define MIN_MATCH 4
+
+#define FAST_HASH_BITS 14
+#define FAST_WINDOW ((1ULL << 16) - 1)
+
+#define HIGH_HASH_BITS 16
+#define HIGH_WINDOW (1ULL << 20)
+#define HIGH_CHAIN_DEPTH 64
+
+// The Huffman pass of HIGH_COMPRESSION.  Code lengths are limited so
+// that a single table lookup decodes a symbol.
+#define HUFFMAN_MAX_CODE_LENGTH 12
+#define HIGH_STORED 0
+#define HIGH_HUFFMAN 1
+
+static void corrupt(void)
+{
+  throw std::runtime_error("Corrupt compressed block");
+}
+
+static void put_varint(std::string &out, uint64_t x)
+{
+  while (x >= 0x80) {
+    out.push_back((char)(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back((char)x);
+}
+
+static uint64_t get_varint(const unsigned char *&p, const unsigned char *end)
+{
+  uint64_t x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (p == end)
+      corrupt();
+    uint8_t b = *p++;
+    x |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return x;
+  }
+  corrupt();
+  return 0;
+}
+
+static void put_length(std::string &out, size_t n)
+{
+  while (n >= 255) {
+    out.push_back((char)255);
+    n -= 255;
+  }
+  out.push_back((char)n);
+}
+
+static size_t get_length(const unsigned char *&p, const unsigned char *end)
+{
+  size_t n = 0;
+  while (true) {
+    if (p == end)
+      corrupt();
+    uint8_t b = *p++;
+    n += b;
+    if (b != 255)
+      return n;
+  }
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t x;
+  memcpy(&x, p, 4);
+  return x;
+}
+
+static uint32_t hash4(const unsigned char *p, int bits)
+{
+  return (read32(p) * 2654435761u) >> (32 - bits);
+}
+
+// How far the bytes at a and b agree, up to end (b's end).
+static size_t match_length(const unsigned char *a, const unsigned char *b,
+			   const unsigned char *end)
+{
+  const unsigned char *start = b;
+  while (end - b >= 8) {
+    uint64_t x, y;
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x != y)
+      return b - start + (__builtin_ctzll(x ^ y) >> 3);
+    a += 8;
+    b += 8;
+  }
+  while (b < end && *a == *b) {
+    a++;
+    b++;
+  }
+  return b - start;
+}
+
+// Literals [lit, lit + nlit), then a match of mlen bytes starting
+// offset bytes back, or nothing if mlen is 0.
+static void put_sequence(std::string &out, const unsigned char *lit, size_t nlit,
+			 size_t offset, size_t mlen)
+{
+  size_t ml = mlen ? mlen - MIN_MATCH : 0;
+  out.push_back((char)((std::min<size_t>(nlit, 15) << 4) | std::min<size_t>(ml, 15)));
+  if (nlit >= 15)
+    put_length(out, nlit - 15);
+  out.append((const char *)lit, nlit);
+  if (mlen == 0)
+    return;
+  put_varint(out, offset);
+  if (ml >= 15)
+    put_length(out, ml - 15);
+}
+
+static std::string lz_fast(const std::string &in)
+{
+  std::string out;
+  out.reserve(in.size() / 2 + 16);
+  const unsigned char *base = (const unsigned char *)in.data();
+  const unsigned char *end = base + in.size();
+  const unsigned char *ip = base;
+  const unsigned char *anchor = base;
+  // Positions plus one, so that 0 is empty.
+  std::vector<uint32_t> table(1 << FAST_HASH_BITS, 0);
+
+  while (end - ip > MIN_MATCH) {
+    uint32_t h = hash4(ip, FAST_HASH_BITS);
+    uint32_t candidate = table[h];
+    table[h] = ip - base + 1;
+    if (candidate) {
+      const unsigned char *ref = base + candidate - 1;
+      if ((uint64_t)(ip - ref) <= FAST_WINDOW && read32(ref) == read32(ip)) {
+	size_t len = MIN_MATCH + match_length(ref + MIN_MATCH, ip + MIN_MATCH, end);
+	while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+	  ip--;
+	  ref--;
+	  len++;
+	}
+	put_sequence(out, anchor, ip - anchor, ip - ref, len);
+	ip += len;
+	anchor = ip;
+	if (end - ip > MIN_MATCH)
+	  table[hash4(ip - 2, FAST_HASH_BITS)] = ip - 2 - base + 1;
+	continue;
+      }
+    }
+    // Speed up through data that doesn't compress.
+    size_t step = 1 + ((ip - anchor) >> 6);
+    if ((size_t)(end - ip) <= step + MIN_MATCH)
+      break;
+    ip += step;
+  }
+  put_sequence(out, anchor, end - anchor, 0, 0);
+  return out;
+}
+
+static std::string lz_high(const std::string &in)
+{
+  std::string out;
+  out.reserve(in.size() / 2 + 16);
+  const unsigned char *base = (const unsigned char *)in.data();
+  const unsigned char *end = base + in.size();
+  size_t size = in.size();
+  // Positions plus one, so that 0 is the end of a chain.
+  std::vector<uint32_t> head(1 << HIGH_HASH_BITS, 0);
+  std::vector<uint32_t> prev(size, 0);
+  size_t inserted = 0;
+
+  // Add every position before pos to the chains.
+  auto insert_upto = [&](size_t pos) {
+    for (; inserted < pos; inserted++) {
+      uint32_t h = hash4(base + inserted, HIGH_HASH_BITS);
+      prev[inserted] = head[h];
+      head[h] = inserted + 1;
+    }
+  };
+
+  auto longest_match = [&](size_t pos, size_t &offset) {
+    insert_upto(pos);
+    size_t best = 0;
+    uint32_t candidate = head[hash4(base + pos, HIGH_HASH_BITS)];
+    for (int depth = 0; candidate && depth < HIGH_CHAIN_DEPTH; depth++) {
+      size_t cpos = candidate - 1;
+      if (pos - cpos > HIGH_WINDOW)
+	break;
+      const unsigned char *ref = base + cpos;
+      if ((pos + best >= size || ref[best] == base[pos + best]) &&
+	  read32(ref) == read32(base + pos)) {
+	size_t len = MIN_MATCH + match_length(ref + MIN_MATCH, base + pos + MIN_MATCH, end);
+	if (len > best) {
+	  best = len;
+	  offset = pos - cpos;
+	  if (pos + len == size)
+	    break;
+	}
+      }
+      candidate = prev[cpos];
+    }
+    return best;
+  };
+
+  size_t pos = 0;
+  size_t anchor = 0;
+  while (size - pos > MIN_MATCH) {
+    size_t offset;
+    size_t len = longest_match(pos, offset);
+    if (len < MIN_MATCH) {
+      pos++;
+      continue;
+    }
+    // Take a longer match starting at the next byte instead, if
+    // there is one.
+    while (size - (pos + 1) > MIN_MATCH) {
+      size_t next_offset;
+      size_t next_len = longest_match(pos + 1, next_offset);
+      if (next_len <= len)
+	break;
+      pos++;
+      len = next_len;
+      offset = next_offset;
+    }
+    put_sequence(out, base + anchor, pos - anchor, offset, len);
+    pos += len;
+    anchor = pos;
+    insert_upto(std::min(pos, size - MIN_MATCH));
+  }
+  put_sequence(out, base + anchor, size - anchor, 0, 0);
+  return out;
+}
+
+static void lz_decode(const unsigned char *p, const unsigned char *end,
+		      std::string &out)
+{
+  unsigned char *obase = (unsigned char *)&out[0];
+  unsigned char *op = obase;
+  unsigned char *oend = obase + out.size();
+  while (true) {
+    if (p == end)
+      corrupt();
+    unsigned token = *p++;
+    size_t nlit = token >> 4;
+    if (nlit == 15)
+      nlit += get_length(p, end);
+    if (nlit > (size_t)(end - p) || nlit > (size_t)(oend - op))
+      corrupt();
+    memcpy(op, p, nlit);
+    op += nlit;
+    p += nlit;
+    if (p == end)
+      break;
+    uint64_t offset = get_varint(p, end);
+    size_t mlen = token & 15;
+    if (mlen == 15)
+      mlen += get_length(p, end);
+    mlen += MIN_MATCH;
+    if (offset == 0 || offset > (uint64_t)(op - obase) || mlen > (size_t)(oend - op))
+      corrupt();
+    const unsigned char *ref = op - offset;
+    if (offset >= mlen) {
+      memcpy(op, ref, mlen);
+      op += mlen;
+    } else {
+      // Overlapping: a run.
+      for (size_t i = 0; i < mlen; i++)
+	*op++ = *ref++;
+    }
+  }
+  if (op != oend)
+    corrupt();
+}
+
+// Huffman code lengths for freq, limited to HUFFMAN_MAX_CODE_LENGTH
+// by flattening the frequencies until they fit.
+static void huffman_lengths(const uint64_t *freq, uint8_t *len)
+{
+  std::vector<uint64_t> f(freq, freq + 256);
+  std::vector<int> symbols;
+  for (int s = 0; s < 256; s++)
+    if (f[s])
+      symbols.push_back(s);
+  memset(len, 0, 256);
+  if (symbols.size() == 1) {
+    len[symbols[0]] = 1;
+    return;
+  }
+
+  while (true) {
+    typedef std::pair<uint64_t, int> entry;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > queue;
+    std::vector<uint64_t> weight;
+    std::vector<int> parent;
+    for (size_t i = 0; i < symbols.size(); i++) {
+      weight.push_back(f[symbols[i]]);
+      parent.push_back(-1);
+      queue.push(entry(weight[i], i));
+    }
+    while (queue.size() > 1) {
+      entry a = queue.top();
+      queue.pop();
+      entry b = queue.top();
+      queue.pop();
+      int n = weight.size();
+      weight.push_back(a.first + b.first);
+      parent.push_back(-1);
+      parent[a.second] = n;
+      parent[b.second] = n;
+      queue.push(entry(weight[n], n));
+    }
+
+    int max_length = 0;
+    for (size_t i = 0; i < symbols.size(); i++) {
+      int depth = 0;
+      for (int j = i; parent[j] != -1; j = parent[j])
+	depth++;
+      len[symbols[i]] = depth;
+      max_length = std::max(max_length, depth);
+    }
+    if (max_length <= HUFFMAN_MAX_CODE_LENGTH)
+      return;
+    for (size_t i = 0; i < symbols.size(); i++)
+      f[symbols[i]] = (f[symbols[i]] + 1) / 2;
+  }
+}
+
+// Canonical codes for len, bit-reversed since the bit stream is
+// least significant bit first.  Returns false if len isn't a prefix
+// code.
+static bool huffman_codes(const uint8_t *len, uint32_t *code)
+{
+  std::vector<int> order;
+  for (int s = 0; s < 256; s++)
+    if (len[s])
+      order.push_back(s);
+  std::stable_sort(order.begin(), order.end(),
+		   [len](int a, int b) { return len[a] < len[b]; });
+  uint32_t next = 0;
+  int length = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    int s = order[i];
+    next <<= len[s] - length;
+    length = len[s];
+    if (next >= (1u << length))
+      return false;
+    uint32_t r = 0;
+    for (int b = 0; b < length; b++)
+      if (next & (1u << b))
+	r |= 1u << (length - 1 - b);
+    code[s] = r;
+    next++;
+  }
+  return true;
+}
+
+static std::string huffman_encode(const std::string &in)
+{
+  uint64_t freq[256] = {0};
+  for (size_t i = 0; i < in.size(); i++)
+    freq[(unsigned char)in[i]]++;
+  uint8_t len[256];
+  uint32_t code[256];
+  huffman_lengths(freq, len);
+  huffman_codes(len, code);
+
+  std::string out;
+  out.reserve(128 + 10 + in.size());
+  for (int s = 0; s < 256; s += 2)
+    out.push_back((char)(len[s] | (len[s + 1] << 4)));
+  put_varint(out, in.size());
+  uint64_t bits = 0;
+  int nbits = 0;
+  for (size_t i = 0; i < in.size(); i++) {
+    unsigned char s = in[i];
+    bits |= (uint64_t)code[s] << nbits;
+    nbits += len[s];
+    while (nbits >= 8) {
+      out.push_back((char)(bits & 0xff));
+      bits >>= 8;
+      nbits -= 8;
+    }
+  }
+  if (nbits > 0)
+    out.push_back((char)bits);
+  return out;
+}
+
+static std::string huffman_decode(const unsigned char *p, const unsigned char *end,
+				  uint64_t max_size)
+{
+  if (end - p < 128)
+    corrupt();
+  uint8_t len[256];
+  for (int s = 0; s < 256; s += 2) {
+    len[s] = *p & 15;
+    len[s + 1] = *p >> 4;
+    p++;
+  }
+  uint32_t code[256];
+  if (!huffman_codes(len, code))
+    corrupt();
+  // Low byte: symbol.  High byte: code length, 0 for no code.
+  std::vector<uint16_t> table(1 << HUFFMAN_MAX_CODE_LENGTH, 0);
+  for (int s = 0; s < 256; s++) {
+    if (len[s] == 0)
+      continue;
+    if (len[s] > HUFFMAN_MAX_CODE_LENGTH)
+      corrupt();
+    for (uint32_t k = code[s]; k < table.size(); k += 1u << len[s])
+      table[k] = s | (len[s] << 8);
+  }
+
+  uint64_t size = get_varint(p, end);
+  // Every symbol takes at least a bit.
+  if (size > 8 * (uint64_t)(end - p) || size > max_size)
+    corrupt();
+  std::string out(size, '\0');
+  uint64_t bits = 0;
+  int nbits = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    while (nbits <= 56 && p < end) {
+      bits |= (uint64_t)*p++ << nbits;
+      nbits += 8;
+    }
+    uint16_t e = table[bits & ((1 << HUFFMAN_MAX_CODE_LENGTH) - 1)];
+    int l = e >> 8;
+    if (l == 0 || l > nbits)
+      corrupt();
+    out[i] = (char)(e & 0xff);
+    bits >>= l;
+    nbits -= l;
+  }
+  return out;
+}
+
+static std::string high_compress(const std::string &in)
+{
+  std::string lz = lz_high(in);
+  std::string huffman = huffman_encode(lz);
+  std::string out;
+  if (huffman.size() < lz.size()) {
+    out.push_back((char)HIGH_HUFFMAN);
+    out += huffman;
+  } else {
+    out.push_back((char)HIGH_STORED);
+    out += lz;
+  }
+  return out;
+}
+
+std::string compress_block(compression_codec codec, const std::string &in)
+{
+  std::string payload;
+  switch (codec) {
+  case NO_COMPRESSION:
+    return in;
+  case FAST_COMPRESSION:
+    payload = lz_fast(in);
+    break;
+  case HIGH_COMPRESSION:
+    // Chain links are 32 bits.
+    if (in.size() >= (1ULL << 32))
+      return in;
+    payload = high_compress(in);
+    break;
+  default:
+    throw std::invalid_argument("Unknown compression codec");
+  }
+  if (payload.size() + COMPRESSED_BLOCK_HEADER_SIZE >= in.size())
+    return in;
+
+  std::string out;
+  out.reserve(COMPRESSED_BLOCK_HEADER_SIZE + payload.size());
+  out.append(COMPRESSED_BLOCK_MAGIC, COMPRESSED_BLOCK_MAGIC_SIZE);
+  out.push_back((char)codec);
+  uint64_t size = in.size();
+  for (int i = 0; i < 8; i++)
+    out.push_back((char)((size >> (8 * i)) & 0xff));
+  out += payload;
+  return out;
+}
+
+bool is_compressed_block(const char *p, size_t n)
+{
+  return n >= COMPRESSED_BLOCK_MAGIC_SIZE &&
+    memcmp(p, COMPRESSED_BLOCK_MAGIC, COMPRESSED_BLOCK_MAGIC_SIZE) == 0;
+}
+
+std::string decompress_block(const std::string &in)
+{
+  return decompress_block(in.data(), in.size());
+}
+
+std::string decompress_block(const char *in, size_t n)
+{
+  if (n < COMPRESSED_BLOCK_HEADER_SIZE || !is_compressed_block(in, n))
+    corrupt();
+  const unsigned char *p = (const unsigned char *)in + COMPRESSED_BLOCK_MAGIC_SIZE;
+  const unsigned char *end = (const unsigned char *)in + n;
+  compression_codec codec = (compression_codec)*p++;
+  uint64_t size = 0;
+  for (int i = 0; i < 8; i++)
+    size |= (uint64_t)*p++ << (8 * i);
+  // No sequence byte stands for more than 255 output bytes.
+  if (size > 255 * (uint64_t)(end - p) * 8 + MIN_MATCH)
+    corrupt();
+
+  std::string out(size, '\0');
+  switch (codec) {
+  case FAST_COMPRESSION:
+    lz_decode(p, end, out);
+    break;
+  case HIGH_COMPRESSION:
+    {
+      if (p == end)
+	corrupt();
+      uint8_t mode = *p++;
+      if (mode == HIGH_STORED) {
+	lz_decode(p, end, out);
+      } else if (mode == HIGH_HUFFMAN) {
+	std::string lz = huffman_decode(p, end, 8 * (uint64_t)(end - p));
+	lz_decode((const unsigned char *)lz.data(),
+		  (const unsigned char *)lz.data() + lz.size(), out);
+      } else {
+	corrupt();
+      }
+    }
+    break;
+  default:
+    corrupt();
+  }
+  return out;
+}
@@ -0,0 +1,301 @@
+#include "include/replacement_policy.hpp"
+#include <algorithm>
+#include <cassert>
+
+////////////////////////////////
+// cache_list                 //
+////////////////////////////////
+
+void cache_list::push_back(cache_entry *e)
+{
+  assert(e->cache_owner == NULL);
+  e->cache_prev = tail;
+  e->cache_next = NULL;
+  if (tail)
+    tail->cache_next = e;
+  else
+    head = e;
+  tail = e;
+  e->cache_owner = this;
+  n++;
+}
+
+void cache_list::remove(cache_entry *e)
+{
+  assert(e->cache_owner == this);
+  if (e->cache_prev)
+    e->cache_prev->cache_next = e->cache_next;
+  else
+    head = e->cache_next;
+  if (e->cache_next)
+    e->cache_next->cache_prev = e->cache_prev;
+  else
+    tail = e->cache_prev;
+  e->cache_prev = e->cache_next = NULL;
+  e->cache_owner = NULL;
+  n--;
+}
+
+cache_entry * cache_list::pop_front(void)
+{
+  cache_entry *e = head;
+  if (e)
+    remove(e);
+  return e;
+}
+
+//pinned entries aren't on any list.
+void replacement_policy::hold(cache_entry *e)
+{
+  if (e->cache_owner)
+    e->cache_owner->remove(e);
+}
+
+//append up to n entries of l, front first.
+void replacement_policy::coldest_in(const cache_list &l, uint64_t n,
+				    std::vector<cache_entry *> &out)
+{
+  for (cache_entry *e = l.front(); e != NULL && n > 0; e = e->cache_next, n--)
+    out.push_back(e);
+}
+
+////////////////////////////////
+// lru_policy                 //
+////////////////////////////////
+
+void lru_policy::set_capacity(uint64_t)
+{}
+
+void lru_policy::admit(cache_entry *)
+{}
+
+//recency is taken at release time, so there's nothing to do here.
+void lru_policy::touch(cache_entry *)
+{}
+
+void lru_policy::release(cache_entry *e)
+{
+  lru.push_back(e);
+}
+
+cache_entry * lru_policy::victim(void)
+{
+  return lru.front();
+}
+
+void lru_policy::coldest(uint64_t n, std::vector<cache_entry *> &out)
+{
+  coldest_in(lru, n, out);
+}
+
+void lru_policy::evict(cache_entry *e)
+{
+  lru.remove(e);
+}
+
+void lru_policy::forget(cache_entry *e)
+{
+  if (e->cache_owner)
+    e->cache_owner->remove(e);
+}
+
+////////////////////////////////
+// two_q_policy               //
+////////////////////////////////
+
+void two_q_policy::set_capacity(uint64_t c)
+{
+  in_capacity = std::max<uint64_t>(c / 4, 1);
+  out_capacity = std::max<uint64_t>(c / 2, 1);
+  while (a1out.size() > out_capacity)
+    a1out.pop_front()->cache_queue = NONE;
+}
+
+cache_list & two_q_policy::list_for(cache_entry *e)
+{
+  return e->cache_queue == AM ? am : a1in;
+}
+
+void two_q_policy::admit(cache_entry *e)
+{
+  if (e->cache_queue == A1OUT) {
+    a1out.remove(e);
+    e->cache_queue = AM;
+  } else {
+    assert(e->cache_queue == NONE);
+    e->cache_queue = A1IN;
+  }
+  resident[e->cache_queue]++;
+}
+
+//hits in A1in don't count as evidence that the entry is hot, and
+//Am's recency is taken at release time.
+void two_q_policy::touch(cache_entry *)
+{}
+
+void two_q_policy::release(cache_entry *e)
+{
+  list_for(e).push_back(e);
+}
+
+cache_entry * two_q_policy::victim(void)
+{
+  if ((resident[A1IN] > in_capacity && !a1in.empty()) || am.empty())
+    return a1in.front();
+  return am.front();
+}
+
+void two_q_policy::coldest(uint64_t n, std::vector<cache_entry *> &out)
+{
+  size_t start = out.size();
+  bool a1in_first = resident[A1IN] > in_capacity || am.empty();
+  coldest_in(a1in_first ? a1in : am, n, out);
+  coldest_in(a1in_first ? am : a1in, n - (out.size() - start), out);
+}
+
+void two_q_policy::evict(cache_entry *e)
+{
+  list_for(e).remove(e);
+  resident[e->cache_queue]--;
+  if (e->cache_queue == A1IN) {
+    e->cache_queue = A1OUT;
+    a1out.push_back(e);
+    while (a1out.size() > out_capacity)
+      a1out.pop_front()->cache_queue = NONE;
+  } else {
+    e->cache_queue = NONE;
+  }
+}
+
+void two_q_policy::forget(cache_entry *e)
+{
+  if (e->cache_owner)
+    e->cache_owner->remove(e);
+  if (e->cache_queue == A1IN || e->cache_queue == AM)
+    resident[e->cache_queue]--;
+  e->cache_queue = NONE;
+}
+
+////////////////////////////////
+// arc_policy                 //
+////////////////////////////////
+
+void arc_policy::set_capacity(uint64_t c)
+{
+  capacity = std::max<uint64_t>(c, 1);
+  p = std::min(p, capacity);
+  trim_ghosts();
+}
+
+cache_list & arc_policy::list_for(cache_entry *e)
+{
+  switch (e->cache_queue) {
+  case T1: return t1;
+  case B1: return b1;
+  case T2: return t2;
+  default:
+    assert(e->cache_queue == B2);
+    return b2;
+  }
+}
+
+//keep |T1| + |B1| <= c and the whole directory <= 2c.
+void arc_policy::trim_ghosts(void)
+{
+  while (resident[T1] + b1.size() > capacity && !b1.empty())
+    b1.pop_front()->cache_queue = NONE;
+  while (resident[T1] + resident[T2] + b1.size() + b2.size() > 2 * capacity &&
+	 !b2.empty())
+    b2.pop_front()->cache_queue = NONE;
+}
+
+void arc_policy::admit(cache_entry *e)
+{
+  last_admit_from_b2 = false;
+  if (e->cache_queue == B1) {
+    uint64_t delta = std::max<uint64_t>(b2.size() / b1.size(), 1);
+    p = std::min(p + delta, capacity);
+    b1.remove(e);
+    e->cache_queue = T2;
+  } else if (e->cache_queue == B2) {
+    uint64_t delta = std::max<uint64_t>(b1.size() / b2.size(), 1);
+    p = p > delta ? p - delta : 0;
+    b2.remove(e);
+    e->cache_queue = T2;
+    last_admit_from_b2 = true;
+  } else {
+    assert(e->cache_queue == NONE);
+    e->cache_queue = T1;
+  }
+  resident[e->cache_queue]++;
+  trim_ghosts();
+}
+
+//a second reference moves an entry from T1 to T2.  Entries are
+//pinned when touched, so this doesn't have to relink anything.
+void arc_policy::touch(cache_entry *e)
+{
+  if (e->cache_queue == T1) {
+    assert(e->cache_owner == NULL);
+    resident[T1]--;
+    resident[T2]++;
+    e->cache_queue = T2;
+  }
+}
+
+void arc_policy::release(cache_entry *e)
+{
+  list_for(e).push_back(e);
+}
+
+// ARC's REPLACE: evict from T1 if it is over its target size,
+// otherwise from T2.  Fall back to the other list if every entry in
+// the chosen one is pinned.
+cache_entry * arc_policy::victim(void)
+{
+  bool from_t1 = resident[T1] > 0 &&
+    (resident[T1] > p || (last_admit_from_b2 && resident[T1] == p));
+  if (from_t1)
+    return t1.empty() ? t2.front() : t1.front();
+  return t2.empty() ? t1.front() : t2.front();
+}
+
+void arc_policy::coldest(uint64_t n, std::vector<cache_entry *> &out)
+{
+  size_t start = out.size();
+  bool t1_first = resident[T1] > 0 &&
+    (resident[T1] > p || (last_admit_from_b2 && resident[T1] == p));
+  coldest_in(t1_first ? t1 : t2, n, out);
+  coldest_in(t1_first ? t2 : t1, n - (out.size() - start), out);
+}
+
+void arc_policy::evict(cache_entry *e)
+{
+  list_for(e).remove(e);
+  resident[e->cache_queue]--;
+  e->cache_queue = e->cache_queue == T1 ? B1 : B2;
+  list_for(e).push_back(e);
+  trim_ghosts();
+}
+
+void arc_policy::forget(cache_entry *e)
+{
+  if (e->cache_owner)
+    e->cache_owner->remove(e);
+  if (e->cache_queue == T1 || e->cache_queue == T2)
+    resident[e->cache_queue]--;
+  e->cache_queue = NONE;
+}
+
+replacement_policy * make_replacement_policy(replacement_policy_kind kind)
+{
+  switch (kind) {
+  case TWO_Q_REPLACEMENT:
+    return new two_q_policy();
+  case ARC_REPLACEMENT:
+    return new arc_policy();
+  default:
+    assert(kind == LRU_REPLACEMENT);
+    return new lru_policy();
+  }
+}
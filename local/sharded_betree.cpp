@@ -0,0 +1,124 @@
+#include "include/sharded_betree.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+static sockaddr_un socket_address(const std::string &path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    throw std::invalid_argument("Socket path too long: " + path);
+  memcpy(addr.sun_path, path.data(), path.size());
+  return addr;
+}
+
+message_socket::message_socket(const std::string &path)
+{
+  sockaddr_un addr = socket_address(path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert(fd >= 0);
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    int e = errno;
+    close(fd);
+    throw std::runtime_error("Can't connect to " + path + ": " + strerror(e));
+  }
+}
+
+message_socket::message_socket(int fd) : fd(fd) {}
+
+message_socket::~message_socket(void)
+{
+  close(fd);
+}
+
+bool message_socket::send(const std::string &msg)
+{
+  std::string frame;
+  frame.reserve(8 + msg.size());
+  for (int i = 0; i < 8; i++)
+    frame.push_back((char)((msg.size() >> (8 * i)) & 0xff));
+  frame += msg;
+  size_t done = 0;
+  while (done < frame.size()) {
+    // MSG_NOSIGNAL: a peer that has gone away is an error, not SIGPIPE.
+    ssize_t r = ::send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    done += r;
+  }
+  return true;
+}
+
+static bool receive_all(int fd, char *data, size_t n)
+{
+  size_t done = 0;
+  while (done < n) {
+    ssize_t r = recv(fd, data + done, n - done, 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    done += r;
+  }
+  return true;
+}
+
+bool message_socket::receive(std::string &msg)
+{
+  char header[8];
+  if (!receive_all(fd, header, sizeof(header)))
+    return false;
+  uint64_t length = 0;
+  for (int i = 0; i < 8; i++)
+    length |= (uint64_t)(unsigned char)header[i] << (8 * i);
+  msg.resize(length);
+  return length == 0 || receive_all(fd, &msg[0], length);
+}
+
+void message_socket::shutdown(void)
+{
+  ::shutdown(fd, SHUT_RDWR);
+}
+
+message_listener::message_listener(const std::string &path) : path(path)
+{
+  sockaddr_un addr = socket_address(path);
+  unlink(path.c_str());
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert(fd >= 0);
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    int e = errno;
+    close(fd);
+    throw std::runtime_error("Can't listen at " + path + ": " + strerror(e));
+  }
+}
+
+message_listener::~message_listener(void)
+{
+  close(fd);
+  unlink(path.c_str());
+}
+
+message_socket *message_listener::accept(void)
+{
+  while (true) {
+    int conn = ::accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn >= 0)
+      return new message_socket(conn);
+    if (errno != EINTR && errno != ECONNABORTED)
+      return NULL;
+  }
+}
+
+//On Linux, shutting down a listening socket wakes up accept().
+void message_listener::shutdown(void)
+{
+  ::shutdown(fd, SHUT_RDWR);
+}
@@ -1,35 +1,104 @@
 #include "include/swap_space.hpp"
+#include <algorithm>
 
+serialization_context::serialization_context(swap_space &sspace) :
+  ss(sspace),
+  is_leaf(true),
+  format(sspace.get_serialization_format()),
+  in_background(false)
+{}
+
+//Fixed-width little-endian encoding used by the binary format.
+static void write_le(std::iostream &fs, uint64_t x, int nbytes)
+{
+  char buf[8];
+  for (int i = 0; i < nbytes; i++)
+    buf[i] = (char)((x >> (8 * i)) & 0xff);
+  fs.write(buf, nbytes);
+  assert(fs.good());
+}
+
+static uint64_t read_le(std::iostream &fs, int nbytes)
+{
+  unsigned char buf[8];
+  fs.read((char *)buf, nbytes);
+  assert(fs.good());
+  uint64_t x = 0;
+  for (int i = 0; i < nbytes; i++)
+    x |= ((uint64_t)buf[i]) << (8 * i);
+  return x;
+}
 
 //Methods to serialize/deserialize different kinds of objects.
 //You shouldn't need to touch these.
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x)
 {
+  if (context.format == BINARY_SERIALIZATION) {
+    write_le(fs, x, 8);
+    return;
+  }
   fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 {
+  if (context.format == BINARY_SERIALIZATION) {
+    x = read_le(fs, 8);
+    return;
+  }
   fs >> x;
   assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, int64_t x)
 {
+  if (context.format == BINARY_SERIALIZATION) {
+    write_le(fs, (uint64_t)x, 8);
+    return;
+  }
   fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x)
 {
+  if (context.format == BINARY_SERIALIZATION) {
+    x = (int64_t)read_le(fs, 8);
+    return;
+  }
   fs >> x;
   assert(fs.good());
 }
 
+void serialize(std::iostream &fs, serialization_context &context, uint8_t x)
+{
+  if (context.format == BINARY_SERIALIZATION) {
+    write_le(fs, x, 1);
+    return;
+  }
+  fs << (unsigned int)x << " ";
+  assert(fs.good());
+}
+
+void deserialize(std::iostream &fs, serialization_context &context, uint8_t &x)
+{
+  if (context.format == BINARY_SERIALIZATION) {
+    x = (uint8_t)read_le(fs, 1);
+    return;
+  }
+  unsigned int tmp;
+  fs >> tmp;
+  assert(fs.good());
+  x = (uint8_t)tmp;
+}
+
 void serialize(std::iostream &fs, serialization_context &context, std::string x)
 {
-  fs << x.size() << ",";
+  if (context.format == BINARY_SERIALIZATION)
+    write_le(fs, x.size(), 8);
+  else
+    fs << x.size() << ",";
   assert(fs.good());
   fs.write(x.data(), x.size());
   assert(fs.good());
@@ -38,27 +107,130 @@ void serialize(std::iostream &fs, serialization_context &context, std::string x)
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
 {
   size_t length;
-  char comma;
-  fs >> length >> comma;
+  if (context.format == BINARY_SERIALIZATION) {
+    length = read_le(fs, 8);
+  } else {
+    char comma;
+    fs >> length >> comma;
+  }
   assert(fs.good());
-  char *buf = new char[length];
-  assert(buf);
-  fs.read(buf, length);
+  x.resize(length);
+  fs.read(&x[0], length);
   assert(fs.good());
-  x = std::string(buf, length);
-  delete buf;
 }
 
-bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b) {
-  return a->last_access < b->last_access;
+thread_local bool swap_space::detaching = false;
+
+swap_space::object * swap_space::object_table::find(uint64_t id) {
+  shard &sh = shard_for(id);
+  std::unique_lock<std::mutex> lock(sh.mutex, std::defer_lock);
+  if (locking)
+    lock.lock();
+  auto it = sh.map.find(id);
+  return it == sh.map.end() ? NULL : it->second;
+}
+
+void swap_space::object_table::insert(swap_space::object *obj) {
+  shard &sh = shard_for(obj->id);
+  std::unique_lock<std::mutex> lock(sh.mutex, std::defer_lock);
+  if (locking)
+    lock.lock();
+  [[maybe_unused]] bool inserted = sh.map.emplace(obj->id, obj).second;
+  assert(inserted);
 }
 
-swap_space::swap_space(backing_store *bs, uint64_t n) :
+void swap_space::object_table::erase(uint64_t id) {
+  shard &sh = shard_for(id);
+  std::unique_lock<std::mutex> lock(sh.mutex, std::defer_lock);
+  if (locking)
+    lock.lock();
+  sh.map.erase(id);
+}
+
+//hand an object that just came into memory to the policy for its
+//kind of node.
+void swap_space::cache_admit(swap_space::object *obj) {
+  replacement_policy *p = obj->is_leaf ? leaf_policy : internal_policy;
+  if (obj->policy && obj->policy != p)
+    obj->policy->forget(obj);
+  obj->policy = p;
+  p->admit(obj);
+}
+
+swap_space::swap_space(backing_store *bs, uint64_t n,
+		       serialization_format fmt) :
   backstore(bs),
+  format(fmt),
   max_in_memory_objects(n),
   objects(),
-  lru_pqueue(cmp_by_last_access)
-{}
+  leaf_policy(new lru_policy()),
+  internal_policy(leaf_policy)
+{
+  if (backstore)
+    next_id = backstore->reserve_object_ids();
+  leaf_policy->set_capacity(n);
+}
+
+swap_space::~swap_space(void) {
+  stop_background_writeback();
+  stop_prefetching();
+  stop_async_io();
+  objects.for_each([](object *obj) { obj->policy = NULL; });
+  // Anything left was abandon()ed.
+  detaching = true;
+  objects.for_each([](object *obj) {
+      delete obj->target.load();
+      delete obj;
+    });
+  detaching = false;
+  if (internal_policy != leaf_policy)
+    delete internal_policy;
+  delete leaf_policy;
+}
+
+void swap_space::set_thread_safe(bool ts) {
+  thread_safe = ts;
+  objects.locking = ts;
+}
+
+swap_space::cache_stats swap_space::get_cache_stats(void) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  cache_stats s = stats;
+  s.hits += hits;
+  return s;
+}
+
+void swap_space::reset_cache_stats(void) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  stats = cache_stats();
+  hits = 0;
+}
+
+void swap_space::set_replacement_policy(replacement_policy_kind kind,
+					bool favor_internal_nodes) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  objects.for_each([](object *obj) {
+      if (obj->policy)
+	obj->policy->forget(obj);
+      obj->policy = NULL;
+    });
+  if (internal_policy != leaf_policy)
+    delete internal_policy;
+  delete leaf_policy;
+
+  leaf_policy = make_replacement_policy(kind);
+  internal_policy = favor_internal_nodes ? make_replacement_policy(kind) : leaf_policy;
+  leaf_policy->set_capacity(max_in_memory_objects);
+  internal_policy->set_capacity(max_in_memory_objects);
+
+  objects.for_each([this](object *obj) {
+      if (obj->target) {
+	cache_admit(obj);
+	if (obj->pincount == 0)
+	  obj->policy->release(obj);
+      }
+    });
+}
 
 //construct a new object. Called by ss->allocate() via pointer<Referent> construction
 //Does not insert into objects table - that's handled by pointer<Referent>()
@@ -66,84 +238,615 @@ swap_space::object::object(swap_space *sspace, serializable * tgt) {
   target = tgt;
   id = sspace->next_id++;
   version = 0;
-  is_leaf = false;
+  // Unknown until the first write-back.  Most new objects are leaves,
+  // and the replacement policy is the only thing that looks at this
+  // before then.
+  is_leaf = true;
   refcount = 1;
-  last_access = sspace->next_access_time++;
   target_is_dirty = true;
   pincount = 0;
+  policy = NULL;
+  bytes = 0;
+  serialized_bytes = 0;
+  writeback_pending = false;
+  prefetch_pending = false;
+  prefetched = false;
+  loading = false;
+  checkpoint_version = 0;
 }
 
 //set # of items that can live in ss.
 void swap_space::set_cache_size(uint64_t sz) {
   assert(sz > 0);
+  std::unique_lock<std::mutex> lock = lock_cache();
   max_in_memory_objects = sz;
+  leaf_policy->set_capacity(sz);
+  internal_policy->set_capacity(sz);
+  maybe_evict_something();
+}
+
+void swap_space::set_cache_size_in_bytes(uint64_t bytes) {
+  assert(bytes > 0);
+  std::unique_lock<std::mutex> lock = lock_cache();
+  max_in_memory_bytes = bytes;
   maybe_evict_something();
 }
 
-//write an object that lives on disk back to disk
-//only triggers a write if the object is "dirty" (target_is_dirty == true)
+//bring the bytes charged for an in-memory object up to date.
+void swap_space::charge(swap_space::object *obj) {
+  uint64_t b = obj->target.load()->memory_footprint();
+  if (b == 0)
+    b = obj->serialized_bytes;
+  current_in_memory_bytes += b;
+  current_in_memory_bytes -= obj->bytes;
+  obj->bytes = b;
+  if (current_in_memory_bytes > peak_in_memory_bytes)
+    peak_in_memory_bytes = current_in_memory_bytes;
+}
+
+//an in-memory object is being pinned, i.e. is about to be used.  The
+//policy hears about uses here rather than on every access, so that
+//accesses to pinned objects don't need the cache lock.
+void swap_space::first_pin(swap_space::object *obj) {
+  obj->policy->hold(obj);
+  if (obj->prefetched) {
+    // Being admitted by the prefetch doesn't count as a use.
+    obj->prefetched = false;
+    stats.prefetch_hits++;
+  } else {
+    obj->policy->touch(obj);
+  }
+}
+
+void swap_space::set_compression(compression_codec codec) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  wait_for_writebacks(NULL);
+  compression = codec;
+}
+
+// A read-only stream buffer over bytes in memory, so that objects
+// can be deserialized from a stored_block in place.
+class block_streambuf : public std::streambuf {
+public:
+  block_streambuf(const char *p, size_t n) {
+    char *b = const_cast<char *>(p);
+    setg(b, b, b + n);
+  }
+  uint64_t consumed(void) const { return gptr() - eback(); }
+};
+
+static uint64_t deserialize_bytes(const char *p, size_t n,
+				  serialization_context &ctxt,
+				  serializable &target) {
+  block_streambuf buf(p, n);
+  std::iostream in(&buf);
+  in.exceptions(std::iostream::badbit | std::iostream::failbit);
+  deserialize(in, ctxt, target);
+  return buf.consumed();
+}
+
+//returns the object's serialized size, before any compression.
+uint64_t swap_space::read(uint64_t id, uint64_t version,
+			  std::shared_ptr<stored_block> &block,
+			  serializable *target, bool in_background) {
+  if (!block)
+    block = backstore->read(id, version);
+  serialization_context ctxt(*this);
+  ctxt.in_background = in_background;
+  if (!is_compressed_block(block->data(), block->size()))
+    return deserialize_bytes(block->data(), block->size(), ctxt, *target);
+  std::string raw = decompress_block(block->data(), block->size());
+  deserialize_bytes(raw.data(), raw.size(), ctxt, *target);
+  return raw.size();
+}
+
+//keep the image a leaf was just loaded from, if images are retained.
+void swap_space::retain_image(swap_space::object *obj,
+			      const std::shared_ptr<stored_block> &block) {
+  if (max_retained_images == 0 || !obj->is_leaf || obj->image)
+    return;
+  obj->image = block;
+  retained_images.push_back(std::make_pair(obj->id, obj->version));
+  trim_retained_images();
+}
+
+void swap_space::trim_retained_images(void) {
+  while (retained_images.size() > max_retained_images) {
+    object *obj = objects.find(retained_images.front().first);
+    if (obj && obj->version == retained_images.front().second)
+      obj->image.reset();
+    retained_images.pop_front();
+  }
+}
+
+void swap_space::set_retained_leaf_images(uint64_t n) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  max_retained_images = n;
+  trim_retained_images();
+}
+
+//write a dirty object back to disk.  The object's pointers are left
+//alone; the caller deletes it in detaching mode afterwards, which
+//hands their references over to the new on-disk version.
 void swap_space::write_back(swap_space::object *obj)
 {
-  assert(objects.count(obj->id) > 0);
+  assert(objects.find(obj->id) == obj);
+  assert(obj->target_is_dirty && !obj->writeback_pending);
 
-  debug(std::cout << "Writing back " << obj->id
-	<< " (" << obj->target << ") "
-	<< "with last access time " << obj->last_access << std::endl);
+  debug(std::cout << "Writing back " << obj->id << std::endl);
 
-  // This calls _serialize on all the pointers in this object,
-  // which keeps refcounts right later on when we delete them all.
-  // In the future, we may also use this to implement in-memory
-  // evictions, i.e. where we first "evict" an object by
-  // compressing it and keeping the compressed version in memory.
   serialization_context ctxt(*this);
   std::stringstream sstream;
-  serialize(sstream, ctxt, *obj->target);
+  serialize(sstream, ctxt, *obj->target.load());
   obj->is_leaf = ctxt.is_leaf;
 
-  if (obj->target_is_dirty) {
-    std::string buffer = sstream.str();
+  std::string buffer = sstream.str();
+  obj->serialized_bytes = buffer.length();
+  stats.bytes_serialized += buffer.length();
+  buffer = compress_block(compression, buffer);
+  stats.bytes_stored += buffer.length();
 
+  //modification - ss now controls BSID - split into unique id and version.
+  //version increments linearly based uniquely on this version counter.
 
-    //modification - ss now controls BSID - split into unique id and version.
-    //version increments linearly based uniquely on this version counter.
+  uint64_t new_version_id = obj->version+1;
 
-    uint64_t new_version_id = obj->version+1;
+  backstore->allocate(obj->id, new_version_id);
+  std::iostream *out = backstore->get(obj->id, new_version_id);
+  out->write(buffer.data(), buffer.length());
+  backstore->put(out);
 
-    backstore->allocate(obj->id, new_version_id);
-    std::iostream *out = backstore->get(obj->id, new_version_id);
-    out->write(buffer.data(), buffer.length());
+  obj->target_is_dirty = false;
+  version_written(obj, new_version_id);
+}
+
+//obj's contents are now stored as version.
+void swap_space::version_written(swap_space::object *obj, uint64_t version)
+{
+  //version 0 is the flag that the object exists only in memory.
+  //The old version has to stay around until the new one is durable.
+  if (obj->version > 0 && obj->version == obj->checkpoint_version)
+    checkpoint_deallocations.push_back(std::make_pair(obj->id, obj->version));
+  else if (obj->version > 0)
+    pending_deallocations.push_back(std::make_pair(obj->id, obj->version));
+  obj->version = version;
+  obj->image.reset();
+
+  if (++unsynced_writes >= write_group_size)
+    sync_and_free_old_versions();
+}
+
+void swap_space::set_write_group_size(uint64_t n) {
+  assert(n > 0);
+  std::unique_lock<std::mutex> lock = lock_cache();
+  write_group_size = n;
+  if (unsynced_writes >= write_group_size)
+    sync_and_free_old_versions();
+}
+
+void swap_space::checkpoint(void) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  wait_for_writebacks(NULL);
+  sync_and_free_old_versions();
+}
+
+void swap_space::write_checkpoint(std::iostream &out) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  wait_for_writebacks(NULL);
+  objects.for_each([this](object *obj) {
+      if (obj->target != NULL && obj->target_is_dirty)
+	write_back(obj);
+    });
+  sync_and_free_old_versions();
+
+  serialization_context ctxt(*this);
+  uint64_t count = 0;
+  objects.for_each([&count](object *) { count++; });
+  serialize(out, ctxt, next_id.load());
+  serialize(out, ctxt, count);
+  objects.for_each([&](object *obj) {
+      assert(obj->version > 0);
+      serialize(out, ctxt, obj->id);
+      serialize(out, ctxt, obj->version);
+      serialize(out, ctxt, (uint8_t)obj->is_leaf);
+      serialize(out, ctxt, obj->refcount.load());
+    });
+}
+
+void swap_space::commit_checkpoint(void) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  for (size_t i = 0; i < checkpoint_deallocations.size(); i++)
+    backstore->deallocate(checkpoint_deallocations[i].first,
+			  checkpoint_deallocations[i].second);
+  checkpoint_deallocations.clear();
+  objects.for_each([](object *obj) { obj->checkpoint_version = obj->version; });
+}
+
+void swap_space::read_checkpoint(std::iostream &in) {
+  std::unique_lock<std::mutex> lock = lock_cache();
+  serialization_context ctxt(*this);
+  uint64_t saved_next_id;
+  uint64_t count;
+  deserialize(in, ctxt, saved_next_id);
+  deserialize(in, ctxt, count);
+  for (uint64_t i = 0; i < count; i++) {
+    object *obj = new object(this, NULL);
+    uint64_t refcount;
+    uint8_t is_leaf;
+    deserialize(in, ctxt, obj->id);
+    deserialize(in, ctxt, obj->version);
+    deserialize(in, ctxt, is_leaf);
+    deserialize(in, ctxt, refcount);
+    obj->is_leaf = is_leaf;
+    obj->refcount = refcount;
+    obj->target_is_dirty = false;
+    obj->checkpoint_version = obj->version;
+    objects.insert(obj);
+  }
+  next_id = saved_next_id;
+}
+
+void swap_space::sync_and_free_old_versions(void) {
+  backstore->sync();
+  for (size_t i = 0; i < pending_deallocations.size(); i++)
+    backstore->deallocate(pending_deallocations[i].first,
+			  pending_deallocations[i].second);
+  pending_deallocations.clear();
+  unsynced_writes = 0;
+}
+
+void swap_space::start_background_writeback(uint64_t nthreads, uint64_t window) {
+  assert(writers.empty() && nthreads > 0 && window > 0);
+  writeback_window = window;
+  for (uint64_t i = 0; i < nthreads; i++)
+    writers.push_back(std::thread(&swap_space::writer_main, this));
+}
+
+void swap_space::stop_background_writeback(void) {
+  if (writers.empty())
+    return;
+  wait_for_writebacks(NULL);
+  {
+    std::unique_lock<std::mutex> lock(writeback_mutex);
+    stop_writers = true;
+  }
+  writeback_queued.notify_all();
+  for (size_t i = 0; i < writers.size(); i++)
+    writers[i].join();
+  writers.clear();
+  stop_writers = false;
+}
+
+void swap_space::writer_main(void) {
+  std::unique_lock<std::mutex> lock(writeback_mutex);
+  while (true) {
+    while (writeback_queue.empty() && !stop_writers)
+      writeback_queued.wait(lock);
+    if (writeback_queue.empty())
+      return;
+    writeback wb = std::move(writeback_queue.front());
+    writeback_queue.pop_front();
+    lock.unlock();
+
+    wb.buffer = compress_block(compression, wb.buffer);
+    wb.bytes_stored = wb.buffer.length();
+    backstore->allocate(wb.id, wb.version);
+    std::iostream *out = backstore->get(wb.id, wb.version);
+    out->write(wb.buffer.data(), wb.buffer.length());
     backstore->put(out);
+    wb.buffer.clear();
+    wb.buffer.shrink_to_fit();
+
+    lock.lock();
+    finished_writebacks.push_back(std::move(wb));
+    writeback_finished.notify_all();
+  }
+}
+
+//snapshot the dirty objects among the next few victims and queue
+//them for the writers.
+void swap_space::queue_writebacks(void) {
+  if ((writers.empty() && !async_io) || writebacks_outstanding >= writeback_window)
+    return;
+
+  std::vector<cache_entry *> cold;
+  leaf_policy->coldest(writeback_window, cold);
+  if (internal_policy != leaf_policy && cold.size() < writeback_window)
+    internal_policy->coldest(writeback_window - cold.size(), cold);
+
+  bool submitted = false;
+  for (size_t i = 0; i < cold.size() && writebacks_outstanding < writeback_window; i++) {
+    object *obj = static_cast<object *>(cold[i]);
+    if (!obj->target_is_dirty || obj->writeback_pending)
+      continue;
+
+    serialization_context ctxt(*this);
+    std::stringstream sstream;
+    serialize(sstream, ctxt, *obj->target.load());
+    obj->is_leaf = ctxt.is_leaf;
 
-    //version 0 is the flag that the object exists only in memory.
-    if (obj->version > 0)
-      backstore->deallocate(obj->id, obj->version);
-    obj->version = new_version_id;
+    writeback wb;
+    wb.id = obj->id;
+    wb.version = obj->version + 1;
+    wb.buffer = sstream.str();
+    obj->serialized_bytes = wb.buffer.length();
+    stats.bytes_serialized += wb.buffer.length();
+    // Changes from here on make the object dirty again.
     obj->target_is_dirty = false;
+    obj->writeback_pending = true;
+    writebacks_outstanding++;
+    stats.background_writebacks++;
+
+    if (async_io) {
+      wb.buffer = compress_block(compression, wb.buffer);
+      wb.bytes_stored = wb.buffer.length();
+      backstore->allocate(wb.id, wb.version);
+      uint64_t tag = next_io_tag++;
+      backstore->submit_write(tag, wb.id, wb.version, std::move(wb.buffer));
+      wb.buffer = std::string();
+      async_writes[tag] = std::move(wb);
+      submitted = true;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(writeback_mutex);
+    writeback_queue.push_back(std::move(wb));
+    writeback_queued.notify_one();
   }
+
+  // Start the batch.
+  if (submitted)
+    reap_async_io(0);
 }
 
+void swap_space::apply_finished_writebacks(void) {
+  if (async_io)
+    reap_async_io(0);
+  std::vector<writeback> finished;
+  {
+    std::unique_lock<std::mutex> lock(writeback_mutex);
+    finished.swap(finished_writebacks);
+  }
+  for (size_t i = 0; i < finished.size(); i++) {
+    writebacks_outstanding--;
+    stats.bytes_stored += finished[i].bytes_stored;
+    object *obj = objects.find(finished[i].id);
+    if (obj == NULL) {
+      // Freed while it was being written.
+      backstore->deallocate(finished[i].id, finished[i].version);
+      continue;
+    }
+    obj->writeback_pending = false;
+    version_written(obj, finished[i].version);
+  }
+}
+
+//wait until obj's background write-back, or all of them if obj is
+//NULL, has been applied.
+void swap_space::wait_for_writebacks(swap_space::object *obj) {
+  while (obj ? obj->writeback_pending : writebacks_outstanding > 0) {
+    {
+      std::unique_lock<std::mutex> lock(writeback_mutex);
+      while (finished_writebacks.empty()) {
+	if (!async_io) {
+	  writeback_finished.wait(lock);
+	  continue;
+	}
+	lock.unlock();
+	reap_async_io(1);
+	lock.lock();
+      }
+    }
+    apply_finished_writebacks();
+  }
+}
+
+void swap_space::start_prefetching(uint64_t nthreads, uint64_t depth) {
+  assert(readers.empty() && nthreads > 0 && depth > 0);
+  prefetch_depth = depth;
+  for (uint64_t i = 0; i < nthreads; i++)
+    readers.push_back(std::thread(&swap_space::reader_main, this));
+}
+
+void swap_space::stop_prefetching(void) {
+  if (readers.empty())
+    return;
+  wait_for_prefetches(NULL);
+  {
+    std::unique_lock<std::mutex> lock(prefetch_mutex);
+    stop_readers = true;
+  }
+  prefetch_queued.notify_all();
+  for (size_t i = 0; i < readers.size(); i++)
+    readers[i].join();
+  readers.clear();
+  stop_readers = false;
+}
+
+void swap_space::reader_main(void) {
+  std::unique_lock<std::mutex> lock(prefetch_mutex);
+  while (true) {
+    while (prefetch_queue.empty() && !stop_readers)
+      prefetch_queued.wait(lock);
+    if (prefetch_queue.empty())
+      return;
+    prefetch_request req = prefetch_queue.front();
+    prefetch_queue.pop_front();
+    lock.unlock();
+
+    req.target = req.make();
+    req.serialized_bytes = read(req.id, req.version, req.image, req.target, true);
+
+    lock.lock();
+    finished_prefetches.push_back(req);
+    prefetch_finished.notify_all();
+  }
+}
+
+void swap_space::start_async_io(uint64_t window, uint64_t depth) {
+  assert(writers.empty() && readers.empty() && !async_io);
+  assert(window > 0 && depth > 0);
+  writeback_window = window;
+  prefetch_depth = depth;
+  async_io = true;
+}
+
+void swap_space::stop_async_io(void) {
+  if (!async_io)
+    return;
+  wait_for_writebacks(NULL);
+  wait_for_prefetches(NULL);
+  async_io = false;
+}
+
+//start reading a prefetch with the backing store's asynchronous I/O,
+//unless its image is retained.
+void swap_space::submit_async_read(const prefetch_request &req) {
+  if (req.image) {
+    prefetch_request r = req;
+    finish_async_read(r);
+    return;
+  }
+  uint64_t tag = next_io_tag++;
+  async_reads[tag] = req;
+  backstore->submit_read(tag, req.id, req.version);
+  reap_async_io(0);
+}
+
+void swap_space::finish_async_read(prefetch_request &req) {
+  req.target = req.make();
+  req.serialized_bytes = read(req.id, req.version, req.image, req.target, false);
+  std::unique_lock<std::mutex> lock(prefetch_mutex);
+  finished_prefetches.push_back(req);
+}
+
+//hand the asynchronous I/O that has finished over to be applied like
+//the threads', first waiting for at least min operations.
+void swap_space::reap_async_io(size_t min) {
+  std::vector<backing_store::io_completion> done;
+  backstore->poll(done, min);
+  for (size_t i = 0; i < done.size(); i++) {
+    auto w = async_writes.find(done[i].tag);
+    if (w != async_writes.end()) {
+      std::unique_lock<std::mutex> lock(writeback_mutex);
+      finished_writebacks.push_back(std::move(w->second));
+      async_writes.erase(w);
+      continue;
+    }
+    auto r = async_reads.find(done[i].tag);
+    assert(r != async_reads.end());
+    prefetch_request req = r->second;
+    async_reads.erase(r);
+    req.image = done[i].block;
+    finish_async_read(req);
+  }
+}
+
+//put prefetched objects in the cache.  Nothing can load or free an
+//object while it's being prefetched, so the results are never stale.
+void swap_space::apply_finished_prefetches(void) {
+  if (async_io)
+    reap_async_io(0);
+  std::vector<prefetch_request> finished;
+  {
+    std::unique_lock<std::mutex> lock(prefetch_mutex);
+    finished.swap(finished_prefetches);
+  }
+  for (size_t i = 0; i < finished.size(); i++) {
+    prefetches_outstanding--;
+    object *obj = objects.find(finished[i].id);
+    assert(obj != NULL && obj->prefetch_pending && obj->target == NULL &&
+	   obj->version == finished[i].version);
+    obj->prefetch_pending = false;
+    // If it's pinned, its first use is already underway.
+    obj->prefetched = obj->pincount == 0;
+    if (!obj->prefetched)
+      stats.prefetch_hits++;
+    obj->target = finished[i].target;
+    obj->serialized_bytes = finished[i].serialized_bytes;
+    retain_image(obj, finished[i].image);
+    current_in_memory_objects++;
+    cache_admit(obj);
+    charge(obj);
+    if (obj->pincount == 0)
+      obj->policy->release(obj);
+  }
+}
+
+//wait until obj's prefetch, or all of them if obj is NULL, has been
+//applied.
+void swap_space::wait_for_prefetches(swap_space::object *obj) {
+  while (obj ? obj->prefetch_pending : prefetches_outstanding > 0) {
+    {
+      std::unique_lock<std::mutex> lock(prefetch_mutex);
+      while (finished_prefetches.empty()) {
+	if (!async_io) {
+	  prefetch_finished.wait(lock);
+	  continue;
+	}
+	lock.unlock();
+	reap_async_io(1);
+	lock.lock();
+      }
+    }
+    apply_finished_prefetches();
+  }
+}
 
 //attempt to evict an unused object from the swap space
-//objects in swap space are referenced in a priority queue
-//pull objects with low counts first to try and find an object with pincount 0.
+//the policies only offer unpinned objects; leaves go first if
+//internal nodes are favored.  Dirty victims are written back first,
+//unless a background write-back already has them covered.
 void swap_space::maybe_evict_something(void)
 {
-  while (current_in_memory_objects > max_in_memory_objects) {
-    object *obj = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it)
-      if ((*it)->pincount == 0) {
-	obj = *it;
-	break;
-      }
-    if (obj == NULL)
-      return;
-    lru_pqueue.erase(obj);
+  if (!writers.empty() || async_io)
+    apply_finished_writebacks();
+  if (!readers.empty() || async_io)
+    apply_finished_prefetches();
+
+  bool evicted = false;
+  bool over_bytes = false;
+  while (current_in_memory_objects > max_in_memory_objects ||
+	 current_in_memory_bytes > max_in_memory_bytes) {
+    over_bytes |= current_in_memory_bytes > max_in_memory_bytes;
+    cache_entry *victim = leaf_policy->victim();
+    if (victim == NULL && internal_policy != leaf_policy)
+      victim = internal_policy->victim();
+    if (victim == NULL)
+      break;
+    object *obj = static_cast<object *>(victim);
+    assert(obj->pincount == 0 && obj->target != NULL);
+    obj->policy->evict(obj);
+    obj->prefetched = false;
 
-    write_back(obj);
-    
-    delete obj->target;
+    if (obj->writeback_pending)
+      wait_for_writebacks(obj);
+    stats.evictions++;
+    if (obj->target_is_dirty) {
+      stats.dirty_evictions++;
+      write_back(obj);
+    }
+
+    detaching = true;
+    delete obj->target.load();
+    detaching = false;
     obj->target = NULL;
     current_in_memory_objects--;
+    current_in_memory_bytes -= obj->bytes;
+    obj->bytes = 0;
+    evicted = true;
+  }
+
+  // The cache is full, so get the next victims cleaned.
+  if (evicted)
+    queue_writebacks();
+
+  // Policies size their queues in objects.  When the byte budget is
+  // what's binding, tell them how many objects it currently fits.
+  if (over_bytes) {
+    uint64_t c = std::min(max_in_memory_objects,
+			  std::max<uint64_t>(current_in_memory_objects, 1));
+    leaf_policy->set_capacity(c);
+    internal_policy->set_capacity(c);
   }
 }
 